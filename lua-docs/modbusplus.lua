@@ -3,8 +3,8 @@
 --- @class ModbusDevice
 local ModbusDevice = {}
 
---- @alias ModbusDevice.RtuConfig { device: string, baud: integer, parity?: "N" | "E" | "O", data_bits?: 5 | 6 | 7 | 8, stop_bits?: 1 | 2, flowctrl?: "None" | "HW" | "SW" }
---- @alias ModbusDevice.TcpConfig { ip: string, port: integer }
+--- @alias ModbusDevice.RtuConfig { device: string, baud: integer, parity?: "N" | "E" | "O", data_bits?: 5 | 6 | 7 | 8, stop_bits?: 1 | 2, flowctrl?: "None" | "HW" | "SW", turnaround_ms?: integer }
+--- @alias ModbusDevice.TcpConfig { ip: string, port: integer, rtt_ms?: integer, window?: integer, async?: boolean }
 
 --- Creates a new ModbusDevice object.
 --- @param config ModbusDevice.RtuConfig Configuration for the Modbus device.
@@ -12,6 +12,8 @@ local ModbusDevice = {}
 function ModbusDevice.newRtu(config) end
 
 --- Creates a new ModbusDevice object.
+--- With a `window`, requests are framed without libmodbus and up to `window` of them are in flight at once. A `window` of 0, the default, leaves requests to libmodbus.
+--- With `async`, the connection is driven by a shared event loop thread, which also reconnects it after a failure.
 --- @param config ModbusDevice.TcpConfig Configuration for the Modbus device.
 --- @return ModbusDevice
 function ModbusDevice.newTcp(config) end
@@ -81,6 +83,38 @@ function ModbusDevice:raw_write_register(addr, value) end
 --- @return nil
 function ModbusDevice:raw_write_registers(addr, values) end
 
+--- Changes bits of the holding register at addr with a mask write (FC22).
+--- The register becomes (current AND and_mask) OR (or_mask AND NOT and_mask).
+--- Falls back to a read followed by a write if the device does not support FC22.
+--- @param addr integer Address of the register to write.
+--- @param and_mask integer Bits to keep (0-65535).
+--- @param or_mask integer Bits to set among those not kept (0-65535).
+--- @return integer # Number of registers written.
+function ModbusDevice:raw_mask_write_register(addr, and_mask, or_mask) end
+
+--- Saves what has been learned about each slave, such as the largest request it accepts and whether it supports
+--- mask writes (FC22) and read/write multiple registers (FC23), so it doesn't have to be learned again.
+--- @param path string Path of the JSON file to write.
+--- @return nil
+function ModbusDevice:save_profile(path) end
+
+--- Loads a profile written by save_profile().
+--- @param path string Path of the JSON file to read.
+--- @return nil
+function ModbusDevice:load_profile(path) end
+
+--- @alias ModbusDevice.BusStats { frames: integer, errors: integer, busy_ms: number, gap_ms: number, elapsed_ms: number, occupancy: number }
+
+--- Gets the use of the bus since the device was created or the statistics were reset. `busy_ms` is the time from each
+--- request to its response, `gap_ms` the time spent waiting for the silent interval required between RTU frames and
+--- `occupancy` the share of `elapsed_ms` spent on both.
+--- @return ModbusDevice.BusStats
+function ModbusDevice:bus_stats() end
+
+--- Resets the statistics returned by bus_stats().
+--- @return nil
+function ModbusDevice:reset_bus_stats() end
+
 --- Creates a new context for high-level operations based on the provided configuration.
 --- @param mapping_path string Path to the mapping file for this context.
 --- @param device_id integer? Device ID for the context.
@@ -101,20 +135,104 @@ function ModbusDeviceContext:connect() end
 function ModbusDeviceContext:close() end
 
 --- Reads the value associated with the given name from the context.
---- @param name string Name of the variable to read.
+--- @param name string|integer Name of the variable to read, or a handle from ModbusDeviceContext:handle().
 --- @return any # The value associated with the name, type depends on the mapping configuration.
 function ModbusDeviceContext:read(name) end
 
+--- Resolves a name once so that read and write can skip looking it up.
+--- Handles are only valid for contexts using the same mapping file.
+--- @param name string Name of the variable.
+--- @return integer # The handle.
+function ModbusDeviceContext:handle(name) end
+
+--- Reads a bitfield of up to three registers as a single integer, bit 0 being the lowest bit of the first register.
+--- @param name string|integer Name of the bitfield, or a handle from ModbusDeviceContext:handle().
+--- @return integer # The raw bits.
+function ModbusDeviceContext:read_mask(name) end
+
+--- Reads a bitfield into an existing table, setting each flag to true or false, so polling loops can reuse one table.
+--- @param name string|integer Name of the bitfield, or a handle from ModbusDeviceContext:handle().
+--- @param flags table<string, boolean> The table to fill.
+--- @return table<string, boolean> # The same table.
+function ModbusDeviceContext:read_into(name, flags) end
+
+--- Reads several values at once, merging adjacent registers into as few requests as possible.
+--- Small gaps between values are read as well when that is cheaper than another request.
+--- @param names string[] Names of the variables to read.
+--- @return table<string, any> # The values keyed by name.
+function ModbusDeviceContext:read_many(names) end
+
+--- Compiles the given names, or every value in the mapping, into a reusable read plan.
+--- @param names string[]? Names of the variables to read, defaults to the whole mapping.
+--- @return ModbusReadPlan
+function ModbusDeviceContext:compile(names) end
+
+--- Executes a read plan compiled by this context.
+--- @param plan ModbusReadPlan Plan to execute.
+--- @param values table<string, any>? Table to fill with the values, a new table is created if omitted.
+--- @return table<string, any> # The values keyed by name.
+function ModbusDeviceContext:read_plan(plan, values) end
+
+--- Reads every value in the mapping with a plan compiled on first use.
+--- @param values table<string, any>? Table to fill with the values, a new table is created if omitted.
+--- @return table<string, any> # The values keyed by name.
+function ModbusDeviceContext:read_all(values) end
+
 --- Writes the given data to the variable associated with the given name in the context.
---- @param name string Name of the variable to write to.
+--- Bitfields are written as a table of flag name to boolean, flags left out keep their state.
+--- Enums can be written by label or by value, strings shorter than the mapping are padded with null characters.
+--- @param name string|integer Name of the variable to write to, or a handle from ModbusDeviceContext:handle().
 --- @param data any Data to write, type depends on the mapping configuration.
 --- @return nil
 function ModbusDeviceContext:write(name, data) end
 
+--- Writes several values at once, values at contiguous addresses share a single request.
+--- @param values table<string, any> Data to write keyed by variable name.
+--- @return nil
+function ModbusDeviceContext:write_many(values) end
+
+--- Writes values then reads values back. When the writes and the reads each cover one contiguous run of holding
+--- registers, this is a single read/write multiple registers (FC23) transaction, otherwise separate writes and reads.
+--- @param writes table<string, any> Data to write keyed by variable name.
+--- @param reads string[] Names of the variables to read.
+--- @return table<string, any> # The values read keyed by name.
+function ModbusDeviceContext:exchange(writes, reads) end
+
+--- Drops every value cached because of a `max_age_ms` in the mapping, and the bitfield registers kept for devices
+--- without mask writes (FC22), which otherwise are only read before the first write.
+--- @return nil
+function ModbusDeviceContext:clear_cache() end
+
+--- Polls values on a background thread at a fixed period. Can be called several times with different periods.
+--- The device must stay connected while polling.
+--- @param period_ms integer Time between two polls in milliseconds.
+--- @param plan ModbusReadPlan|string[]? Plan or names of the variables to poll, defaults to the whole mapping.
+--- @return nil
+function ModbusDeviceContext:poll(period_ms, plan) end
+
+--- Stops polling. Values polled so far are dropped.
+--- @return nil
+function ModbusDeviceContext:stop_polling() end
+
+--- Gets the last polled value of a variable without waiting on the device.
+--- @param name string|integer Name of the variable, or a handle from ModbusDeviceContext:handle().
+--- @return any # The value, or nil if it has not been polled yet.
+--- @return integer? # Milliseconds since the value was read.
+function ModbusDeviceContext:latest(name) end
+
+--- Gets the last polled value of every variable polled so far.
+--- @return table<string, any> # The values keyed by name.
+function ModbusDeviceContext:latest_all() end
+
 --- Executes a transaction function within the context.
 --- Automatically handles connection management.
 --- @param fn fun(ctx: ModbusDeviceContext): nil Function to execute within the transaction.
 --- @return nil
 function ModbusDeviceContext:tx(fn) end
 
+--- A precompiled set of reads, created by ModbusDeviceContext:compile().
+--- The length operator returns the number of values in the plan.
+--- @class ModbusReadPlan
+local ModbusReadPlan = {}
+
 return ModbusDevice
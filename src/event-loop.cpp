@@ -0,0 +1,645 @@
+#include "event-loop.hpp"
+#include <modbus/modbus.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <system_error>
+
+namespace {
+// Connections are keyed by their id, which never reaches these
+constexpr uint64_t WAKEUP_KEY = UINT64_MAX;
+constexpr uint64_t TIMER_KEY = UINT64_MAX - 1;
+
+constexpr int MAX_EVENTS = 64;
+
+void addToEpoll(int epoll, int fd, uint64_t key) {
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.u64 = key;
+	if (::epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == -1) {
+		throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+	}
+}
+}  // namespace
+
+EventLoop::EventLoop() {
+	m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+	m_timer = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	m_wakeup = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	try {
+		if (m_epoll == -1 || m_timer == -1 || m_wakeup == -1) {
+			throw std::system_error(errno, std::generic_category(),
+									"Failed to create the event loop");
+		}
+		addToEpoll(m_epoll, m_wakeup, WAKEUP_KEY);
+		addToEpoll(m_epoll, m_timer, TIMER_KEY);
+	} catch (...) {
+		for (const int fd : {m_epoll, m_timer, m_wakeup}) {
+			if (fd != -1) {
+				::close(fd);
+			}
+		}
+		throw;
+	}
+
+	m_thread = std::thread(&EventLoop::run, this);
+}
+
+EventLoop::~EventLoop() {
+	if (std::this_thread::get_id() == m_thread.get_id()) {
+		// Released by one of its callbacks, run() returns once it is done
+		*m_destroyed = true;
+		m_thread.detach();
+	} else {
+		m_stopping = true;
+		wake();
+		m_thread.join();
+	}
+
+	for (auto& entry : m_connections) {
+		if (entry.second->fd != -1) {
+			::close(entry.second->fd);
+		}
+	}
+	::close(m_wakeup);
+	::close(m_timer);
+	::close(m_epoll);
+}
+
+std::shared_ptr<EventLoop> EventLoop::shared() {
+	// Held weakly, a module unloaded with the loop still running would crash
+	static std::mutex mutex;
+	static std::weak_ptr<EventLoop> instance;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto loop = instance.lock();
+	if (!loop) {
+		loop = std::make_shared<EventLoop>();
+		instance = loop;
+	}
+	return loop;
+}
+
+EventLoop::ConnectionId EventLoop::open(
+	const std::string& host,
+	int port,
+	const ConnectionOptions& options,
+	std::function<void(int error)> onConnect) {
+	auto conn = std::make_unique<Connection>();
+	conn->options = options;
+	conn->options.window = std::max(options.window, 1u);
+	conn->onConnect = std::move(onConnect);
+
+	// Resolved once here, so the loop never blocks on a name server
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* infos = nullptr;
+	const std::string service = std::to_string(port);
+	const int rc = ::getaddrinfo(host.c_str(), service.c_str(), &hints, &infos);
+	if (rc != 0) {
+		throw std::runtime_error("Failed to resolve " + host + ": " +
+								 gai_strerror(rc));
+	}
+	for (addrinfo* info = infos; info; info = info->ai_next) {
+		Address address = {};
+		address.family = info->ai_family;
+		address.size = info->ai_addrlen;
+		memcpy(&address.addr, info->ai_addr, info->ai_addrlen);
+		conn->addresses.push_back(address);
+	}
+	::freeaddrinfo(infos);
+
+	const ConnectionId id = m_nextConnection++;
+	conn->id = id;
+	runSync([this, &conn] {
+		Connection& added = *conn;
+		m_connections.emplace(added.id, std::move(conn));
+		startConnect(added, Clock::now());
+	});
+	++m_connectionCount;
+	return id;
+}
+
+void EventLoop::close(ConnectionId id) {
+	runSync([this, id] {
+		auto it = m_connections.find(id);
+		if (it == m_connections.end()) {
+			return;
+		}
+
+		Connection& conn = *it->second;
+		if (conn.fd != -1) {
+			::close(conn.fd);
+		}
+		fail(conn, ECANCELED);
+		m_connections.erase(it);
+		--m_connectionCount;
+		runCallbacks();
+	});
+}
+
+void EventLoop::submit(ConnectionId id,
+					   uint8_t unit,
+					   mbap::Transaction* transactions,
+					   size_t count,
+					   std::function<void()> done) {
+	auto batch = std::make_shared<Batch>(Batch{count, std::move(done)});
+	post([this, id, unit, transactions, count, batch] {
+		if (count == 0) {
+			m_callbacks.push_back(std::move(batch->done));
+			return;
+		}
+
+		auto it = m_connections.find(id);
+		Connection* conn =
+			it != m_connections.end() ? it->second.get() : nullptr;
+		for (size_t i = 0; i < count; ++i) {
+			Request request = {batch, &transactions[i], unit, {}};
+			if (!conn || conn->state == Connection::State::Idle) {
+				complete(request, ENOTCONN);
+			} else {
+				conn->queue.push_back(request);
+			}
+		}
+		if (conn && conn->state == Connection::State::Connected) {
+			pump(*conn);
+		}
+	});
+}
+
+EventLoop::TimerId EventLoop::addTimer(std::chrono::milliseconds period,
+									   std::function<void()> callback) {
+	const TimerId id = m_nextTimer++;
+	post([this, id, period, callback = std::move(callback)]() mutable {
+		m_timers.push_back(
+			Timer{id, period, Clock::now(), std::move(callback)});
+	});
+	return id;
+}
+
+void EventLoop::removeTimer(TimerId id) {
+	runSync([this, id] {
+		m_timers.erase(
+			std::remove_if(m_timers.begin(), m_timers.end(),
+						   [id](const Timer& timer) { return timer.id == id; }),
+			m_timers.end());
+	});
+}
+
+void EventLoop::post(std::function<void()> fn) {
+	{
+		std::lock_guard<std::mutex> lock(m_postedMutex);
+		m_posted.push_back(std::move(fn));
+	}
+	wake();
+}
+
+void EventLoop::runSync(const std::function<void()>& fn) {
+	if (std::this_thread::get_id() == m_thread.get_id()) {
+		fn();
+		return;
+	}
+
+	std::promise<void> done;
+	auto future = done.get_future();
+	post([&fn, &done] {
+		try {
+			fn();
+			done.set_value();
+		} catch (...) {
+			done.set_exception(std::current_exception());
+		}
+	});
+	future.get();
+}
+
+void EventLoop::wake() noexcept {
+	const uint64_t one = 1;
+	while (::write(m_wakeup, &one, sizeof(one)) == -1 && errno == EINTR) {
+	}
+}
+
+void EventLoop::run() {
+	bool destroyed = false;
+	m_destroyed = &destroyed;
+
+	epoll_event events[MAX_EVENTS];
+	while (!m_stopping) {
+		armTimer();
+		const int count = ::epoll_wait(m_epoll, events, MAX_EVENTS, -1);
+		if (count == -1) {
+			continue;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			const uint64_t key = events[i].data.u64;
+			uint64_t value;
+			if (key == WAKEUP_KEY) {
+				while (::read(m_wakeup, &value, sizeof(value)) == -1 &&
+					   errno == EINTR) {
+				}
+				if (!runPosted()) {
+					return;
+				}
+			} else if (key == TIMER_KEY) {
+				while (::read(m_timer, &value, sizeof(value)) == -1 &&
+					   errno == EINTR) {
+				}
+				m_armed = Clock::time_point::max();
+			} else {
+				// Unless closed by a callback of an earlier event
+				auto it = m_connections.find(static_cast<ConnectionId>(key));
+				if (it != m_connections.end()) {
+					handle(*it->second, events[i].events);
+				}
+			}
+			if (!runCallbacks()) {
+				return;
+			}
+		}
+
+		const auto now = Clock::now();
+		expire(now);
+		if (!runCallbacks() || !runTimers(now)) {
+			return;
+		}
+	}
+}
+
+bool EventLoop::runPosted() {
+	bool* const destroyed = m_destroyed;
+	std::vector<std::function<void()>> posted;
+	{
+		std::lock_guard<std::mutex> lock(m_postedMutex);
+		posted.swap(m_posted);
+	}
+	for (auto& fn : posted) {
+		fn();
+		if (*destroyed) {
+			return false;
+		}
+	}
+	// Dropping them may release the last reference to the loop
+	posted.clear();
+	return !*destroyed;
+}
+
+bool EventLoop::runTimers(Clock::time_point now) {
+	bool* const destroyed = m_destroyed;
+	// By index and id, callbacks may add or remove timers
+	for (size_t i = 0; i < m_timers.size(); ++i) {
+		if (m_timers[i].due > now) {
+			continue;
+		}
+
+		const TimerId id = m_timers[i].id;
+		auto callback = std::move(m_timers[i].callback);
+		callback();
+		if (*destroyed) {
+			return false;
+		}
+
+		auto it =
+			std::find_if(m_timers.begin(), m_timers.end(),
+						 [id](const Timer& timer) { return timer.id == id; });
+		if (it == m_timers.end()) {
+			callback = nullptr;
+			if (*destroyed) {
+				return false;
+			}
+			continue;
+		}
+		it->callback = std::move(callback);
+
+		// Periods missed while the loop was busy are skipped, not caught up
+		it->due += it->period;
+		if (it->due <= now) {
+			it->due = now + it->period;
+		}
+	}
+	return true;
+}
+
+bool EventLoop::runCallbacks() {
+	bool* const destroyed = m_destroyed;
+	while (!m_callbacks.empty()) {
+		std::vector<std::function<void()>> callbacks;
+		callbacks.swap(m_callbacks);
+		for (auto& callback : callbacks) {
+			if (callback) {
+				callback();
+				if (*destroyed) {
+					return false;
+				}
+			}
+		}
+		callbacks.clear();
+		if (*destroyed) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void EventLoop::expire(Clock::time_point now) {
+	for (auto& entry : m_connections) {
+		Connection& conn = *entry.second;
+		switch (conn.state) {
+			case Connection::State::Idle:
+				if (conn.deadline <= now) {
+					startConnect(conn, now);
+				}
+				break;
+			case Connection::State::Connecting:
+				if (conn.deadline <= now) {
+					disconnect(conn, ETIMEDOUT);
+				}
+				break;
+			case Connection::State::Connected:
+				// Sent in order with the same timeout, the oldest expires first
+				if (conn.inFlight.empty() ||
+					conn.inFlight.front().deadline > now) {
+					break;
+				}
+				while (!conn.inFlight.empty() &&
+					   conn.inFlight.front().deadline <= now) {
+					complete(conn.inFlight.front(), ETIMEDOUT);
+					conn.inFlight.erase(conn.inFlight.begin());
+				}
+				pump(conn);
+				break;
+		}
+	}
+}
+
+void EventLoop::armTimer() {
+	auto next = Clock::time_point::max();
+	for (const auto& timer : m_timers) {
+		next = std::min(next, timer.due);
+	}
+	for (const auto& entry : m_connections) {
+		const Connection& conn = *entry.second;
+		if (conn.state != Connection::State::Connected) {
+			next = std::min(next, conn.deadline);
+		} else if (!conn.inFlight.empty()) {
+			next = std::min(next, conn.inFlight.front().deadline);
+		}
+	}
+	if (next == m_armed) {
+		return;
+	}
+
+	// steady_clock is CLOCK_MONOTONIC on Linux, its time points are absolute
+	// times of the timerfd. A zero value would disarm it.
+	itimerspec spec = {};
+	if (next != Clock::time_point::max()) {
+		const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+							next.time_since_epoch())
+							.count();
+		spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+		spec.it_value.tv_nsec = std::max<long>(ns % 1000000000, 1);
+	}
+	::timerfd_settime(m_timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+	m_armed = next;
+}
+
+void EventLoop::handle(Connection& conn, uint32_t events) {
+	switch (conn.state) {
+		case Connection::State::Idle:
+			break;
+		case Connection::State::Connecting:
+			finishConnect(conn);
+			break;
+		case Connection::State::Connected:
+			if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				receive(conn);
+			}
+			if (conn.state == Connection::State::Connected &&
+				(events & EPOLLOUT)) {
+				flushOutput(conn);
+			}
+			break;
+	}
+}
+
+void EventLoop::startConnect(Connection& conn, Clock::time_point now) {
+	if (conn.addresses.empty()) {
+		conn.state = Connection::State::Connecting;
+		disconnect(conn, EHOSTUNREACH);
+		return;
+	}
+	const Address& address = conn.addresses[conn.nextAddress];
+	conn.nextAddress = (conn.nextAddress + 1) % conn.addresses.size();
+
+	conn.state = Connection::State::Connecting;
+	conn.deadline = now + std::chrono::milliseconds(conn.options.timeoutMs);
+	conn.fd = ::socket(address.family,
+					   SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn.fd == -1) {
+		disconnect(conn, errno);
+		return;
+	}
+
+	// Requests are small and sent back to back, Nagle would hold them back
+	const int one = 1;
+	::setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (::connect(conn.fd, reinterpret_cast<const sockaddr*>(&address.addr),
+				  address.size) == 0) {
+		finishConnect(conn);
+	} else if (errno == EINPROGRESS) {
+		watch(conn, true);
+	} else {
+		disconnect(conn, errno);
+	}
+}
+
+void EventLoop::finishConnect(Connection& conn) {
+	int error = 0;
+	socklen_t size = sizeof(error);
+	if (::getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1) {
+		error = errno;
+	}
+	if (error != 0) {
+		disconnect(conn, error);
+		return;
+	}
+
+	conn.state = Connection::State::Connected;
+	conn.inputSize = 0;
+	watch(conn, false);
+	if (conn.onConnect) {
+		m_callbacks.push_back([callback = conn.onConnect] { callback(0); });
+	}
+	pump(conn);
+}
+
+void EventLoop::disconnect(Connection& conn, int error) {
+	const bool wasConnected = conn.state == Connection::State::Connected;
+	if (conn.fd != -1) {
+		::close(conn.fd);
+		conn.fd = -1;
+	}
+	conn.watched = false;
+	fail(conn, error);
+
+	// A link that dropped is reestablished at once, a failed attempt only
+	// after a pause, so a server that is down isn't hammered
+	conn.state = Connection::State::Idle;
+	conn.deadline = Clock::now();
+	if (!wasConnected) {
+		conn.deadline += std::chrono::milliseconds(conn.options.reconnectMs);
+		if (conn.onConnect) {
+			m_callbacks.push_back(
+				[callback = conn.onConnect, error] { callback(error); });
+		}
+	}
+}
+
+void EventLoop::pump(Connection& conn) {
+	const auto deadline =
+		Clock::now() + std::chrono::milliseconds(conn.options.timeoutMs);
+	while (!conn.queue.empty() &&
+		   conn.inFlight.size() < conn.options.window) {
+		Request request = std::move(conn.queue.front());
+		conn.queue.pop_front();
+
+		mbap::Transaction& tx = *request.tx;
+		tx.id = conn.nextId++;
+		tx.error = 0;
+		const size_t offset = conn.output.size();
+		conn.output.resize(offset + mbap::MAX_FRAME_SIZE);
+		const size_t size =
+			mbap::encode(tx, request.unit, conn.output.data() + offset);
+		conn.output.resize(offset + size);
+		if (size == 0) {
+			complete(request, EMBMDATA);
+			continue;
+		}
+
+		tx.pending = true;
+		request.deadline = deadline;
+		conn.inFlight.push_back(std::move(request));
+	}
+	flushOutput(conn);
+}
+
+void EventLoop::flushOutput(Connection& conn) {
+	while (conn.outputSent < conn.output.size()) {
+		const ssize_t rc =
+			::send(conn.fd, conn.output.data() + conn.outputSent,
+				   conn.output.size() - conn.outputSent, MSG_NOSIGNAL);
+		if (rc >= 0) {
+			conn.outputSent += static_cast<size_t>(rc);
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			// The rest goes once the socket has room
+			watch(conn, true);
+			return;
+		} else if (errno != EINTR) {
+			disconnect(conn, errno);
+			return;
+		}
+	}
+	conn.output.clear();
+	conn.outputSent = 0;
+	watch(conn, false);
+}
+
+void EventLoop::receive(Connection& conn) {
+	for (;;) {
+		const ssize_t rc =
+			::recv(conn.fd, conn.input.data() + conn.inputSize,
+				   conn.input.size() - conn.inputSize, 0);
+		if (rc == 0) {
+			disconnect(conn, ECONNRESET);
+			return;
+		}
+		if (rc == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				disconnect(conn, errno);
+				return;
+			}
+			break;
+		}
+		conn.inputSize += static_cast<size_t>(rc);
+
+		while (conn.inputSize >= mbap::HEADER_SIZE) {
+			uint16_t id;
+			size_t size;
+			if (!mbap::parse_header(conn.input.data(), id, size)) {
+				// Out of sync, only a new connection recovers from that
+				disconnect(conn, EMBBADDATA);
+				return;
+			}
+			if (conn.inputSize < size) {
+				break;
+			}
+
+			// Responses to requests that timed out are dropped
+			auto it = std::find_if(
+				conn.inFlight.begin(), conn.inFlight.end(),
+				[id](const Request& request) { return request.tx->id == id; });
+			if (it != conn.inFlight.end()) {
+				mbap::decode(*it->tx, conn.input.data(), size);
+				complete(*it, 0);
+				conn.inFlight.erase(it);
+			}
+
+			conn.inputSize -= size;
+			memmove(conn.input.data(), conn.input.data() + size,
+					conn.inputSize);
+		}
+	}
+	pump(conn);
+}
+
+void EventLoop::watch(Connection& conn, bool output) {
+	if (conn.watched && conn.watchingOutput == output) {
+		return;
+	}
+
+	epoll_event event = {};
+	event.events = EPOLLIN | (output ? EPOLLOUT : 0u);
+	event.data.u64 = conn.id;
+	::epoll_ctl(m_epoll, conn.watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn.fd,
+				&event);
+	conn.watched = true;
+	conn.watchingOutput = output;
+}
+
+void EventLoop::fail(Connection& conn, int error) {
+	for (auto& request : conn.inFlight) {
+		complete(request, error);
+	}
+	conn.inFlight.clear();
+	for (auto& request : conn.queue) {
+		complete(request, error);
+	}
+	conn.queue.clear();
+	conn.output.clear();
+	conn.outputSent = 0;
+	conn.inputSize = 0;
+}
+
+void EventLoop::complete(Request& request, int error) {
+	if (error != 0) {
+		request.tx->error = error;
+	}
+	request.tx->pending = false;
+	if (--request.batch->left == 0) {
+		m_callbacks.push_back(std::move(request.batch->done));
+	}
+}
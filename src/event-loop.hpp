@@ -0,0 +1,231 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "mbap.hpp"
+
+/**
+ * Drives many Modbus/TCP connections from a single thread, with non-blocking
+ * sockets watched by epoll and every deadline on one timerfd. Connections
+ * are reestablished on their own after a failure, and requests that go
+ * unanswered time out.
+ *
+ * Requests are submitted in batches from any thread. Completions and timers
+ * run on the loop thread, so they must not block.
+ */
+class EventLoop {
+   public:
+	using ConnectionId = uint32_t;
+	using TimerId = uint64_t;
+
+	struct ConnectionOptions {
+		unsigned int window = 1;		 // Requests in flight at once
+		unsigned int timeoutMs = 500;	 // For the connection and responses
+		unsigned int reconnectMs = 1000;  // Between two connection attempts
+	};
+
+	EventLoop();
+
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	~EventLoop();
+
+	/**
+	 * Gets the loop shared by every asynchronous device. It only lives as
+	 * long as someone holds it, like the shared PollScheduler.
+	 * @return The shared loop.
+	 */
+	static std::shared_ptr<EventLoop> shared();
+
+	/**
+	 * Opens a connection, which keeps being reestablished until closed.
+	 * @param host The address or host name of the server.
+	 * @param port The TCP port of the server.
+	 * @param options The window and timeouts of the connection.
+	 * @param onConnect Called on the loop thread with the result of each
+	 * attempt, 0 once connected.
+	 * @return The id of the connection.
+	 * @throws std::runtime_error If the host can't be resolved.
+	 */
+	ConnectionId open(const std::string& host,
+					  int port,
+					  const ConnectionOptions& options,
+					  std::function<void(int error)> onConnect = nullptr);
+
+	/**
+	 * Closes a connection. Requests still in progress fail with ECANCELED,
+	 * and are done before this returns.
+	 */
+	void close(ConnectionId id);
+
+	/**
+	 * Submits transactions to send on a connection. Each ends up with its
+	 * response decoded or its error set, ENOTCONN if the connection is down.
+	 * @param id The connection.
+	 * @param unit The unit id to address.
+	 * @param transactions The transactions, which must stay valid until done
+	 * is called.
+	 * @param count The number of transactions.
+	 * @param done Called on the loop thread once all of them are complete.
+	 */
+	void submit(ConnectionId id,
+				uint8_t unit,
+				mbap::Transaction* transactions,
+				size_t count,
+				std::function<void()> done);
+
+	/**
+	 * Calls a function on the loop thread at a fixed period, the first time
+	 * immediately.
+	 * @return An id to remove the timer with.
+	 */
+	TimerId addTimer(std::chrono::milliseconds period,
+					 std::function<void()> callback);
+
+	/**
+	 * Removes a timer. Once this returns, the callback is not running and
+	 * won't be called again.
+	 */
+	void removeTimer(TimerId id);
+
+	size_t getConnectionCount() const noexcept { return m_connectionCount; }
+
+   private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Batch {
+		size_t left;
+		std::function<void()> done;
+	};
+
+	struct Request {
+		std::shared_ptr<Batch> batch;
+		mbap::Transaction* tx;
+		uint8_t unit;
+		Clock::time_point deadline;
+	};
+
+	struct Address {
+		int family;
+		sockaddr_storage addr;
+		socklen_t size;
+	};
+
+	struct Connection {
+		// Idle until the next attempt, at the deadline
+		enum class State { Idle, Connecting, Connected };
+
+		ConnectionId id;
+		std::vector<Address> addresses;	 // Tried in turn
+		size_t nextAddress = 0;
+		ConnectionOptions options;
+		std::function<void(int)> onConnect;
+
+		State state = State::Idle;
+		int fd = -1;
+		bool watched = false;
+		bool watchingOutput = false;
+		Clock::time_point deadline;	 // Of the connection attempt, or retry
+		uint16_t nextId = 0;
+		std::deque<Request> queue;
+		std::vector<Request> inFlight;
+		std::vector<uint8_t> output;
+		size_t outputSent = 0;
+		std::array<uint8_t, mbap::MAX_FRAME_SIZE * 4> input;
+		size_t inputSize = 0;
+	};
+
+	struct Timer {
+		TimerId id;
+		std::chrono::milliseconds period;
+		Clock::time_point due;
+		std::function<void()> callback;
+	};
+
+	/** Runs a function on the loop thread, without waiting for it. */
+	void post(std::function<void()> fn);
+
+	/** Runs a function on the loop thread and waits for it to return. */
+	void runSync(const std::function<void()>& fn);
+
+	/** Wakes the loop up from epoll_wait(). */
+	void wake() noexcept;
+
+	void run();
+
+	/**
+	 * Callbacks may release the last reference to the loop, which is then
+	 * destroyed on its own thread. These return false once it is, and must
+	 * not touch it anymore.
+	 */
+	bool runPosted();
+	bool runTimers(Clock::time_point now);
+
+	/** Runs the callbacks deferred while handling an event. */
+	bool runCallbacks();
+
+	/** Handles the connection deadlines that have passed. */
+	void expire(Clock::time_point now);
+
+	/** Arms the timerfd for the earliest deadline. */
+	void armTimer();
+
+	void handle(Connection& conn, uint32_t events);
+	void startConnect(Connection& conn, Clock::time_point now);
+	void finishConnect(Connection& conn);
+
+	/**
+	 * Closes the socket and fails every request. A connection that was up is
+	 * reestablished right away, a failed attempt is retried later.
+	 */
+	void disconnect(Connection& conn, int error);
+
+	/** Sends queued requests while the window allows. */
+	void pump(Connection& conn);
+	void flushOutput(Connection& conn);
+	void receive(Connection& conn);
+	void watch(Connection& conn, bool output);
+
+	/** Fails every request of a connection. */
+	void fail(Connection& conn, int error);
+
+	/**
+	 * Completes a request with the error given, or as decoded if 0. The
+	 * completion of its batch is deferred to runCallbacks().
+	 */
+	void complete(Request& request, int error);
+
+	int m_epoll = -1;
+	int m_timer = -1;
+	int m_wakeup = -1;
+	std::thread m_thread;
+	std::atomic<bool> m_stopping{false};
+	// Set by the destructor when run from a callback, points into run()
+	bool* m_destroyed = nullptr;
+
+	std::mutex m_postedMutex;
+	std::vector<std::function<void()>> m_posted;
+
+	// Owned by the loop thread
+	std::unordered_map<ConnectionId, std::unique_ptr<Connection>> m_connections;
+	std::vector<Timer> m_timers;
+	std::vector<std::function<void()>> m_callbacks;
+	Clock::time_point m_armed = Clock::time_point::max();
+
+	std::atomic<ConnectionId> m_nextConnection{1};
+	std::atomic<TimerId> m_nextTimer{1};
+	std::atomic<size_t> m_connectionCount{0};
+};
@@ -23,6 +23,11 @@ static int lua_mbdevice_write_bit(lua_State* L);
 static int lua_mbdevice_write_bits(lua_State* L);
 static int lua_mbdevice_write_register(lua_State* L);
 static int lua_mbdevice_write_registers(lua_State* L);
+static int lua_mbdevice_mask_write_register(lua_State* L);
+static int lua_mbdevice_save_profile(lua_State* L);
+static int lua_mbdevice_load_profile(lua_State* L);
+static int lua_mbdevice_bus_stats(lua_State* L);
+static int lua_mbdevice_reset_bus_stats(lua_State* L);
 static int lua_mbdevice_new_ctx(lua_State* L);
 
 // ModbusDeviceContext methods
@@ -30,8 +35,26 @@ static int lua_mbdevicectx_gc(lua_State* L);
 static int lua_mbdevicectx_connect(lua_State* L);
 static int lua_mbdevicectx_close(lua_State* L);
 static int lua_mbdevicectx_read(lua_State* L);
+static int lua_mbdevicectx_handle(lua_State* L);
+static int lua_mbdevicectx_read_mask(lua_State* L);
+static int lua_mbdevicectx_read_into(lua_State* L);
+static int lua_mbdevicectx_read_many(lua_State* L);
+static int lua_mbdevicectx_compile(lua_State* L);
+static int lua_mbdevicectx_read_plan(lua_State* L);
+static int lua_mbdevicectx_read_all(lua_State* L);
 static int lua_mbdevicectx_write(lua_State* L);
+static int lua_mbdevicectx_write_many(lua_State* L);
+static int lua_mbdevicectx_exchange(lua_State* L);
+static int lua_mbdevicectx_clear_cache(lua_State* L);
 static int lua_mbdevicectx_tx(lua_State* L);
+static int lua_mbdevicectx_poll(lua_State* L);
+static int lua_mbdevicectx_stop_polling(lua_State* L);
+static int lua_mbdevicectx_latest(lua_State* L);
+static int lua_mbdevicectx_latest_all(lua_State* L);
+
+// ReadPlan methods
+static int lua_readplan_gc(lua_State* L);
+static int lua_readplan_len(lua_State* L);
 
 #ifdef LIBMODBUSPLUS_STACK_CHECK
 #define STACK_START(fn_name, nargs)                             \
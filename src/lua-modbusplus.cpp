@@ -5,10 +5,14 @@
 #include "lua-modbusplus-private.hpp"
 #include "mapping-registry.hpp"
 #include "modbus-device-ctx.hpp"
+#include "modbus-device-tcp-async.hpp"
+#include "modbus-device-tcp-pipelined.hpp"
 #include "modbus-device.hpp"
+#include "read-plan.hpp"
 
 static const char* MODBUS_DEVICE_METATABLE = "modbusplus.device";
 static const char* MODBUS_DEVICE_CTX_METATABLE = "modbusplus.device.ctx";
+static const char* READ_PLAN_METATABLE = "modbusplus.device.plan";
 
 void lua_push_error_func(lua_State* L) {
 	STACK_START(lua_push_error_func, 0);
@@ -50,6 +54,41 @@ std::shared_ptr<ModbusDeviceContext> getModbusDeviceCtx(lua_State* L,
 	return *ptr;
 }
 
+std::shared_ptr<ReadPlan> getReadPlan(lua_State* L, int index) {
+	void* udata = luaL_checkudata(L, index, READ_PLAN_METATABLE);
+	if (!udata) {
+		luaL_error(L, "Invalid ReadPlan userdata");
+		return nullptr;
+	}
+	auto ptr = static_cast<std::shared_ptr<ReadPlan>*>(udata);
+	if (!ptr || !*ptr) {
+		luaL_error(L, "ReadPlan is null");
+		return nullptr;
+	}
+	return *ptr;
+}
+
+void pushReadPlan(lua_State* L, const std::shared_ptr<ReadPlan>& plan) {
+	// Allocate userdata
+	void* udata = lua_newuserdata(L, sizeof(std::shared_ptr<ReadPlan>));
+
+	// Construct the shared_ptr in the userdata (placement new)
+	new (udata) std::shared_ptr<ReadPlan>(plan);
+
+	// Set the userdata's metatable
+	luaL_getmetatable(L, READ_PLAN_METATABLE);
+	lua_setmetatable(L, -2);
+
+	// Intern the names once, in entry order, as the userdata's environment
+	const auto& entries = plan->getEntries();
+	lua_createtable(L, static_cast<int>(entries.size()), 0);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		lua_pushlstring(L, entries[i].name.c_str(), entries[i].name.size());
+		lua_rawseti(L, -2, static_cast<int>(i + 1));
+	}
+	lua_setfenv(L, -2);
+}
+
 luaL_reg library_methods[] = {
 	{"newRtu", lua_mbdevice_newRtu},
 	{"newTcp", lua_mbdevice_newTcp},
@@ -69,6 +108,11 @@ luaL_reg device_methods[] = {
 	{"raw_write_bits", lua_mbdevice_write_bits},
 	{"raw_write_register", lua_mbdevice_write_register},
 	{"raw_write_registers", lua_mbdevice_write_registers},
+	{"raw_mask_write_register", lua_mbdevice_mask_write_register},
+	{"save_profile", lua_mbdevice_save_profile},
+	{"load_profile", lua_mbdevice_load_profile},
+	{"bus_stats", lua_mbdevice_bus_stats},
+	{"reset_bus_stats", lua_mbdevice_reset_bus_stats},
 	{"new_context", lua_mbdevice_new_ctx},
 	{NULL, NULL} /* sentinel */
 };
@@ -77,8 +121,27 @@ luaL_reg device_ctx_methods[] = {
 	{"connect", lua_mbdevicectx_connect},
 	{"close", lua_mbdevicectx_close},
 	{"read", lua_mbdevicectx_read},
+	{"handle", lua_mbdevicectx_handle},
+	{"read_mask", lua_mbdevicectx_read_mask},
+	{"read_into", lua_mbdevicectx_read_into},
+	{"read_many", lua_mbdevicectx_read_many},
+	{"compile", lua_mbdevicectx_compile},
+	{"read_plan", lua_mbdevicectx_read_plan},
+	{"read_all", lua_mbdevicectx_read_all},
 	{"write", lua_mbdevicectx_write},
+	{"write_many", lua_mbdevicectx_write_many},
+	{"exchange", lua_mbdevicectx_exchange},
+	{"clear_cache", lua_mbdevicectx_clear_cache},
 	{"tx", lua_mbdevicectx_tx},
+	{"poll", lua_mbdevicectx_poll},
+	{"stop_polling", lua_mbdevicectx_stop_polling},
+	{"latest", lua_mbdevicectx_latest},
+	{"latest_all", lua_mbdevicectx_latest_all},
+	{NULL, NULL} /* sentinel */
+};
+luaL_reg read_plan_methods[] = {
+	{"__gc", lua_readplan_gc},
+	{"__len", lua_readplan_len},
 	{NULL, NULL} /* sentinel */
 };
 
@@ -104,6 +167,14 @@ int luaopen_modbusplus(lua_State* L) {
 		lua_pop(L, 1);	// pop existing metatable
 	}
 
+	// Create read plan metatable
+	if (luaL_newmetatable(L, READ_PLAN_METATABLE)) {
+		luaL_register(L, nullptr, read_plan_methods);
+		lua_setfield(L, -1, "__index");	 // metatable.__index = metatable
+	} else {
+		lua_pop(L, 1);	// pop existing metatable
+	}
+
 	// Create library table
 	lua_newtable(L);
 	luaL_register(L, nullptr, library_methods);
@@ -118,6 +189,16 @@ int lua_mbdevice_newRtu(lua_State* L) {
 
 	// The config is passed as a table
 	luaL_checktype(L, 1, LUA_TTABLE);
+
+	// Optional tuning of the cost model used to merge reads
+	lua_getfield(L, 1, "turnaround_ms");
+	const int turnaroundMs = luaL_optinteger(
+		L, -1, ModbusDeviceRtu::DEFAULT_TURNAROUND_US / 1000);
+	lua_pop(L, 1);
+	if (turnaroundMs < 0) {
+		return luaL_error(L, "Invalid turnaround_ms: %d", turnaroundMs);
+	}
+
 	lua_getfield(L, -1, "device");
 	lua_getfield(L, -2, "baud");
 	lua_getfield(L, -3, "parity");
@@ -187,6 +268,7 @@ int lua_mbdevice_newRtu(lua_State* L) {
 	auto device = std::make_shared<ModbusDeviceRtu>(
 		deviceName, baud, parity, dataBitsEnum, stopBitsEnum, flowctrl);
 #endif
+	device->setTurnaround(static_cast<unsigned int>(turnaroundMs) * 1000);
 
 	// Allocate userdata
 	void* udata = lua_newuserdata(L, sizeof(std::shared_ptr<ModbusDevice>));
@@ -208,6 +290,32 @@ int lua_mbdevice_newTcp(lua_State* L) {
 
 	// The config is passed as a table
 	luaL_checktype(L, 1, LUA_TTABLE);
+
+	// Optional tuning of the cost model used to merge reads
+	lua_getfield(L, 1, "rtt_ms");
+	const int rttMs =
+		luaL_optinteger(L, -1, ModbusDeviceTcp::DEFAULT_RTT_US / 1000);
+	lua_pop(L, 1);
+	if (rttMs < 0) {
+		return luaL_error(L, "Invalid rtt_ms: %d", rttMs);
+	}
+
+	// Optional pipelining, which frames requests without libmodbus, 0 leaving
+	// requests to libmodbus one at a time
+	lua_getfield(L, 1, "window");
+	const int window = luaL_optinteger(L, -1, 0);
+	lua_pop(L, 1);
+	if (window < 0 ||
+		window > static_cast<int>(ModbusDeviceTcpPipelined::MAX_WINDOW)) {
+		return luaL_error(L, "Window must be between 0 and %d",
+						  ModbusDeviceTcpPipelined::MAX_WINDOW);
+	}
+
+	// Optionally driven by the shared event loop rather than the caller
+	lua_getfield(L, 1, "async");
+	const bool async = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
 	lua_getfield(L, -1, "ip");
 	lua_getfield(L, -2, "port");
 
@@ -221,7 +329,16 @@ int lua_mbdevice_newTcp(lua_State* L) {
 	lua_pop(L, 3);
 
 	// Create ModbusDeviceTcp instance
-	auto device = std::make_shared<ModbusDeviceTcp>(ip, port);
+	std::shared_ptr<ModbusDeviceTcp> device;
+	if (async) {
+		device = std::make_shared<ModbusDeviceTcpAsync>(
+			ip, port, window > 0 ? static_cast<unsigned int>(window) : 1u);
+	} else if (window > 0) {
+		device = std::make_shared<ModbusDeviceTcpPipelined>(ip, port, window);
+	} else {
+		device = std::make_shared<ModbusDeviceTcp>(ip, port);
+	}
+	device->setRoundTripTime(static_cast<unsigned int>(rttMs) * 1000);
 
 	// Allocate userdata
 	void* udata = lua_newuserdata(L, sizeof(std::shared_ptr<ModbusDevice>));
@@ -590,6 +707,88 @@ int lua_mbdevice_write_register(lua_State* L) {
 	return 1;  // Return number of registers written (should be 1)
 }
 
+int lua_mbdevice_save_profile(lua_State* L) {
+	STACK_START(lua_mbdevice_save_profile, 2);
+
+	auto ptr = getModbusDevice(L, 1);
+	const char* path = luaL_checkstring(L, 2);
+
+	try {
+		ptr->saveProfile(path);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to save profile: %s", ex.what());
+	}
+
+	// STACK: device, path
+	lua_pop(L, 2);
+
+	STACK_END(lua_mbdevice_save_profile, 0);
+
+	return 0;
+}
+
+int lua_mbdevice_load_profile(lua_State* L) {
+	STACK_START(lua_mbdevice_load_profile, 2);
+
+	auto ptr = getModbusDevice(L, 1);
+	const char* path = luaL_checkstring(L, 2);
+
+	try {
+		ptr->loadProfile(path);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to load profile: %s", ex.what());
+	}
+
+	// STACK: device, path
+	lua_pop(L, 2);
+
+	STACK_END(lua_mbdevice_load_profile, 0);
+
+	return 0;
+}
+
+int lua_mbdevice_bus_stats(lua_State* L) {
+	STACK_START(lua_mbdevice_bus_stats, 1);
+
+	auto ptr = getModbusDevice(L, 1);
+	const auto stats = ptr->getBusStats();
+
+	// STACK: device
+	lua_pop(L, 1);
+
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, static_cast<lua_Number>(stats.frames));
+	lua_setfield(L, -2, "frames");
+	lua_pushnumber(L, static_cast<lua_Number>(stats.errors));
+	lua_setfield(L, -2, "errors");
+	lua_pushnumber(L, stats.busyUs / 1000.0);
+	lua_setfield(L, -2, "busy_ms");
+	lua_pushnumber(L, stats.gapUs / 1000.0);
+	lua_setfield(L, -2, "gap_ms");
+	lua_pushnumber(L, stats.elapsedUs / 1000.0);
+	lua_setfield(L, -2, "elapsed_ms");
+	lua_pushnumber(L, stats.occupancy());
+	lua_setfield(L, -2, "occupancy");
+
+	STACK_END(lua_mbdevice_bus_stats, 1);
+
+	return 1;  // Return the statistics
+}
+
+int lua_mbdevice_reset_bus_stats(lua_State* L) {
+	STACK_START(lua_mbdevice_reset_bus_stats, 1);
+
+	auto ptr = getModbusDevice(L, 1);
+	ptr->resetBusStats();
+
+	// STACK: device
+	lua_pop(L, 1);
+
+	STACK_END(lua_mbdevice_reset_bus_stats, 0);
+
+	return 0;
+}
+
 int lua_mbdevice_write_registers(lua_State* L) {
 	STACK_START(lua_mbdevice_write_registers, 3);
 
@@ -635,6 +834,34 @@ int lua_mbdevice_write_registers(lua_State* L) {
 	return 1;  // Return number of registers written
 }
 
+int lua_mbdevice_mask_write_register(lua_State* L) {
+	STACK_START(lua_mbdevice_mask_write_register, 4);
+
+	auto ptr = getModbusDevice(L, 1);
+	int addr = luaL_checkinteger(L, 2);
+	int andMask = luaL_checkinteger(L, 3);
+	int orMask = luaL_checkinteger(L, 4);
+	if (andMask < 0 || andMask > 0xFFFF || orMask < 0 || orMask > 0xFFFF) {
+		return luaL_error(L, "Masks must be between 0 and 65535");
+	}
+
+	// STACK: device, addr, and_mask, or_mask
+	lua_pop(L, 4);
+
+	unsigned int rc;
+	try {
+		rc = ptr->maskWriteRegister(addr, static_cast<uint16_t>(andMask),
+									static_cast<uint16_t>(orMask));
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to mask write register: %s", ex.what());
+	}
+	lua_pushinteger(L, rc);
+
+	STACK_END(lua_mbdevice_mask_write_register, 1);
+
+	return 1;  // Return number of registers written (should be 1)
+}
+
 int lua_mbdevice_new_ctx(lua_State* L) {
 	STACK_START(lua_mbdevice_new_ctx, 1);
 
@@ -652,6 +879,7 @@ int lua_mbdevice_new_ctx(lua_State* L) {
 	// Create ModbusDeviceContext instance
 	auto ctx = std::make_shared<ModbusDeviceContext>(ptr, std::move(mapping),
 													 device_id);
+	ctx->luaInternStrings(L);
 
 	// Allocate userdata
 	void* udata =
@@ -664,6 +892,10 @@ int lua_mbdevice_new_ctx(lua_State* L) {
 	luaL_getmetatable(L, MODBUS_DEVICE_CTX_METATABLE);
 	lua_setmetatable(L, -2);
 
+	// Give the context its own environment for per-context Lua state
+	lua_newtable(L);
+	lua_setfenv(L, -2);
+
 	STACK_END(lua_mbdevice_new_ctx, 1);
 
 	return 1;  // Return the userdata
@@ -674,6 +906,7 @@ int lua_mbdevicectx_gc(lua_State* L) {
 
 	// Get the userdata
 	auto ptr = getModbusDeviceCtx(L, 1);
+	ptr->luaReleaseStrings(L);
 	ptr.reset();
 
 	// STACK: ctx
@@ -734,38 +967,290 @@ int lua_mbdevicectx_close(lua_State* L) {
 int lua_mbdevicectx_read(lua_State* L) {
 	STACK_START(lua_mbdevicectx_read, 2);
 
+	auto ctx = getModbusDeviceCtx(L, 1);
+
+	// Handles from ctx:handle() skip the name lookup
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		const lua_Integer handle = lua_tointeger(L, 2);
+
+		// STACK: ctx, handle
+		lua_pop(L, 2);
+
+		try {
+			ctx->luaRead(L, static_cast<Mapping::Handle>(handle));
+		} catch (const std::exception& ex) {
+			return luaL_error(L, "Failed to read handle %d: %s",
+							  static_cast<int>(handle), ex.what());
+		}
+	} else {
+		const char* name = luaL_checkstring(L, 2);
+
+		// STACK: ctx, name
+		lua_pop(L, 2);
+
+		try {
+			ctx->luaRead(L, name);
+		} catch (const std::exception& ex) {
+			return luaL_error(L, "Failed to read mapping '%s': %s", name,
+							  ex.what());
+		}
+	}
+
+	STACK_END(lua_mbdevicectx_read, 1);
+
+	return 1;  // Return the value
+}
+
+int lua_mbdevicectx_handle(lua_State* L) {
+	STACK_START(lua_mbdevicectx_handle, 2);
+
 	auto ctx = getModbusDeviceCtx(L, 1);
 	const char* name = luaL_checkstring(L, 2);
 
+	Mapping::Handle handle;
+	try {
+		handle = ctx->getHandle(name);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to resolve mapping '%s': %s", name,
+						  ex.what());
+	}
+
 	// STACK: ctx, name
 	lua_pop(L, 2);
+	lua_pushinteger(L, static_cast<lua_Integer>(handle));
+
+	STACK_END(lua_mbdevicectx_handle, 1);
+
+	return 1;
+}
+
+int lua_mbdevicectx_read_mask(lua_State* L) {
+	STACK_START(lua_mbdevicectx_read_mask, 2);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	const bool byHandle = lua_type(L, 2) == LUA_TNUMBER;
+	const char* name = byHandle ? nullptr : luaL_checkstring(L, 2);
+	const lua_Integer index = byHandle ? lua_tointeger(L, 2) : 0;
+
+	// STACK: ctx, name|handle
 
 	try {
-		ctx->luaRead(L, name);
+		const Mapping::Handle handle =
+			byHandle ? static_cast<Mapping::Handle>(index)
+					 : ctx->getHandle(name);
+		ctx->luaReadMask(L, handle);
 	} catch (const std::exception& ex) {
-		return luaL_error(L, "Failed to read mapping '%s': %s", name,
-						  ex.what());
+		return luaL_error(L, "Failed to read mask of '%s': %s",
+						  byHandle ? lua_tostring(L, 2) : name, ex.what());
 	}
 
-	STACK_END(lua_mbdevicectx_read, 1);
+	// STACK: ctx, name|handle, mask
+	lua_replace(L, 1);
+	lua_pop(L, 1);
 
-	return 1;  // Return the value
+	STACK_END(lua_mbdevicectx_read_mask, 1);
+
+	return 1;  // Return the mask
+}
+
+int lua_mbdevicectx_read_into(lua_State* L) {
+	STACK_START(lua_mbdevicectx_read_into, 3);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	const bool byHandle = lua_type(L, 2) == LUA_TNUMBER;
+	const char* name = byHandle ? nullptr : luaL_checkstring(L, 2);
+	const lua_Integer index = byHandle ? lua_tointeger(L, 2) : 0;
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	// STACK: ctx, name|handle, flags
+
+	try {
+		const Mapping::Handle handle =
+			byHandle ? static_cast<Mapping::Handle>(index)
+					 : ctx->getHandle(name);
+		ctx->luaReadInto(L, handle, 3);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to read flags of '%s': %s",
+						  byHandle ? lua_tostring(L, 2) : name, ex.what());
+	}
+
+	// STACK: ctx, name|handle, flags
+	lua_replace(L, 1);
+	lua_pop(L, 1);
+
+	STACK_END(lua_mbdevicectx_read_into, 1);
+
+	return 1;  // Return the filled table
+}
+
+int lua_mbdevicectx_read_many(lua_State* L) {
+	STACK_START(lua_mbdevicectx_read_many, 2);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	// STACK: ctx, names
+
+	try {
+		ctx->luaReadMany(L, 2);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to read mappings: %s", ex.what());
+	}
+
+	// STACK: ctx, names, values
+	lua_replace(L, 1);
+	lua_pop(L, 1);
+
+	STACK_END(lua_mbdevicectx_read_many, 1);
+
+	return 1;  // Return the table of values
+}
+
+int lua_mbdevicectx_compile(lua_State* L) {
+	STACK_START(lua_mbdevicectx_compile, 2);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	const bool wholeMapping = lua_isnoneornil(L, 2);
+	if (!wholeMapping) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
+
+	// STACK: ctx, names?
+
+	std::shared_ptr<ReadPlan> plan;
+	try {
+		if (wholeMapping) {
+			plan = ctx->compilePlan();
+		} else {
+			plan = ctx->compilePlan(
+				ModbusDeviceContext::luaCheckNames(L, 2));
+		}
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to compile read plan: %s", ex.what());
+	}
+
+	pushReadPlan(L, plan);
+
+	// STACK: ctx, names?, plan
+	lua_replace(L, 1);
+	lua_settop(L, 1);
+
+	STACK_END(lua_mbdevicectx_compile, 1);
+
+	return 1;  // Return the plan
+}
+
+int lua_mbdevicectx_read_plan(lua_State* L) {
+	STACK_START(lua_mbdevicectx_read_plan, 3);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	auto plan = getReadPlan(L, 2);
+
+	// Fill the given table or create a new one
+	if (lua_isnoneornil(L, 3)) {
+		lua_settop(L, 2);
+		lua_createtable(L, 0, static_cast<int>(plan->getEntries().size()));
+	} else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_settop(L, 3);
+	}
+	lua_getfenv(L, 2);
+
+	// STACK: ctx, plan, values, keys
+
+	try {
+		ctx->luaReadPlan(L, *plan, 4, 3);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to read plan: %s", ex.what());
+	}
+
+	// STACK: ctx, plan, values, keys
+	lua_pop(L, 1);
+	lua_replace(L, 1);
+	lua_pop(L, 1);
+
+	STACK_END(lua_mbdevicectx_read_plan, 1);
+
+	return 1;  // Return the table of values
+}
+
+int lua_mbdevicectx_read_all(lua_State* L) {
+	STACK_START(lua_mbdevicectx_read_all, 2);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
+	lua_settop(L, 2);
+
+	// The plan for the whole mapping is compiled on first use and kept in the
+	// context's environment
+	lua_getfenv(L, 1);
+	lua_getfield(L, 3, "read_all_plan");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		try {
+			pushReadPlan(L, ctx->compilePlan());
+		} catch (const std::exception& ex) {
+			return luaL_error(L, "Failed to compile read plan: %s", ex.what());
+		}
+		lua_pushvalue(L, -1);
+		lua_setfield(L, 3, "read_all_plan");
+	}
+	auto plan = getReadPlan(L, 4);
+
+	// Fill the given table or create a new one sized for the whole mapping
+	if (lua_isnil(L, 2)) {
+		lua_createtable(L, 0, static_cast<int>(plan->getEntries().size()));
+		lua_replace(L, 2);
+	}
+	lua_getfenv(L, 4);
+
+	// STACK: ctx, values, env, plan, keys
+
+	try {
+		ctx->luaReadPlan(L, *plan, 5, 2);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to read all mappings: %s", ex.what());
+	}
+
+	// STACK: ctx, values, env, plan, keys
+	lua_settop(L, 2);
+	lua_replace(L, 1);
+
+	STACK_END(lua_mbdevicectx_read_all, 1);
+
+	return 1;  // Return the table of values
 }
 
 int lua_mbdevicectx_write(lua_State* L) {
 	STACK_START(lua_mbdevicectx_write, 3);
 
 	auto ctx = getModbusDeviceCtx(L, 1);
-	const char* name = luaL_checkstring(L, 2);
 	// Value is at index 3
 
-	// STACK: ctx, name, value
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		const lua_Integer handle = lua_tointeger(L, 2);
 
-	try {
-		ctx->luaWrite(L, name);
-	} catch (const std::exception& ex) {
-		return luaL_error(L, "Failed to write mapping '%s': %s", name,
-						  ex.what());
+		// STACK: ctx, handle, value
+
+		try {
+			ctx->luaWrite(L, static_cast<Mapping::Handle>(handle));
+		} catch (const std::exception& ex) {
+			return luaL_error(L, "Failed to write handle %d: %s",
+							  static_cast<int>(handle), ex.what());
+		}
+	} else {
+		const char* name = luaL_checkstring(L, 2);
+
+		// STACK: ctx, name, value
+
+		try {
+			ctx->luaWrite(L, name);
+		} catch (const std::exception& ex) {
+			return luaL_error(L, "Failed to write mapping '%s': %s", name,
+							  ex.what());
+		}
 	}
 
 	// STACK: ctx, name
@@ -776,6 +1261,67 @@ int lua_mbdevicectx_write(lua_State* L) {
 	return 0;
 }
 
+int lua_mbdevicectx_write_many(lua_State* L) {
+	STACK_START(lua_mbdevicectx_write_many, 2);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	// STACK: ctx, values
+
+	try {
+		ctx->luaWriteMany(L, 2);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to write mappings: %s", ex.what());
+	}
+
+	// STACK: ctx, values
+	lua_pop(L, 2);
+
+	STACK_END(lua_mbdevicectx_write_many, 0);
+
+	return 0;
+}
+
+int lua_mbdevicectx_exchange(lua_State* L) {
+	STACK_START(lua_mbdevicectx_exchange, 3);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	// STACK: ctx, writes, reads
+
+	try {
+		ctx->luaExchange(L, 2, 3);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to exchange mappings: %s", ex.what());
+	}
+
+	// STACK: ctx, writes, reads, values
+	lua_replace(L, 1);
+	lua_pop(L, 2);
+
+	STACK_END(lua_mbdevicectx_exchange, 1);
+
+	return 1;  // Return the table of values read
+}
+
+int lua_mbdevicectx_clear_cache(lua_State* L) {
+	STACK_START(lua_mbdevicectx_clear_cache, 1);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+
+	// STACK: ctx
+	lua_pop(L, 1);
+
+	ctx->clearCache();
+
+	STACK_END(lua_mbdevicectx_clear_cache, 0);
+
+	return 0;
+}
+
 int lua_mbdevicectx_tx(lua_State* L) {
 	STACK_START(lua_mbdevicectx_tx, 0);
 
@@ -813,3 +1359,139 @@ int lua_mbdevicectx_tx(lua_State* L) {
 
 	return 1;
 }
+
+int lua_mbdevicectx_poll(lua_State* L) {
+	STACK_START(lua_mbdevicectx_poll, 3);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	const lua_Integer periodMs = luaL_checkinteger(L, 2);
+	lua_settop(L, 3);
+
+	// STACK: ctx, period, plan|names|nil
+
+	// Poll a compiled plan, the given names or the whole mapping
+	std::shared_ptr<ReadPlan> plan;
+	if (lua_isuserdata(L, 3)) {
+		plan = getReadPlan(L, 3);
+	} else if (!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+	}
+
+	try {
+		if (!plan) {
+			plan = lua_isnil(L, 3) ? ctx->compilePlan()
+								   : ctx->compilePlan(
+										 ModbusDeviceContext::luaCheckNames(L, 3));
+		}
+		ctx->poll(plan, std::chrono::milliseconds(periodMs));
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to start polling: %s", ex.what());
+	}
+
+	// STACK: ctx, period, plan|names|nil
+	lua_pop(L, 3);
+
+	STACK_END(lua_mbdevicectx_poll, 0);
+
+	return 0;
+}
+
+int lua_mbdevicectx_stop_polling(lua_State* L) {
+	STACK_START(lua_mbdevicectx_stop_polling, 1);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+
+	// STACK: ctx
+	lua_pop(L, 1);
+
+	ctx->stopPolling();
+
+	STACK_END(lua_mbdevicectx_stop_polling, 0);
+
+	return 0;
+}
+
+int lua_mbdevicectx_latest(lua_State* L) {
+	STACK_START(lua_mbdevicectx_latest, 2);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+	const bool byHandle = lua_type(L, 2) == LUA_TNUMBER;
+	const char* name = byHandle ? nullptr : luaL_checkstring(L, 2);
+	const lua_Integer index = byHandle ? lua_tointeger(L, 2) : 0;
+	lua_settop(L, 2);
+
+	// STACK: ctx, name|handle
+
+	int count;
+	try {
+		const Mapping::Handle handle =
+			byHandle ? static_cast<Mapping::Handle>(index)
+					 : ctx->getHandle(name);
+		count = ctx->luaLatest(L, handle);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to get latest value of '%s': %s",
+						  byHandle ? lua_tostring(L, 2) : name, ex.what());
+	}
+
+	// STACK: ctx, name|handle, value, age?
+	lua_remove(L, 1);
+	lua_remove(L, 1);
+
+	STACK_END(lua_mbdevicectx_latest, count);
+
+	return count;  // Return the value and its age
+}
+
+int lua_mbdevicectx_latest_all(lua_State* L) {
+	STACK_START(lua_mbdevicectx_latest_all, 1);
+
+	auto ctx = getModbusDeviceCtx(L, 1);
+
+	// STACK: ctx
+
+	try {
+		ctx->luaLatestAll(L);
+	} catch (const std::exception& ex) {
+		return luaL_error(L, "Failed to get latest values: %s", ex.what());
+	}
+
+	// STACK: ctx, values
+	lua_replace(L, 1);
+
+	STACK_END(lua_mbdevicectx_latest_all, 1);
+
+	return 1;  // Return the table of values
+}
+
+int lua_readplan_gc(lua_State* L) {
+	STACK_START(lua_readplan_gc, 1);
+
+	// Get the userdata
+	void* udata = luaL_checkudata(L, 1, READ_PLAN_METATABLE);
+	if (udata) {
+		// Call the destructor for the shared_ptr
+		auto ptr = static_cast<std::shared_ptr<ReadPlan>*>(udata);
+		ptr->reset();
+	}
+
+	lua_pop(L, 1);
+
+	STACK_END(lua_readplan_gc, 0);
+
+	return 0;
+}
+
+int lua_readplan_len(lua_State* L) {
+	STACK_START(lua_readplan_len, 1);
+
+	auto plan = getReadPlan(L, 1);
+
+	// STACK: plan
+	lua_pop(L, 1);
+
+	lua_pushinteger(L, static_cast<lua_Integer>(plan->getEntries().size()));
+
+	STACK_END(lua_readplan_len, 1);
+
+	return 1;  // Return the number of values in the plan
+}
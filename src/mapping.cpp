@@ -1,6 +1,34 @@
 #include "mapping.hpp"
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
+#include <map>
 #include "nlohmann/json.hpp"
+#include "value-decoders.hpp"
+#include "value-utils.hpp"
+
+namespace {
+/**
+ * Parses the byte order of a numeric value, accepting the orders of
+ * value_utils::BYTE_ORDERS of the same size as the default.
+ */
+Mapping::ValueDefOrder parseOrder(const std::string* orderStr,
+								  Mapping::ValueDefOrder defaultOrder,
+								  const std::string& key) {
+	if (!orderStr) {
+		return defaultOrder;
+	}
+
+	const size_t size = value_utils::byte_order_size(defaultOrder);
+	for (const auto& entry : value_utils::BYTE_ORDERS) {
+		if (*orderStr == entry.name &&
+			value_utils::byte_order_size(entry.order) == size) {
+			return entry.order;
+		}
+	}
+	throw std::runtime_error("Invalid order in mapping for key: " + key);
+}
+}  // namespace
 
 Mapping::Mapping(const char* path) {
 	// Read and parse the mapping file located at 'path'
@@ -77,46 +105,27 @@ Mapping::Mapping(const char* path) {
 				: nullptr;
 		switch (def.format) {
 			case ValueDefFormat::bit:
-				throw std::runtime_error(
-					"Bit format does not support byte order for key: " +
-					item.key());
+				if (orderStr) {
+					throw std::runtime_error(
+						"Bit format does not support byte order for key: " +
+						item.key());
+				}
 				break;
 			case ValueDefFormat::u16:
 			case ValueDefFormat::i16:
-				if (!orderStr || *orderStr == "ab") {
-					def.order = ValueDefOrder::ab;
-				} else if (*orderStr == "ba") {
-					def.order = ValueDefOrder::ba;
-				} else {
-					throw std::runtime_error(
-						"Invalid order in mapping for key: " + item.key());
-				}
+				def.order = parseOrder(orderStr, ValueDefOrder::ab, item.key());
 				break;
 			case ValueDefFormat::u32:
 			case ValueDefFormat::i32:
 			case ValueDefFormat::f32:
-				if (!orderStr || *orderStr == "abcd") {
-					def.order = ValueDefOrder::abcd;
-				} else if (*orderStr == "dcba") {
-					def.order = ValueDefOrder::dcba;
-				} else if (*orderStr == "badc") {
-					def.order = ValueDefOrder::badc;
-				} else if (*orderStr == "cdab") {
-					def.order = ValueDefOrder::cdab;
-				} else {
-					throw std::runtime_error(
-						"Invalid order in mapping for key: " + item.key());
-				}
+				def.order =
+					parseOrder(orderStr, ValueDefOrder::abcd, item.key());
 				break;
 			case ValueDefFormat::u64:
 			case ValueDefFormat::i64:
 			case ValueDefFormat::f64:
-				if (!orderStr || *orderStr == "abcdefgh") {
-					def.order = ValueDefOrder::abcdefgh;
-				} else {
-					throw std::runtime_error(
-						"Invalid order in mapping for key: " + item.key());
-				}
+				def.order =
+					parseOrder(orderStr, ValueDefOrder::abcdefgh, item.key());
 				break;
 			case ValueDefFormat::str:
 				if (!orderStr || *orderStr == "ab") {
@@ -146,6 +155,25 @@ Mapping::Mapping(const char* path) {
 		}
 		def.scale = item.value().value("scale", 1.0);
 
+		// Trimming only applies to strings
+		if (def.format != ValueDefFormat::str && item.value().contains("trim")) {
+			throw std::runtime_error(
+				"Trim not applicable for format in key: " + item.key());
+		}
+		def.trim = item.value().value("trim", true);
+
+		// Slowly changing values can be served from cache for a while
+		if (item.value().contains("max_age_ms")) {
+			const auto& maxAge = item.value()["max_age_ms"];
+			if (!maxAge.is_number_unsigned() ||
+				maxAge.get<uint64_t>() > UINT32_MAX) {
+				throw std::runtime_error(
+					"max_age_ms must be a non-negative integer for key: " +
+					item.key());
+			}
+			def.maxAgeMs = maxAge.get<uint32_t>();
+		}
+
 		// Length should only be present for string and bitfield types
 		if (def.format != ValueDefFormat::str &&
 			def.format != ValueDefFormat::bitfield) {
@@ -176,10 +204,27 @@ Mapping::Mapping(const char* path) {
 				"Linking not applicable for format in key: " + item.key());
 		}
 
-		m_values[item.key()] = def;
+		// Choose the decoder now so reading doesn't branch on the format
+		def.decode = value_decoders::select(def);
+
+		m_maxLength = std::max(m_maxLength, def.length);
+		m_handles[item.key()] = static_cast<Handle>(m_values.size());
+		m_values.push_back(def);
+		m_names.push_back(item.key());
 	}
 	printf("DEBUG: Loaded %d value definitions\n", (int)m_values.size());
 
+	// Enum labels and flag names are stored once and referred to by id
+	std::unordered_map<std::string, uint32_t> stringIds;
+	const auto intern = [&](const std::string& str) {
+		auto [it, inserted] =
+			stringIds.emplace(str, static_cast<uint32_t>(m_strings.size()));
+		if (inserted) {
+			m_strings.push_back(str);
+		}
+		return it->second;
+	};
+
 	// Read bitfield definitions
 	if (j.contains("bitfields")) {
 		if (!j["bitfields"].is_object()) {
@@ -198,6 +243,7 @@ Mapping::Mapping(const char* path) {
 					item.key());
 			}
 
+			std::map<uint16_t, uint32_t> flags;
 			for (const auto& bf_item : item.value().items()) {
 				const auto& bitName = bf_item.key();
 
@@ -208,7 +254,12 @@ Mapping::Mapping(const char* path) {
 				}
 
 				uint16_t bitPos = bf_item.value().get<uint16_t>();
-				m_bitfields[bitfieldName][bitPos] = bitName;
+				flags[bitPos] = intern(bitName);
+			}
+
+			auto& bitfieldDef = m_bitfields[bitfieldName];
+			for (const auto& [bit, string] : flags) {
+				bitfieldDef.push_back({bit, string});
 			}
 		}
 	}
@@ -229,6 +280,11 @@ Mapping::Mapping(const char* path) {
 					"Enum definition must be an object for key: " + item.key());
 			}
 
+			auto& enumDef = m_enums[enumName];
+
+			// Labels are looked up when writing, each one even when several
+			// share a value, which then decodes to one of them
+			std::map<int64_t, uint32_t> labels;
 			for (const auto& enum_item : item.value().items()) {
 				if (!enum_item.value().is_number_integer()) {
 					throw std::runtime_error(
@@ -237,22 +293,157 @@ Mapping::Mapping(const char* path) {
 				}
 
 				int64_t enumValue = enum_item.value().get<int64_t>();
-				m_enums[enumName][enumValue] = enum_item.key();
+				const uint32_t label = intern(enum_item.key());
+				labels[enumValue] = label;
+				enumDef.values.emplace_back(m_strings[label], enumValue);
+			}
+			if (labels.empty()) {
+				continue;
+			}
+			std::sort(enumDef.values.begin(), enumDef.values.end());
+
+			// Index small ranges directly, search larger ones
+			const int64_t min = labels.begin()->first;
+			const uint64_t span = static_cast<uint64_t>(labels.rbegin()->first) -
+								  static_cast<uint64_t>(min);
+			if (span < labels.size() * 2 + 16) {
+				enumDef.min = min;
+				enumDef.direct.assign(span + 1, -1);
+				for (const auto& [value, string] : labels) {
+					const uint64_t index = static_cast<uint64_t>(value) -
+										   static_cast<uint64_t>(min);
+					enumDef.direct[index] = static_cast<int32_t>(string);
+				}
+			} else {
+				enumDef.sorted.assign(labels.begin(), labels.end());
 			}
 		}
 	}
 	printf("DEBUG: Loaded %d enums\n", (int)m_enums.size());
+
+	// Resolve the links now so reading doesn't look them up by name
+	for (auto& def : m_values) {
+		if (def.format == ValueDefFormat::bitfield) {
+			def.bitfieldDef = &getBitfieldDef(def.linked);
+		} else if (!def.linked.empty()) {
+			def.enumDef = &getEnumDef(def.linked);
+		}
+	}
+
+	// Read ranges that fault when read, these are never bridged when merging
+	// reads
+	if (j.contains("unreadable")) {
+		if (!j["unreadable"].is_array()) {
+			throw std::runtime_error(
+				"'unreadable' must be an array in mapping file");
+		}
+
+		for (const auto& item : j["unreadable"]) {
+			if (!item.is_object()) {
+				throw std::runtime_error(
+					"Unreadable range must be an object in mapping file");
+			}
+
+			AddressRange range;
+			range.addr = item.at("addr").get<uint16_t>();
+			range.length = item.value("len", 1);
+
+			// Coils and discrete inputs are listed as bit ranges
+			auto typeStr = item.value("type", "hold");
+			range.type = typeStr == "input" || typeStr == "discrete"
+							 ? ValueDefType::input
+							 : ValueDefType::holding;
+			range.bits = typeStr == "coil" || typeStr == "discrete";
+
+			m_unreadable.push_back(range);
+		}
+	}
 }
 
 const Mapping::ValueDef& Mapping::getValueDef(const std::string& name) const {
-	auto it = m_values.find(name);
-	if (it == m_values.end()) {
+	return m_values[getHandle(name)];
+}
+
+const Mapping::ValueDef& Mapping::getValueDef(const char* name) const {
+	return m_values[getHandle(name)];
+}
+
+Mapping::Handle Mapping::getHandle(const std::string& name) const {
+	auto it = m_handles.find(name);
+	if (it == m_handles.end()) {
 		throw std::runtime_error("Value definition not found for key: " + name);
 	}
 	return it->second;
 }
 
-const std::unordered_map<uint16_t, std::string>& Mapping::getBitfieldDef(
+Mapping::Handle Mapping::getHandle(const char* name) const {
+	// The key keeps its capacity, so only names longer than any before
+	// allocate
+	thread_local std::string key;
+	key.assign(name);
+	return getHandle(key);
+}
+
+const Mapping::ValueDef& Mapping::getValueDefAt(Handle handle) const {
+	if (handle >= m_values.size()) {
+		throw std::runtime_error("Invalid value handle: " +
+								 std::to_string(handle));
+	}
+	return m_values[handle];
+}
+
+const std::string& Mapping::getName(Handle handle) const {
+	if (handle >= m_names.size()) {
+		throw std::runtime_error("Invalid value handle: " +
+								 std::to_string(handle));
+	}
+	return m_names[handle];
+}
+
+bool Mapping::isReadable(ValueDefType type,
+						 bool bits,
+						 uint32_t addr,
+						 uint32_t end) const noexcept {
+	for (const auto& range : m_unreadable) {
+		if (range.type == type && range.bits == bits &&
+			addr < range.addr + range.length &&
+			range.addr < end) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int64_t Mapping::EnumDef::find(int64_t value) const noexcept {
+	if (!direct.empty()) {
+		const uint64_t index =
+			static_cast<uint64_t>(value) - static_cast<uint64_t>(min);
+		return index < direct.size() ? direct[index] : -1;
+	}
+
+	auto it = std::lower_bound(
+		sorted.begin(), sorted.end(), value,
+		[](const auto& label, int64_t value) { return label.first < value; });
+	if (it == sorted.end() || it->first != value) {
+		return -1;
+	}
+	return it->second;
+}
+
+bool Mapping::EnumDef::findValue(std::string_view label,
+								 int64_t& value) const noexcept {
+	auto it = std::lower_bound(values.begin(), values.end(), label,
+							   [](const auto& entry, std::string_view label) {
+								   return entry.first < label;
+							   });
+	if (it == values.end() || it->first != label) {
+		return false;
+	}
+	value = it->second;
+	return true;
+}
+
+const Mapping::BitfieldDef& Mapping::getBitfieldDef(
 	const std::string& name) const {
 	auto it = m_bitfields.find(name);
 	if (it == m_bitfields.end()) {
@@ -262,8 +453,7 @@ const std::unordered_map<uint16_t, std::string>& Mapping::getBitfieldDef(
 	return it->second;
 }
 
-const std::unordered_map<int64_t, std::string>& Mapping::getEnumDef(
-	const std::string& name) const {
+const Mapping::EnumDef& Mapping::getEnumDef(const std::string& name) const {
 	auto it = m_enums.find(name);
 	if (it == m_enums.end()) {
 		throw std::runtime_error("Enum definition not found for key: " + name);
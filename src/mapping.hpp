@@ -2,7 +2,12 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct lua_State;
 
 class Mapping {
    public:
@@ -31,12 +36,76 @@ class Mapping {
 		dcba,
 		badc,
 		cdab,
-		abcdefgh
+		abcdefgh,
+		badcfehg,
+		cdabghef,
+		dcbahgfe,
+		efghabcd,
+		fehgbadc,
+		ghefcdab,
+		hgfedcba
+	};
+
+	/**
+	 * Labels of an enum. Labels are stored as string ids, see getString().
+	 */
+	struct EnumDef {
+		/**
+		 * Finds the label of a value.
+		 * @param value The value.
+		 * @return The string id of the label, or -1 if the value has none.
+		 */
+		int64_t find(int64_t value) const noexcept;
+
+		/**
+		 * Finds the value of a label, for writing enums by label.
+		 * @param label The label.
+		 * @param value Set to the value of the label if found.
+		 * @return False if the enum has no such label.
+		 */
+		bool findValue(std::string_view label, int64_t& value) const noexcept;
+
+		// Small ranges are indexed directly by value - min, with -1 for
+		// values without a label, others are searched in sorted order
+		int64_t min = 0;
+		std::vector<int32_t> direct;
+		std::vector<std::pair<int64_t, uint32_t>> sorted;
+
+		// Labels and their values sorted by label
+		std::vector<std::pair<std::string, int64_t>> values;
+	};
+
+	struct BitfieldFlag {
+		uint16_t bit;
+		uint32_t string;  // String id of the flag name
 	};
 
+	// Flags in ascending bit order
+	using BitfieldDef = std::vector<BitfieldFlag>;
+
+	struct ValueDef;
+
+	/**
+	 * Decodes the registers of a value and pushes it onto the Lua stack.
+	 * Chosen for each value when the mapping is loaded.
+	 * @param strings Stack index of a table holding every string of the
+	 * mapping at its id + 1, or 0 to push the strings from the mapping.
+	 */
+	using ValueDecoder = void (*)(lua_State* L,
+								  const Mapping& mapping,
+								  const ValueDef& def,
+								  const uint16_t* regs,
+								  const char* name,
+								  int strings);
+
 	struct ValueDef {
+		ValueDecoder decode = nullptr;
 		double scale = 1.0;
 		std::string linked;
+		const EnumDef* enumDef = nullptr;		   // Resolved from linked
+		const BitfieldDef* bitfieldDef = nullptr;  // Resolved from linked
+		uint32_t maxAgeMs = 0;	// Serve from cache if younger, 0 disables
+		bool trim = true;		// Strip whitespace around strings
 		uint16_t addr;
 		uint16_t length;
 		ValueDefFormat format;
@@ -44,20 +113,113 @@ class Mapping {
 		ValueDefOrder order;
 	};
 
+	struct AddressRange {
+		uint16_t addr;
+		uint16_t length;
+		ValueDefType type;
+		bool bits;	// Coils or discrete inputs rather than registers
+	};
+
+	/**
+	 * Identifies a value without its name, resolved once with getHandle().
+	 */
+	using Handle = uint32_t;
+
 	Mapping(const char* path);
 
 	const ValueDef& getValueDef(const std::string& name) const;
 
-	const std::unordered_map<uint16_t, std::string>& getBitfieldDef(
-		const std::string& name) const;
+	/**
+	 * Looks up a value definition without allocating once warmed up.
+	 * @param name The name of the value.
+	 * @return The value definition.
+	 */
+	const ValueDef& getValueDef(const char* name) const;
+
+	/**
+	 * Resolves the name of a value to a handle.
+	 * @param name The name of the value.
+	 * @return The handle, an index into the values of the mapping.
+	 */
+	Handle getHandle(const std::string& name) const;
+
+	/**
+	 * Resolves the name of a value to a handle without allocating once
+	 * warmed up.
+	 * @param name The name of the value.
+	 * @return The handle, an index into the values of the mapping.
+	 */
+	Handle getHandle(const char* name) const;
+
+	/**
+	 * Gets a value definition from its handle.
+	 * @param handle A handle returned by getHandle().
+	 * @return The value definition.
+	 */
+	const ValueDef& getValueDefAt(Handle handle) const;
+
+	/**
+	 * Gets the name of a value from its handle.
+	 * @param handle A handle returned by getHandle().
+	 * @return The name of the value.
+	 */
+	const std::string& getName(Handle handle) const;
+
+	/**
+	 * Gets the number of values, every handle is below it.
+	 * @return The number of values.
+	 */
+	Handle getValueCount() const noexcept {
+		return static_cast<Handle>(m_values.size());
+	}
+
+	/**
+	 * Gets the length of the longest value in the mapping.
+	 * @return The number of registers.
+	 */
+	uint16_t getMaxLength() const noexcept { return m_maxLength; }
+
+	/**
+	 * Checks whether a range of registers or bits may be read without
+	 * faulting.
+	 * @param type The type of the registers or bits.
+	 * @param bits Whether the range is of coils or discrete inputs.
+	 * @param addr The first address of the range.
+	 * @param end One past the last address of the range.
+	 * @return False if the range overlaps any range listed as unreadable.
+	 */
+	bool isReadable(ValueDefType type,
+					bool bits,
+					uint32_t addr,
+					uint32_t end) const noexcept;
+
+	const BitfieldDef& getBitfieldDef(const std::string& name) const;
+
+	const EnumDef& getEnumDef(const std::string& name) const;
+
+	/**
+	 * Gets an enum label or bitfield flag name by its id.
+	 * @param id The string id.
+	 * @return The string.
+	 */
+	const std::string& getString(uint32_t id) const { return m_strings[id]; }
 
-	const std::unordered_map<int64_t, std::string>& getEnumDef(
-		const std::string& name) const;
+	/**
+	 * Gets every enum label and bitfield flag name, indexed by string id.
+	 * @return The strings.
+	 */
+	const std::vector<std::string>& getStrings() const noexcept {
+		return m_strings;
+	}
 
    private:
-	std::unordered_map<std::string, ValueDef> m_values;
-	std::unordered_map<std::string, std::unordered_map<uint16_t, std::string>>
-		m_bitfields;
-	std::unordered_map<std::string, std::unordered_map<int64_t, std::string>>
-		m_enums;
+	// Values are stored densely so a handle is a plain index
+	std::vector<ValueDef> m_values;
+	std::vector<std::string> m_names;
+	std::unordered_map<std::string, Handle> m_handles;
+	std::unordered_map<std::string, BitfieldDef> m_bitfields;
+	std::unordered_map<std::string, EnumDef> m_enums;
+	std::vector<std::string> m_strings;
+	std::vector<AddressRange> m_unreadable;
+	uint16_t m_maxLength = 0;
 };
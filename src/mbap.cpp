@@ -0,0 +1,176 @@
+#include "mbap.hpp"
+#include <modbus/modbus.h>
+
+namespace {
+uint8_t* put16(uint8_t* out, uint16_t value) noexcept {
+	out[0] = static_cast<uint8_t>(value >> 8);
+	out[1] = static_cast<uint8_t>(value);
+	return out + 2;
+}
+
+uint16_t get16(const uint8_t* in) noexcept {
+	return static_cast<uint16_t>((in[0] << 8) | in[1]);
+}
+
+bool isBitRead(uint8_t function) noexcept {
+	return function == mbap::READ_COILS ||
+		   function == mbap::READ_DISCRETE_INPUTS;
+}
+
+bool isRegisterRead(uint8_t function) noexcept {
+	return function == mbap::READ_HOLDING_REGISTERS ||
+		   function == mbap::READ_INPUT_REGISTERS ||
+		   function == mbap::WRITE_AND_READ_REGISTERS;
+}
+
+uint8_t* encodePdu(const mbap::Transaction& tx, uint8_t* out) noexcept {
+	*out++ = tx.function;
+	switch (tx.function) {
+		case mbap::READ_COILS:
+		case mbap::READ_DISCRETE_INPUTS:
+			if (tx.nb == 0 || tx.nb > MODBUS_MAX_READ_BITS) {
+				return nullptr;
+			}
+			out = put16(out, tx.addr);
+			return put16(out, tx.nb);
+		case mbap::READ_HOLDING_REGISTERS:
+		case mbap::READ_INPUT_REGISTERS:
+			if (tx.nb == 0 || tx.nb > MODBUS_MAX_READ_REGISTERS) {
+				return nullptr;
+			}
+			out = put16(out, tx.addr);
+			return put16(out, tx.nb);
+		case mbap::WRITE_SINGLE_COIL:
+			out = put16(out, tx.writeAddr);
+			return put16(out, tx.value ? 0xFF00 : 0x0000);
+		case mbap::WRITE_SINGLE_REGISTER:
+			out = put16(out, tx.writeAddr);
+			return put16(out, tx.value);
+		case mbap::WRITE_MULTIPLE_COILS: {
+			if (tx.writeNb == 0 || tx.writeNb > MODBUS_MAX_WRITE_BITS) {
+				return nullptr;
+			}
+			out = put16(out, tx.writeAddr);
+			out = put16(out, tx.writeNb);
+			const uint8_t bytes = static_cast<uint8_t>((tx.writeNb + 7) / 8);
+			*out++ = bytes;
+			for (uint8_t i = 0; i < bytes; ++i) {
+				out[i] = 0;
+			}
+			for (uint16_t i = 0; i < tx.writeNb; ++i) {
+				if (tx.srcBits[i]) {
+					out[i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+				}
+			}
+			return out + bytes;
+		}
+		case mbap::WRITE_MULTIPLE_REGISTERS:
+			if (tx.writeNb == 0 || tx.writeNb > MODBUS_MAX_WRITE_REGISTERS) {
+				return nullptr;
+			}
+			out = put16(out, tx.writeAddr);
+			out = put16(out, tx.writeNb);
+			*out++ = static_cast<uint8_t>(tx.writeNb * 2);
+			for (uint16_t i = 0; i < tx.writeNb; ++i) {
+				out = put16(out, tx.src[i]);
+			}
+			return out;
+		case mbap::MASK_WRITE_REGISTER:
+			out = put16(out, tx.writeAddr);
+			out = put16(out, tx.value);
+			return put16(out, tx.orMask);
+		case mbap::WRITE_AND_READ_REGISTERS:
+			if (tx.nb == 0 || tx.nb > MODBUS_MAX_WR_READ_REGISTERS ||
+				tx.writeNb == 0 ||
+				tx.writeNb > MODBUS_MAX_WR_WRITE_REGISTERS) {
+				return nullptr;
+			}
+			out = put16(out, tx.addr);
+			out = put16(out, tx.nb);
+			out = put16(out, tx.writeAddr);
+			out = put16(out, tx.writeNb);
+			*out++ = static_cast<uint8_t>(tx.writeNb * 2);
+			for (uint16_t i = 0; i < tx.writeNb; ++i) {
+				out = put16(out, tx.src[i]);
+			}
+			return out;
+		default:
+			return nullptr;
+	}
+}
+}  // namespace
+
+size_t mbap::encode(const Transaction& tx,
+					uint8_t unit,
+					uint8_t* frame) noexcept {
+	uint8_t* end = encodePdu(tx, frame + HEADER_SIZE);
+	if (!end) {
+		return 0;
+	}
+
+	// The length counts the unit id and the PDU
+	const size_t size = static_cast<size_t>(end - frame);
+	uint8_t* out = put16(frame, tx.id);
+	out = put16(out, 0);
+	out = put16(out, static_cast<uint16_t>(size - 6));
+	*out = unit;
+	return size;
+}
+
+bool mbap::parse_header(const uint8_t* frame,
+						uint16_t& id,
+						size_t& size) noexcept {
+	const uint16_t length = get16(frame + 4);
+	if (get16(frame + 2) != 0 || length < 2 ||
+		length > MAX_FRAME_SIZE - 6) {
+		return false;
+	}
+	id = get16(frame);
+	size = 6u + length;
+	return true;
+}
+
+void mbap::decode(Transaction& tx, const uint8_t* frame, size_t size) noexcept {
+	const uint8_t* pdu = frame + HEADER_SIZE;
+	const size_t pduSize = size - HEADER_SIZE;
+
+	if (pdu[0] == (tx.function | 0x80)) {
+		tx.error = pduSize >= 2 ? MODBUS_ENOBASE + pdu[1] : EMBBADDATA;
+		return;
+	}
+	tx.error = EMBBADDATA;
+	if (pdu[0] != tx.function) {
+		return;
+	}
+
+	if (isBitRead(tx.function)) {
+		const size_t bytes = (tx.nb + 7u) / 8u;
+		if (pduSize != 2 + bytes || pdu[1] != bytes) {
+			return;
+		}
+		for (uint16_t i = 0; i < tx.nb; ++i) {
+			const uint8_t bit = (pdu[2 + i / 8] >> (i % 8)) & 1u;
+			if (tx.destBits) {
+				tx.destBits[i] = bit;
+			} else {
+				tx.dest[i] = bit;
+			}
+		}
+	} else if (isRegisterRead(tx.function)) {
+		const size_t bytes = tx.nb * 2u;
+		if (pduSize != 2 + bytes || pdu[1] != bytes) {
+			return;
+		}
+		for (uint16_t i = 0; i < tx.nb; ++i) {
+			tx.dest[i] = get16(pdu + 2 + i * 2);
+		}
+	} else {
+		// Writes echo the address, and FC22 the whole request
+		const size_t expected =
+			tx.function == MASK_WRITE_REGISTER ? 7u : 5u;
+		if (pduSize != expected || get16(pdu + 1) != tx.writeAddr) {
+			return;
+		}
+	}
+	tx.error = 0;
+}
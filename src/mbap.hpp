@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Framing of Modbus/TCP requests and responses, for transports that talk to
+ * the socket themselves instead of going through libmodbus.
+ *
+ * A frame is a 7 byte MBAP header (transaction id, protocol id, length and
+ * unit id) followed by the PDU. Errors are reported with the errno values of
+ * libmodbus, so they can be raised as a ModbusException.
+ */
+namespace mbap {
+/** Size of the MBAP header, unit id included. */
+constexpr size_t HEADER_SIZE = 7;
+
+/** Size of the largest frame. */
+constexpr size_t MAX_FRAME_SIZE = 260;
+
+/** Unit id addressing the server itself rather than a slave behind it. */
+constexpr uint8_t DEFAULT_UNIT = 0xFF;
+
+enum Function : uint8_t {
+	READ_COILS = 0x01,
+	READ_DISCRETE_INPUTS = 0x02,
+	READ_HOLDING_REGISTERS = 0x03,
+	READ_INPUT_REGISTERS = 0x04,
+	WRITE_SINGLE_COIL = 0x05,
+	WRITE_SINGLE_REGISTER = 0x06,
+	WRITE_MULTIPLE_COILS = 0x0F,
+	WRITE_MULTIPLE_REGISTERS = 0x10,
+	MASK_WRITE_REGISTER = 0x16,
+	WRITE_AND_READ_REGISTERS = 0x17,
+};
+
+/**
+ * A request and what its response is decoded into. Reads use addr and nb,
+ * writes use writeAddr and writeNb, except single writes which take value.
+ */
+struct Transaction {
+	uint8_t function = 0;
+	uint16_t addr = 0;
+	uint16_t nb = 0;
+	uint16_t* dest = nullptr;		// Registers, or one word per bit
+	uint8_t* destBits = nullptr;	// Bits as one byte each, instead of dest
+	uint16_t writeAddr = 0;
+	uint16_t writeNb = 0;
+	const uint16_t* src = nullptr;	   // Registers to write
+	const uint8_t* srcBits = nullptr;  // Bits to write, one byte each
+	uint16_t value = 0;				   // Single writes, and the AND mask
+	uint16_t orMask = 0;
+
+	uint16_t id = 0;  // Transaction id of the request sent
+	bool pending = false;
+	int error = 0;	   // Set when the response is decoded, 0 on success
+	size_t tag = 0;	   // Free for the caller
+};
+
+/**
+ * Writes the frame of a request.
+ * @param tx The transaction, with its id set.
+ * @param unit The unit id to address.
+ * @param frame Destination buffer of at least MAX_FRAME_SIZE bytes.
+ * @return The size of the frame, or 0 if the request doesn't fit in one.
+ */
+size_t encode(const Transaction& tx, uint8_t unit, uint8_t* frame) noexcept;
+
+/**
+ * Reads the MBAP header of a response.
+ * @param frame The first HEADER_SIZE bytes of the frame.
+ * @param id Set to the transaction id.
+ * @param size Set to the size of the whole frame.
+ * @return false if the header is not a Modbus/TCP one.
+ */
+bool parse_header(const uint8_t* frame, uint16_t& id, size_t& size) noexcept;
+
+/**
+ * Decodes a response into its transaction, setting tx.error on an exception
+ * response or a response not matching the request.
+ * @param tx The transaction the response answers.
+ * @param frame The whole frame, as sized by parse_header().
+ * @param size The size of the frame.
+ */
+void decode(Transaction& tx, const uint8_t* frame, size_t size) noexcept;
+}  // namespace mbap
@@ -1,255 +1,744 @@
 #include "modbus-device-ctx.hpp"
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
 #include <vector>
+#include "read-plan.hpp"
+#include "value-decoders.hpp"
 #include "value-utils.hpp"
 
+namespace {
+// The luaL_check functions would longjmp past the destructors of the write
+// batch being encoded, so values are checked by hand and errors thrown
+lua_Number toNumber(lua_State* L, int index, const char* name) {
+	if (!lua_isnumber(L, index)) {
+		throw std::runtime_error("Number expected for mapping: " +
+								 std::string(name));
+	}
+	return lua_tonumber(L, index);
+}
+
+const char* toString(lua_State* L, int index, size_t* size, const char* name) {
+	if (!lua_isstring(L, index)) {
+		throw std::runtime_error("String expected for mapping: " +
+								 std::string(name));
+	}
+	return lua_tolstring(L, index, size);
+}
+}  // namespace
+
 ModbusDeviceContext::ModbusDeviceContext(std::shared_ptr<ModbusDevice> device,
 										 std::shared_ptr<Mapping>&& mapping,
-										 int deviceId) noexcept
+										 int deviceId)
 	: m_deviceId(deviceId),
 	  m_device(std::move(device)),
-	  m_mapping(std::move(mapping)) {}
+	  m_mapping(std::move(mapping)),
+	  m_scratch(m_mapping->getMaxLength() * 2u, 0) {}
+
+void ModbusDeviceContext::luaInternStrings(lua_State* L) {
+	luaReleaseStrings(L);
+
+	const auto& strings = m_mapping->getStrings();
+	lua_createtable(L, static_cast<int>(strings.size()), 0);
+	for (size_t i = 0; i < strings.size(); ++i) {
+		lua_pushlstring(L, strings[i].c_str(), strings[i].size());
+		lua_rawseti(L, -2, static_cast<int>(i + 1));
+	}
+	m_stringsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+void ModbusDeviceContext::luaReleaseStrings(lua_State* L) noexcept {
+	if (m_stringsRef != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m_stringsRef);
+		m_stringsRef = LUA_NOREF;
+	}
+}
+
+uint32_t ModbusDeviceContext::cacheKey(const Mapping::ValueDef& def) noexcept {
+	// Coils, discrete inputs, holding and input registers are separate address
+	// spaces
+	const uint32_t space =
+		(def.format == Mapping::ValueDefFormat::bit ? 2u : 0u) +
+		(def.type == Mapping::ValueDefType::input ? 1u : 0u);
+	return (space << 16) | def.addr;
+}
+
+void ModbusDeviceContext::invalidateCache(
+	const Mapping::ValueDef& def) noexcept {
+	const uint32_t key = cacheKey(def);
+	const uint32_t first = key & 0xFFFF;
+	const uint32_t last =
+		first + (def.format == Mapping::ValueDefFormat::bit ? 1 : def.length);
+	for (auto it = m_cache.begin(); it != m_cache.end();) {
+		// Same address space, overlapping ranges
+		const uint32_t addr = it->first & 0xFFFF;
+		if ((it->first >> 16) == (key >> 16) && addr < last &&
+			first < addr + it->second.regs.size()) {
+			it = m_cache.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
 
 void ModbusDeviceContext::luaRead(lua_State* L, const char* name) {
 	// Get mapping
 	const auto& def = m_mapping->getValueDef(name);
+	luaPushValue(L, def, readValue(def), name);
+}
+
+void ModbusDeviceContext::luaRead(lua_State* L, Mapping::Handle handle) {
+	const auto& def = m_mapping->getValueDefAt(handle);
+	luaPushValue(L, def, readValue(def), m_mapping->getName(handle).c_str());
+}
+
+void ModbusDeviceContext::luaReadMask(lua_State* L, Mapping::Handle handle) {
+	const auto& def = m_mapping->getValueDefAt(handle);
+	if (def.format != Mapping::ValueDefFormat::bitfield) {
+		throw std::runtime_error("Only bitfields can be read as a mask");
+	}
+	if (def.length > 3) {
+		throw std::runtime_error(
+			"Bitfield is too long to be read as a mask");
+	}
+
+	const uint16_t* regs = readValue(def);
+	uint64_t mask = 0;
+	for (uint16_t i = 0; i < def.length; ++i) {
+		mask |= static_cast<uint64_t>(regs[i]) << (i * 16);
+	}
+	lua_pushnumber(L, static_cast<lua_Number>(mask));
+}
+
+void ModbusDeviceContext::luaReadInto(lua_State* L,
+									  Mapping::Handle handle,
+									  int tableIndex) {
+	const auto& def = m_mapping->getValueDefAt(handle);
+	if (def.format != Mapping::ValueDefFormat::bitfield) {
+		throw std::runtime_error("Only bitfields can be read into a table");
+	}
+	if (tableIndex < 0) {
+		tableIndex = lua_gettop(L) + tableIndex + 1;
+	}
+
+	const uint16_t* regs = readValue(def);
+	if (m_stringsRef == LUA_NOREF) {
+		value_decoders::fillBitfield(L, *m_mapping, def, regs, 0, tableIndex);
+		return;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m_stringsRef);
+	const int strings = lua_gettop(L);
+	value_decoders::fillBitfield(L, *m_mapping, def, regs, strings,
+								 tableIndex);
+	lua_remove(L, strings);
+}
+
+const uint16_t* ModbusDeviceContext::readValue(const Mapping::ValueDef& def) {
+	// Serve slowly changing values from the cache while they are fresh
+	const auto now = std::chrono::steady_clock::now();
+	if (def.maxAgeMs > 0) {
+		auto it = m_cache.find(cacheKey(def));
+		if (it != m_cache.end() && it->second.regs.size() >= def.length &&
+			now - it->second.time <
+				std::chrono::milliseconds(def.maxAgeMs)) {
+			return it->second.regs.data();
+		}
+	}
 
-	std::vector<uint16_t> regsBuffer(def.length, 0);
-	if (def.format != Mapping::ValueDefFormat::bit) {
-		// Pre-read registers if needed
+	const auto lock = lockDevice();
+	uint16_t* regsBuffer = m_scratch.data();
+	if (def.format == Mapping::ValueDefFormat::bit) {
+		// Read single bit
+		uint8_t value = 0;
+		// Since there is only a single bit, we don't need any compatibility
+		// flags
 		if (def.type == Mapping::ValueDefType::input) {
-			m_device->readInputRegisters(def.addr, def.length,
-										 regsBuffer.data());
+			m_device->readInputBits(def.addr, 1, &value);
 		} else {
-			m_device->readRegisters(def.addr, def.length, regsBuffer.data());
+			m_device->readBits(def.addr, 1, &value);
 		}
+		regsBuffer[0] = value != 0 ? 1 : 0;
+	} else if (def.type == Mapping::ValueDefType::input) {
+		m_device->readInputRegisters(def.addr, def.length, regsBuffer);
+	} else {
+		m_device->readRegisters(def.addr, def.length, regsBuffer);
 	}
 
-	switch (def.format) {
-		case Mapping::ValueDefFormat::bit: {
-			// Read single bit
-			uint8_t value = 0;
-			// Since there is only a single bit, we don't need any compatibility
-			// flags
-			if (def.type == Mapping::ValueDefType::input) {
-				m_device->readInputBits(def.addr, 1, &value);
-			} else {
-				m_device->readBits(def.addr, 1, &value);
-			}
-			lua_pushboolean(L, value != 0);
-			return;
+	if (def.maxAgeMs > 0) {
+		// Entries are overwritten in place, so only the first read allocates
+		auto& entry = m_cache[cacheKey(def)];
+		entry.time = now;
+		entry.regs.assign(regsBuffer, regsBuffer + def.length);
+	}
+	return regsBuffer;
+}
+
+void ModbusDeviceContext::luaReadMany(lua_State* L, int index) {
+	const auto names = luaCheckNames(L, index);
+
+	// Read every block of the plan into a shared buffer
+	ReadPlan plan(m_mapping, names, m_device->getTransportCost().maxGap(),
+				  getCapabilities());
+	const uint16_t* regs = executePlan(plan);
+	const double* values = decodeRuns(plan, regs);
+
+	// Decode the values into a table keyed by name
+	const auto& entries = plan.getEntries();
+	lua_createtable(L, 0, static_cast<int>(names.size()));
+	for (size_t i = 0; i < entries.size(); ++i) {
+		luaPushEntry(L, plan, i, regs, values);
+		lua_setfield(L, -2, entries[i].name.c_str());
+	}
+}
+
+std::vector<std::string> ModbusDeviceContext::luaCheckNames(lua_State* L,
+															int index) {
+	// Collect the names from the array part of the table
+	const int count = static_cast<int>(lua_objlen(L, index));
+	std::vector<std::string> names;
+	names.reserve(count);
+	for (int i = 1; i <= count; ++i) {
+		lua_rawgeti(L, index, i);
+		size_t len = 0;
+		const char* name = lua_tolstring(L, -1, &len);
+		if (name == nullptr) {
+			lua_pop(L, 1);
+			throw std::runtime_error("Name at index " + std::to_string(i) +
+									 " is not a string");
 		}
-		case Mapping::ValueDefFormat::u16:
-		case Mapping::ValueDefFormat::i16: {
-			// Read single register
-			uint16_t value = regsBuffer[0];
+		names.emplace_back(name, len);
+		lua_pop(L, 1);
+	}
+	return names;
+}
 
-			// Handle byte order if needed (only ab and ba for 16-bit)
-			value = value_utils::map_byte_order(value, def.order);
+std::shared_ptr<ReadPlan> ModbusDeviceContext::compilePlan(
+	const std::vector<std::string>& names) const {
+	return std::make_shared<ReadPlan>(m_mapping, names,
+									  m_device->getTransportCost().maxGap(),
+									  getCapabilities());
+}
 
-			int16_t value_s = static_cast<int16_t>(value);
+std::shared_ptr<ReadPlan> ModbusDeviceContext::compilePlan() const {
+	return std::make_shared<ReadPlan>(m_mapping,
+									  m_device->getTransportCost().maxGap(),
+									  getCapabilities());
+}
 
-			// Handle scale if not 1.0
-			if (def.scale != 1.0) {
-				value = static_cast<uint16_t>(static_cast<double>(value) *
-											  def.scale);
-				value_s = static_cast<int16_t>(static_cast<double>(value_s) *
-											   def.scale);
-			}
+void ModbusDeviceContext::luaReadPlan(lua_State* L,
+									  const ReadPlan& plan,
+									  int keysIndex,
+									  int tableIndex) {
+	if (&plan.getMapping() != m_mapping.get()) {
+		throw std::runtime_error(
+			"Read plan was compiled for a different mapping");
+	}
 
-			// If there is a linked enum definition, we should return the
-			// corresponding string
-			if (!def.linked.empty()) {
-				const auto& enumDef = m_mapping->getEnumDef(def.linked);
-				int64_t lookupValue = static_cast<int64_t>(value);
-				auto it = enumDef.find(lookupValue);
-				if (it != enumDef.end()) {
-					lua_pushlstring(L, it->second.c_str(), it->second.size());
-				} else {
-					throw std::runtime_error("Enum value not found for value " +
-											 std::to_string(lookupValue) +
-											 " in mapping: " + name);
-				}
-				return;
-			}
+	const uint16_t* regs = executePlan(plan);
+	const double* values = decodeRuns(plan, regs);
 
-			if (def.format == Mapping::ValueDefFormat::i16) {
-				lua_pushinteger(L, static_cast<int16_t>(value));
-			} else {
-				lua_pushinteger(L, value);
-			}
-			return;
+	// The keys are already interned in the keys table, so filling the table
+	// needs no string hashing
+	const size_t count = plan.getEntries().size();
+	for (size_t i = 0; i < count; ++i) {
+		lua_rawgeti(L, keysIndex, static_cast<int>(i + 1));
+		luaPushEntry(L, plan, i, regs, values);
+		lua_rawset(L, tableIndex);
+	}
+}
+
+std::unique_lock<std::recursive_mutex> ModbusDeviceContext::lockDevice()
+	const {
+	std::unique_lock<std::recursive_mutex> lock(m_device->getMutex());
+
+	// Pollers and other contexts on the device select their own slave
+	if (m_deviceId >= 0) {
+		m_device->setSlave(m_deviceId);
+	}
+	return lock;
+}
+
+ModbusDevice::Capabilities ModbusDeviceContext::getCapabilities() const {
+	const auto lock = lockDevice();
+	return m_device->getCapabilities();
+}
+
+const uint16_t* ModbusDeviceContext::executePlan(const ReadPlan& plan) {
+	// The buffer only ever grows, so repeated plans do not allocate
+	if (m_planBuffer.size() < plan.getRegisterCount()) {
+		m_planBuffer.resize(plan.getRegisterCount(), 0);
+	}
+	const auto lock = lockDevice();
+	plan.execute(*m_device, m_planBuffer.data());
+	return m_planBuffer.data();
+}
+
+void ModbusDeviceContext::poll(std::shared_ptr<const ReadPlan> plan,
+							   std::chrono::milliseconds period) {
+	if (&plan->getMapping() != m_mapping.get()) {
+		throw std::runtime_error(
+			"Read plan was compiled for a different mapping");
+	}
+
+	if (!m_poller) {
+		m_poller = std::make_unique<Poller>(m_device, m_deviceId);
+		m_polled.assign(m_mapping->getValueCount(), {-1, 0});
+	}
+	m_poller->stop();
+	const size_t index = m_poller->addPlan(plan, period);
+
+	// A value polled by several plans is taken from the first
+	const auto& entries = plan->getEntries();
+	for (size_t i = 0; i < entries.size(); ++i) {
+		auto& polled = m_polled[m_mapping->getHandle(entries[i].name)];
+		if (polled.first < 0) {
+			polled = {static_cast<int32_t>(index), static_cast<uint32_t>(i)};
 		}
-		case Mapping::ValueDefFormat::u32:
-		case Mapping::ValueDefFormat::i32: {
-			// Read two registers
-			uint32_t value = (static_cast<uint32_t>(regsBuffer[0]) << 16) |
-							 static_cast<uint32_t>(regsBuffer[1]);
+	}
+	if (m_latestBuffer.size() < plan->getRegisterCount()) {
+		m_latestBuffer.resize(plan->getRegisterCount(), 0);
+	}
+	m_poller->start();
+}
 
-			// Handle byte order if needed
-			value = value_utils::map_byte_order(value, def.order);
+void ModbusDeviceContext::stopPolling() noexcept {
+	m_poller.reset();
+	m_polled.clear();
+}
 
-			int32_t value_s = static_cast<int32_t>(value);
+int ModbusDeviceContext::luaLatest(lua_State* L, Mapping::Handle handle) {
+	if (handle >= m_polled.size() || m_polled[handle].first < 0) {
+		// Also validates the handle
+		throw std::runtime_error("Mapping is not polled: " +
+								 m_mapping->getName(handle));
+	}
 
-			// Handle scale if not 1.0
-			if (def.scale != 1.0) {
-				value = static_cast<uint32_t>(static_cast<double>(value) *
-											  def.scale);
-				value_s = static_cast<int32_t>(static_cast<double>(value_s) *
-											   def.scale);
-			}
+	const auto [index, entryIndex] = m_polled[handle];
+	const int64_t timeMs =
+		m_poller->getSnapshot(index).read(m_latestBuffer.data());
+	if (timeMs == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
 
-			// If there is a linked enum definition, we should return the
-			// corresponding string
-			if (!def.linked.empty()) {
-				const auto& enumDef = m_mapping->getEnumDef(def.linked);
-				int64_t lookupValue = static_cast<int64_t>(value);
-				auto it = enumDef.find(lookupValue);
-				if (it != enumDef.end()) {
-					lua_pushlstring(L, it->second.c_str(), it->second.size());
-				} else {
-					throw std::runtime_error(
-						"Enum value not found for value " +
-						std::to_string(lookupValue) +
-						" in mapping: " + std::string(name));
-				}
-				return;
-			}
+	const auto& entry = m_poller->getPlan(index).getEntries()[entryIndex];
+	luaPushValue(L, *entry.def, m_latestBuffer.data() + entry.offset,
+				 entry.name.c_str());
+	lua_pushnumber(L, static_cast<lua_Number>(Poller::now() - timeMs));
+	return 2;
+}
 
-			if (def.format == Mapping::ValueDefFormat::i32) {
-				lua_pushinteger(L, value_s);
-			} else {
-				lua_pushinteger(L, value);
-			}
-			return;
+void ModbusDeviceContext::luaLatestAll(lua_State* L) {
+	lua_newtable(L);
+	if (!m_poller) {
+		return;
+	}
+
+	// Backwards, so a value polled by several plans is taken from the first
+	for (size_t i = m_poller->getPlanCount(); i-- > 0;) {
+		if (m_poller->getSnapshot(i).read(m_latestBuffer.data()) == 0) {
+			continue;
 		}
-		case Mapping::ValueDefFormat::f32: {
-			// Read two registers
-			uint32_t value_raw = (static_cast<uint32_t>(regsBuffer[0]) << 16) |
-								 static_cast<uint32_t>(regsBuffer[1]);
 
-			// Handle byte order if needed
-			value_raw = value_utils::map_byte_order(value_raw, def.order);
+		const auto& plan = m_poller->getPlan(i);
+		const double* values = decodeRuns(plan, m_latestBuffer.data());
+		const auto& entries = plan.getEntries();
+		for (size_t j = 0; j < entries.size(); ++j) {
+			luaPushEntry(L, plan, j, m_latestBuffer.data(), values);
+			lua_setfield(L, -2, entries[j].name.c_str());
+		}
+	}
+}
 
-			// Convert to float
-			float value;
-			memcpy(&value, &value_raw, sizeof(float));
+const double* ModbusDeviceContext::decodeRuns(const ReadPlan& plan,
+											  const uint16_t* regs) {
+	const auto& entries = plan.getEntries();
+	if (m_planValues.size() < entries.size()) {
+		m_planValues.resize(entries.size(), 0.0);
+	}
 
-			// Handle scale if not 1.0
-			if (def.scale != 1.0) {
-				value =
-					static_cast<float>(static_cast<double>(value) * def.scale);
-			}
+	for (const auto& run : plan.getRuns()) {
+		const auto& first = entries[run.first];
+		value_utils::decode_array(regs + first.offset, run.count,
+								  first.def->format, first.def->order,
+								  first.def->scale,
+								  m_planValues.data() + run.first);
+	}
+	return m_planValues.data();
+}
 
-			lua_pushnumber(L, static_cast<lua_Number>(value));
-			return;
+void ModbusDeviceContext::luaPushEntry(lua_State* L,
+									   const ReadPlan& plan,
+									   size_t index,
+									   const uint16_t* regs,
+									   const double* values) {
+	const auto& entry = plan.getEntries()[index];
+	if (entry.bulk) {
+		lua_pushnumber(L, static_cast<lua_Number>(values[index]));
+	} else {
+		luaPushValue(L, *entry.def, regs + entry.offset, entry.name.c_str());
+	}
+}
+
+void ModbusDeviceContext::luaPushValue(lua_State* L,
+									   const Mapping::ValueDef& def,
+									   const uint16_t* regs,
+									   const char* name) {
+	// The decoder was chosen for the format when the mapping was loaded
+	if (def.linked.empty() || m_stringsRef == LUA_NOREF) {
+		def.decode(L, *m_mapping, def, regs, name, 0);
+		return;
+	}
+
+	// Enum labels and flag names come from the interned strings
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m_stringsRef);
+	const int strings = lua_gettop(L);
+	def.decode(L, *m_mapping, def, regs, name, strings);
+	lua_remove(L, strings);
+}
+
+void ModbusDeviceContext::luaWrite(lua_State* L, const char* name) {
+	// Get mapping
+	luaWriteValue(L, m_mapping->getValueDef(name), name);
+}
+
+void ModbusDeviceContext::luaWrite(lua_State* L, Mapping::Handle handle) {
+	luaWriteValue(L, m_mapping->getValueDefAt(handle),
+				  m_mapping->getName(handle).c_str());
+}
+
+void ModbusDeviceContext::luaWriteValue(lua_State* L,
+										const Mapping::ValueDef& def,
+										const char* name) {
+	// Any cached copy is stale once written
+	invalidateCache(def);
+
+	if (def.format == Mapping::ValueDefFormat::bitfield) {
+		// Only the flags given are changed, with a mask write per register
+		uint16_t* masks = m_scratch.data();
+		luaEncodeBitfield(L, -1, def, masks, masks + def.length, name);
+		writeBitfield(def, masks, masks + def.length);
+		return;
+	}
+
+	uint16_t* regsBuffer = m_scratch.data();
+	std::fill(regsBuffer, regsBuffer + def.length, 0);
+	luaEncodeValue(L, -1, def, regsBuffer, name);
+
+	const auto lock = lockDevice();
+	if (def.format == Mapping::ValueDefFormat::bit) {
+		// Write single bit
+		m_device->writeBit(def.addr, static_cast<uint8_t>(regsBuffer[0]));
+	} else if (def.length == 1) {
+		// Write single register
+		m_device->writeRegister(def.addr, regsBuffer[0]);
+	} else {
+		// Write registers
+		m_device->writeRegisters(def.addr, def.length, regsBuffer);
+	}
+}
+
+void ModbusDeviceContext::luaWriteMany(lua_State* L, int index) {
+	WriteBatch batch;
+	luaEncodeWrites(L, index, batch);
+	executeWrites(batch);
+}
+
+void ModbusDeviceContext::luaExchange(lua_State* L,
+									  int writesIndex,
+									  int readsIndex) {
+	WriteBatch batch;
+	luaEncodeWrites(L, writesIndex, batch);
+
+	const auto names = luaCheckNames(L, readsIndex);
+	const auto caps = getCapabilities();
+	ReadPlan plan(m_mapping, names, m_device->getTransportCost().maxGap(),
+				  caps);
+
+	// A single run of holding registers written and a single block of holding
+	// registers read fit in one FC23 transaction, within the limits learned
+	// for the slave. A block bridging gaps is left to executePlan(), which
+	// recovers if the slave refuses them.
+	const auto& blocks = plan.getBlocks();
+	const auto& writes = batch.writes;
+	bool combined = !writes.empty() && batch.bitfieldWrites.empty() &&
+					blocks.size() == 1 && blocks[0].partCount == 1 &&
+					!blocks[0].bits &&
+					blocks[0].type == Mapping::ValueDefType::holding &&
+					blocks[0].length <= ModbusDevice::MAX_WR_READ_REGISTERS &&
+					blocks[0].length <= caps.maxReadRegisters;
+	uint32_t end = combined ? writes.front().def->addr : 0;
+	for (size_t i = 0; combined && i < writes.size(); ++i) {
+		combined = writes[i].def->format != Mapping::ValueDefFormat::bit &&
+				   writes[i].def->addr == end;
+		end += writes[i].def->length;
+	}
+	const uint32_t writeLength =
+		combined ? end - writes.front().def->addr : 0;
+	combined = combined &&
+			   writeLength <= static_cast<uint32_t>(
+								  ModbusDevice::MAX_WR_WRITE_REGISTERS) &&
+			   writeLength <= static_cast<uint32_t>(caps.maxWriteRegisters);
+
+	const uint16_t* regs;
+	if (combined) {
+		// The registers to write follow the registers read in the plan
+		// buffer, which only ever grows
+		const uint32_t readLength = plan.getRegisterCount();
+		if (m_planBuffer.size() < readLength + writeLength) {
+			m_planBuffer.resize(readLength + writeLength, 0);
+		}
+		uint16_t* writeRegs = m_planBuffer.data() + readLength;
+		for (const auto& write : writes) {
+			const uint16_t* src = batch.image.data() + write.offset;
+			writeRegs = std::copy(src, src + write.def->length, writeRegs);
 		}
-		case Mapping::ValueDefFormat::f64: {
-			// Read four registers
-			uint64_t value_raw = (static_cast<uint64_t>(regsBuffer[0]) << 48) |
-								 (static_cast<uint64_t>(regsBuffer[1]) << 32) |
-								 (static_cast<uint64_t>(regsBuffer[2]) << 16) |
-								 static_cast<uint64_t>(regsBuffer[3]);
 
-			// Handle byte order if needed
-			value_raw = value_utils::map_byte_order(value_raw, def.order);
+		const auto lock = lockDevice();
+		m_device->writeAndReadRegisters(
+			writes.front().def->addr, static_cast<int>(writeLength),
+			m_planBuffer.data() + readLength, blocks[0].addr,
+			blocks[0].length, m_planBuffer.data());
+		regs = m_planBuffer.data();
+	} else {
+		executeWrites(batch);
+		regs = executePlan(plan);
+	}
 
-			// Handle scale if not 1.0
-			double value;
-			memcpy(&value, &value_raw, sizeof(double));
-			if (def.scale != 1.0) {
-				value = value * def.scale;
-			}
+	const double* values = decodeRuns(plan, regs);
 
-			lua_pushnumber(L, static_cast<lua_Number>(value));
-			return;
+	// Decode the values into a table keyed by name
+	const auto& entries = plan.getEntries();
+	lua_createtable(L, 0, static_cast<int>(names.size()));
+	for (size_t i = 0; i < entries.size(); ++i) {
+		luaPushEntry(L, plan, i, regs, values);
+		lua_setfield(L, -2, entries[i].name.c_str());
+	}
+}
+
+void ModbusDeviceContext::luaEncodeWrites(lua_State* L,
+										  int index,
+										  WriteBatch& batch) {
+	// Encode every value into a single register image, bitfields are kept
+	// apart as masks since they only change some bits
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		// STACK: ..., name, value
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			lua_pop(L, 2);
+			throw std::runtime_error(
+				"Names of values to write must be strings");
+		}
+		const char* name = lua_tostring(L, -2);
+		const auto& def = m_mapping->getValueDef(name);
+
+		if (def.format == Mapping::ValueDefFormat::bitfield) {
+			const uint32_t offset = static_cast<uint32_t>(batch.masks.size());
+			batch.masks.resize(batch.masks.size() + def.length * 2, 0);
+			luaEncodeBitfield(L, -1, def, batch.masks.data() + offset,
+							  batch.masks.data() + offset + def.length, name);
+			batch.bitfieldWrites.push_back({&def, offset});
+		} else {
+			const uint32_t offset = static_cast<uint32_t>(batch.image.size());
+			batch.image.resize(batch.image.size() + def.length, 0);
+			luaEncodeValue(L, -1, def, batch.image.data() + offset, name);
+			batch.writes.push_back({&def, offset});
 		}
-		case Mapping::ValueDefFormat::str: {
-			// Strings depend heavily on length and order
-			std::string strValue;
-			strValue.resize(def.length * 2, '\0');
-
-			switch (def.order) {
-				case Mapping::ValueDefOrder::ab:
-					printf(
-						"DEBUG: Reading string with ab order and length %d\n",
-						def.length);
-					for (size_t i = 0; i < def.length; ++i) {
-						strValue[i * 2] = static_cast<char>(regsBuffer[i] >> 8);
-						strValue[i * 2 + 1] =
-							static_cast<char>(regsBuffer[i] & 0x00FF);
-					}
-					break;
-				case Mapping::ValueDefOrder::ba:
-					for (size_t i = 0; i < def.length; ++i) {
-						strValue[i * 2] =
-							static_cast<char>(regsBuffer[i] & 0x00FF);
-						strValue[i * 2 + 1] =
-							static_cast<char>(regsBuffer[i] >> 8);
-					}
-					break;
-				case Mapping::ValueDefOrder::a:
-					for (size_t i = 0; i < def.length; ++i) {
-						strValue[i] = static_cast<char>(regsBuffer[i] >> 8);
-					}
-					break;
-				case Mapping::ValueDefOrder::b:
-					for (size_t i = 0; i < def.length; ++i) {
-						strValue[i] = static_cast<char>(regsBuffer[i] & 0x00FF);
-					}
-					break;
-				default:
-					throw std::runtime_error(
-						"Unsupported byte order for str in luaRead for "
-						"mapping: " +
-						std::string(name));
-			}
 
-			// Trim any trailing null characters
-			size_t endPos = strValue.find('\0');
-			if (endPos != std::string::npos) {
-				strValue.resize(endPos);
-			}
+		invalidateCache(def);
 
-			lua_pushlstring(L, strValue.c_str(), strValue.size());
+		lua_pop(L, 1);	// pop the value, keep the name for lua_next
+	}
 
-			return;
+	// Coils and holding registers are written separately in address order
+	std::sort(batch.writes.begin(), batch.writes.end(),
+			  [](const PendingWrite& lhs, const PendingWrite& rhs) {
+				  const bool lhsBit =
+					  lhs.def->format == Mapping::ValueDefFormat::bit;
+				  const bool rhsBit =
+					  rhs.def->format == Mapping::ValueDefFormat::bit;
+				  if (lhsBit != rhsBit) {
+					  return lhsBit < rhsBit;
+				  }
+				  return lhs.def->addr < rhs.def->addr;
+			  });
+
+	// Checked before anything is written, so a bad batch writes nothing
+	for (size_t i = 1; i < batch.writes.size(); ++i) {
+		const auto& prev = *batch.writes[i - 1].def;
+		const auto& next = *batch.writes[i].def;
+		if ((prev.format == Mapping::ValueDefFormat::bit) ==
+				(next.format == Mapping::ValueDefFormat::bit) &&
+			next.addr < static_cast<uint32_t>(prev.addr) + prev.length) {
+			throw std::runtime_error("Values to write overlap at address " +
+									 std::to_string(next.addr));
 		}
-		case Mapping::ValueDefFormat::bitfield: {
-			const auto& bitfieldDef = m_mapping->getBitfieldDef(def.linked);
-			// Loop through values in the def
-			lua_newtable(L);
-			for (const auto& [bitPos, bitName] : bitfieldDef) {
-				uint16_t regIndex = bitPos / 16;
-				uint16_t bitInReg = bitPos % 16;
-				uint16_t regValue = regsBuffer[regIndex];
-				bool bitSet = (regValue & (1u << bitInReg)) != 0;
-				lua_pushboolean(L, bitSet);
-				lua_setfield(L, -2, bitName.c_str());
+	}
+}
+
+void ModbusDeviceContext::executeWrites(const WriteBatch& batch) {
+	const auto lock = lockDevice();
+	const auto& writes = batch.writes;
+
+	// Emit one request per run of contiguous addresses, as long as the slave
+	// accepts. Values are never split, one longer than the slave accepts goes
+	// out whole on its own, as a single write would.
+	const auto& caps = m_device->getCapabilities();
+	std::vector<uint16_t> regs;
+	std::vector<uint8_t> bits;
+	size_t i = 0;
+	while (i < writes.size()) {
+		const bool isBit =
+			writes[i].def->format == Mapping::ValueDefFormat::bit;
+		const int maxLength =
+			isBit ? caps.maxWriteBits : caps.maxWriteRegisters;
+		const uint16_t start = writes[i].def->addr;
+		uint32_t end = start;
+
+		regs.clear();
+		bits.clear();
+		for (; i < writes.size(); ++i) {
+			const auto& write = writes[i];
+			if ((write.def->format == Mapping::ValueDefFormat::bit) != isBit ||
+				write.def->addr > end ||
+				(end != start && end + write.def->length - start >
+									 static_cast<uint32_t>(maxLength))) {
+				break;
 			}
-			return;
+			const uint16_t* src = batch.image.data() + write.offset;
+			if (isBit) {
+				bits.push_back(static_cast<uint8_t>(src[0]));
+			} else {
+				regs.insert(regs.end(), src, src + write.def->length);
+			}
+			end += write.def->length;
 		}
-		default:
-			throw std::runtime_error(
-				"Unsupported format in luaRead for mapping: " +
-				std::string(name));
+
+		if (isBit) {
+			m_device->writeBits(start, static_cast<int>(bits.size()),
+								bits.data());
+		} else {
+			m_device->writeRegisters(start, static_cast<int>(regs.size()),
+									 regs.data());
+		}
+	}
+
+	for (const auto& write : batch.bitfieldWrites) {
+		const uint16_t* src = batch.masks.data() + write.offset;
+		writeBitfield(*write.def, src, src + write.def->length);
 	}
 }
 
-void ModbusDeviceContext::luaWrite(lua_State* L, const char* name) {
-	// Get mapping
-	const auto& def = m_mapping->getValueDef(name);
+void ModbusDeviceContext::luaEncodeBitfield(lua_State* L,
+											int index,
+											const Mapping::ValueDef& def,
+											uint16_t* andMasks,
+											uint16_t* orMasks,
+											const char* name) {
+	if (def.type == Mapping::ValueDefType::input) {
+		throw std::runtime_error(
+			"Input registers and bits are read only for mapping: " +
+			std::string(name));
+	}
+	if (!lua_istable(L, index)) {
+		throw std::runtime_error(
+			"Bitfield values must be written as a table of flags for "
+			"mapping: " +
+			std::string(name));
+	}
+	if (index < 0) {
+		index = lua_gettop(L) + index + 1;
+	}
+
+	// Untouched bits are kept
+	std::fill(andMasks, andMasks + def.length, 0xFFFF);
+	std::fill(orMasks, orMasks + def.length, 0x0000);
+
+	const auto& bitfieldDef = *def.bitfieldDef;
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		// STACK: ..., flag, value
+		const char* flag =
+			lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : nullptr;
+
+		// Find the position of the flag in the bitfield
+		auto it = std::find_if(
+			bitfieldDef.begin(), bitfieldDef.end(), [&](const auto& bit) {
+				return flag && m_mapping->getString(bit.string) == flag;
+			});
+		if (it == bitfieldDef.end() || it->bit / 16 >= def.length) {
+			lua_pop(L, 2);
+			throw std::runtime_error("Unknown flag '" +
+									 std::string(flag ? flag : "?") +
+									 "' in bitfield for mapping: " + name);
+		}
+
+		const uint16_t regIndex = it->bit / 16;
+		const uint16_t mask = static_cast<uint16_t>(1u << (it->bit % 16));
+		andMasks[regIndex] &= ~mask;
+		if (lua_toboolean(L, -1)) {
+			orMasks[regIndex] |= mask;
+		}
+
+		lua_pop(L, 1);	// pop the value, keep the flag for lua_next
+	}
+}
+
+void ModbusDeviceContext::writeBitfield(const Mapping::ValueDef& def,
+										const uint16_t* andMasks,
+										const uint16_t* orMasks) {
+	const auto lock = lockDevice();
+	for (uint16_t i = 0; i < def.length; ++i) {
+		// Registers without any flag to change are left alone
+		if (andMasks[i] != 0xFFFF) {
+			m_device->maskWriteRegister(def.addr + i, andMasks[i], orMasks[i]);
+		}
+	}
+}
+
+bool ModbusDeviceContext::luaToEnumValue(lua_State* L,
+										 int index,
+										 const Mapping::ValueDef& def,
+										 int64_t& value,
+										 const char* name) const {
+	if (def.linked.empty() || lua_type(L, index) != LUA_TSTRING) {
+		return false;
+	}
+
+	size_t size;
+	const char* label = lua_tolstring(L, index, &size);
+	if (!def.enumDef->findValue({label, size}, value)) {
+		throw std::runtime_error("Enum label not found: " +
+								 std::string(label, size) +
+								 " in mapping: " + std::string(name));
+	}
+	return true;
+}
+
+void ModbusDeviceContext::luaEncodeValue(lua_State* L,
+										 int index,
+										 const Mapping::ValueDef& def,
+										 uint16_t* regs,
+										 const char* name) {
+	if (def.type == Mapping::ValueDefType::input) {
+		throw std::runtime_error(
+			"Input registers and bits are read only for mapping: " +
+			std::string(name));
+	}
 
 	switch (def.format) {
 		case Mapping::ValueDefFormat::bit:
-			throw std::runtime_error(
-				"Writing single bits is not supported in luaWrite for "
-				"mapping: " +
-				std::string(name));
+			regs[0] = lua_toboolean(L, index) ? 1 : 0;
+			return;
 		case Mapping::ValueDefFormat::u16:
 		case Mapping::ValueDefFormat::i16: {
-			lua_Integer value = luaL_checkinteger(L, -1);
+			// Enums can be written by label
+			int64_t label;
+			lua_Integer value = luaToEnumValue(L, index, def, label, name)
+									? static_cast<lua_Integer>(label)
+									: static_cast<lua_Integer>(
+										  toNumber(L, index, name));
 
 			// Handle scale if not 1.0
 			if (def.scale != 1.0) {
@@ -257,25 +746,20 @@ void ModbusDeviceContext::luaWrite(lua_State* L, const char* name) {
 												 def.scale);
 			}
 
-			// We don't support enums for writing for now
-			if (!def.linked.empty()) {
-				throw std::runtime_error(
-					"Writing enums is not supported in luaWrite for mapping: " +
-					std::string(name));
-			}
-
 			uint16_t rawValue = static_cast<uint16_t>(value);
 
 			// Handle byte order if needed (only ab and ba for 16-bit)
-			rawValue = value_utils::unmap_byte_order(rawValue, def.order);
-
-			// Write single register
-			m_device->writeRegister(def.addr, rawValue);
+			regs[0] = value_utils::unmap_byte_order(rawValue, def.order);
 			return;
 		}
 		case Mapping::ValueDefFormat::u32:
 		case Mapping::ValueDefFormat::i32: {
-			lua_Integer value = luaL_checkinteger(L, -1);
+			// Enums can be written by label
+			int64_t label;
+			lua_Integer value = luaToEnumValue(L, index, def, label, name)
+									? static_cast<lua_Integer>(label)
+									: static_cast<lua_Integer>(
+										  toNumber(L, index, name));
 
 			// Handle scale if not 1.0
 			if (def.scale != 1.0) {
@@ -283,29 +767,54 @@ void ModbusDeviceContext::luaWrite(lua_State* L, const char* name) {
 												 def.scale);
 			}
 
-			// We don't support enums for writing for now
-			if (!def.linked.empty()) {
-				throw std::runtime_error(
-					"Writing enums is not supported in luaWrite for mapping: " +
-					std::string(name));
-			}
-
 			uint32_t rawValue = static_cast<uint32_t>(value);
 
 			// Handle byte order if needed
 			rawValue = value_utils::unmap_byte_order(rawValue, def.order);
 
-			uint16_t regs[2] = {
-				static_cast<uint16_t>((rawValue >> 16) & 0xFFFF),
-				static_cast<uint16_t>(rawValue & 0xFFFF),
-			};
+			regs[0] = static_cast<uint16_t>((rawValue >> 16) & 0xFFFF);
+			regs[1] = static_cast<uint16_t>(rawValue & 0xFFFF);
+			return;
+		}
+		case Mapping::ValueDefFormat::u64:
+		case Mapping::ValueDefFormat::i64: {
+			// Numbers are used rather than integers, as unsigned values above
+			// the range of lua_Integer would overflow
+			int64_t label;
+			lua_Number value = luaToEnumValue(L, index, def, label, name)
+								   ? static_cast<lua_Number>(label)
+								   : toNumber(L, index, name);
+
+			// Handle scale if not 1.0
+			if (def.scale != 1.0) {
+				value = static_cast<lua_Number>(static_cast<double>(value) /
+												def.scale);
+			}
 
-			// Write registers
-			m_device->writeRegisters(def.addr, 2, regs);
+			const bool isSigned = def.format == Mapping::ValueDefFormat::i64;
+			const double min = isSigned ? -9223372036854775808.0 : 0.0;
+			const double max =
+				isSigned ? 9223372036854775808.0 : 18446744073709551616.0;
+			if (!(value >= min && value < max)) {
+				throw std::runtime_error("Value out of range for mapping: " +
+										 std::string(name));
+			}
+
+			uint64_t rawValue =
+				isSigned ? static_cast<uint64_t>(static_cast<int64_t>(value))
+						 : static_cast<uint64_t>(value);
+
+			// Handle byte order if needed
+			rawValue = value_utils::unmap_byte_order(rawValue, def.order);
+
+			regs[0] = static_cast<uint16_t>((rawValue >> 48) & 0xFFFF);
+			regs[1] = static_cast<uint16_t>((rawValue >> 32) & 0xFFFF);
+			regs[2] = static_cast<uint16_t>((rawValue >> 16) & 0xFFFF);
+			regs[3] = static_cast<uint16_t>(rawValue & 0xFFFF);
 			return;
 		}
 		case Mapping::ValueDefFormat::f32: {
-			lua_Number value = luaL_checknumber(L, -1);
+			lua_Number value = toNumber(L, index, name);
 
 			// Handle scale if not 1.0
 			if (def.scale != 1.0) {
@@ -321,17 +830,12 @@ void ModbusDeviceContext::luaWrite(lua_State* L, const char* name) {
 			// Handle byte order if needed
 			rawValue = value_utils::unmap_byte_order(rawValue, def.order);
 
-			uint16_t regs[2] = {
-				static_cast<uint16_t>((rawValue >> 16) & 0xFFFF),
-				static_cast<uint16_t>(rawValue & 0xFFFF),
-			};
-
-			// Write registers
-			m_device->writeRegisters(def.addr, 2, regs);
+			regs[0] = static_cast<uint16_t>((rawValue >> 16) & 0xFFFF);
+			regs[1] = static_cast<uint16_t>(rawValue & 0xFFFF);
 			return;
 		}
 		case Mapping::ValueDefFormat::f64: {
-			lua_Number value = luaL_checknumber(L, -1);
+			lua_Number value = toNumber(L, index, name);
 
 			// Handle scale if not 1.0
 			if (def.scale != 1.0) {
@@ -347,15 +851,36 @@ void ModbusDeviceContext::luaWrite(lua_State* L, const char* name) {
 			// Handle byte order if needed
 			rawValue = value_utils::unmap_byte_order(rawValue, def.order);
 
-			uint16_t regs[4] = {
-				static_cast<uint16_t>((rawValue >> 48) & 0xFFFF),
-				static_cast<uint16_t>((rawValue >> 32) & 0xFFFF),
-				static_cast<uint16_t>((rawValue >> 16) & 0xFFFF),
-				static_cast<uint16_t>(rawValue & 0xFFFF),
-			};
+			regs[0] = static_cast<uint16_t>((rawValue >> 48) & 0xFFFF);
+			regs[1] = static_cast<uint16_t>((rawValue >> 32) & 0xFFFF);
+			regs[2] = static_cast<uint16_t>((rawValue >> 16) & 0xFFFF);
+			regs[3] = static_cast<uint16_t>(rawValue & 0xFFFF);
+			return;
+		}
+		case Mapping::ValueDefFormat::str: {
+			size_t size;
+			const char* value = toString(L, index, &size, name);
+
+			const bool wide = def.order == Mapping::ValueDefOrder::ab ||
+							  def.order == Mapping::ValueDefOrder::ba;
+			const size_t capacity = wide ? def.length * 2u : def.length;
+			if (size > capacity) {
+				throw std::runtime_error("String too long for mapping: " +
+										 std::string(name));
+			}
 
-			// Write registers
-			m_device->writeRegisters(def.addr, 4, regs);
+			// Shorter strings are padded with null characters
+			std::fill(regs, regs + def.length, 0);
+			if (wide) {
+				value_utils::pack_bytes(
+					value, size, def.order == Mapping::ValueDefOrder::ab, regs);
+			} else {
+				const bool high = def.order == Mapping::ValueDefOrder::a;
+				for (size_t i = 0; i < size; ++i) {
+					const auto c = static_cast<uint8_t>(value[i]);
+					regs[i] = high ? static_cast<uint16_t>(c << 8) : c;
+				}
+			}
 			return;
 		}
 		default:
@@ -1,18 +1,23 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <lua.hpp>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "mapping.hpp"
 #include "modbus-device.hpp"
+#include "poller.hpp"
+#include "read-plan.hpp"
 
 class ModbusDeviceContext {
    public:
 	ModbusDeviceContext(std::shared_ptr<ModbusDevice> device,
 						std::shared_ptr<Mapping>&& mapping,
-						int deviceId = -1) noexcept;
+						int deviceId = -1);
 
 	ModbusDevice& getDevice() const noexcept { return *m_device; }
 
@@ -30,6 +35,109 @@ class ModbusDeviceContext {
 	 */
 	void luaRead(lua_State* L, const char* name);
 
+	/**
+	 * Pushes the value of the mapping with the given handle onto the Lua
+	 * stack, without looking up its name.
+	 * @param L The Lua state.
+	 * @param handle The handle of the mapping, from getHandle().
+	 * @note The value is pushed onto the stack.
+	 */
+	void luaRead(lua_State* L, Mapping::Handle handle);
+
+	/**
+	 * Reads a bitfield and pushes its registers as a single integer, the
+	 * first register holding bits 0 to 15.
+	 * @param L The Lua state.
+	 * @param handle The handle of the bitfield.
+	 * @note Bitfields of up to three registers fit in a Lua number.
+	 */
+	void luaReadMask(lua_State* L, Mapping::Handle handle);
+
+	/**
+	 * Reads a bitfield into an existing table instead of creating one, so
+	 * polling doesn't create garbage.
+	 * @param L The Lua state.
+	 * @param handle The handle of the bitfield.
+	 * @param tableIndex The stack index of the table to fill.
+	 */
+	void luaReadInto(lua_State* L, Mapping::Handle handle, int tableIndex);
+
+	/**
+	 * Resolves the name of a mapping to a handle for luaRead() and
+	 * luaWrite().
+	 * @param name The name of the mapping.
+	 * @return The handle.
+	 */
+	Mapping::Handle getHandle(const char* name) const {
+		return m_mapping->getHandle(name);
+	}
+
+	/**
+	 * Interns every enum label and flag name of the mapping in a table in the
+	 * Lua registry, so that decoding pushes them without hashing.
+	 * @param L The Lua state the context is used from.
+	 */
+	void luaInternStrings(lua_State* L);
+
+	/**
+	 * Releases the table created by luaInternStrings().
+	 * @param L The Lua state the context is used from.
+	 */
+	void luaReleaseStrings(lua_State* L) noexcept;
+
+	/**
+	 * Reads the registers of a value, or takes them from the cache if they
+	 * are fresh enough.
+	 * @param def The definition of the value.
+	 * @return The registers, valid until the next read or write on the
+	 * context. Bits are stored as 0 or 1.
+	 */
+	const uint16_t* readValue(const Mapping::ValueDef& def);
+
+	/**
+	 * Reads several mappings with as few requests as possible and pushes a
+	 * table of name to value onto the Lua stack.
+	 * @param L The Lua state.
+	 * @param index The stack index of the array of names to read.
+	 * @note The table is pushed onto the stack.
+	 */
+	void luaReadMany(lua_State* L, int index);
+
+	/**
+	 * Collects the names from the array part of a Lua table.
+	 * @param L The Lua state.
+	 * @param index The stack index of the array of names.
+	 * @return The names, in array order.
+	 */
+	static std::vector<std::string> luaCheckNames(lua_State* L, int index);
+
+	/**
+	 * Compiles a reusable read plan for the given names.
+	 * @param names The names of the mappings to read.
+	 * @return The plan, which can be executed with luaReadPlan().
+	 */
+	std::shared_ptr<ReadPlan> compilePlan(
+		const std::vector<std::string>& names) const;
+
+	/**
+	 * Compiles a reusable read plan for every value in the mapping.
+	 * @return The plan, which can be executed with luaReadPlan().
+	 */
+	std::shared_ptr<ReadPlan> compilePlan() const;
+
+	/**
+	 * Executes a read plan and stores every value into a Lua table.
+	 * @param L The Lua state.
+	 * @param plan The plan to execute, compiled for this context's mapping.
+	 * @param keysIndex The stack index of an array holding the name of each
+	 * plan entry, in entry order.
+	 * @param tableIndex The stack index of the table to fill.
+	 */
+	void luaReadPlan(lua_State* L,
+					 const ReadPlan& plan,
+					 int keysIndex,
+					 int tableIndex);
+
 	/**
 	 * Writes a value from the Lua stack to the given mapping.
 	 * @param L The Lua state.
@@ -39,9 +147,254 @@ class ModbusDeviceContext {
 	 */
 	void luaWrite(lua_State* L, const char* name);
 
+	/**
+	 * Writes a value from the Lua stack to the mapping with the given handle.
+	 * @param L The Lua state.
+	 * @param handle The handle of the mapping, from getHandle().
+	 * @note The value to write is at the top of the stack.
+	 */
+	void luaWrite(lua_State* L, Mapping::Handle handle);
+
+	/**
+	 * Writes several values with as few requests as possible.
+	 * @param L The Lua state.
+	 * @param index The stack index of the table of name to value to write.
+	 * @note Values at contiguous addresses are written with a single request.
+	 */
+	void luaWriteMany(lua_State* L, int index);
+
+	/**
+	 * Writes several values then reads several values back, in a single FC23
+	 * transaction when the writes and the reads each form one contiguous run
+	 * of holding registers. Pushes a table of name to value read.
+	 * @param L The Lua state.
+	 * @param writesIndex The stack index of the table of name to value to
+	 * write.
+	 * @param readsIndex The stack index of the array of names to read.
+	 * @note The table is pushed onto the stack.
+	 */
+	void luaExchange(lua_State* L, int writesIndex, int readsIndex);
+
+	/**
+	 * Drops every value cached for mappings with a max_age_ms, and the
+	 * registers kept by mask writes to slaves lacking them.
+	 */
+	void clearCache() noexcept {
+		m_cache.clear();
+		m_device->forgetMaskedRegisters();
+	}
+
+	/**
+	 * Polls a plan in the background, restarting polling with every plan
+	 * added so far. The device must be connected.
+	 * @param plan The plan, compiled for this context's mapping.
+	 * @param period The time between two executions of the plan.
+	 */
+	void poll(std::shared_ptr<const ReadPlan> plan,
+			  std::chrono::milliseconds period);
+
+	/**
+	 * Stops polling and forgets every polled plan.
+	 */
+	void stopPolling() noexcept;
+
+	/**
+	 * Pushes the latest polled value of a mapping and its age in
+	 * milliseconds, or nil if it hasn't been polled successfully yet.
+	 * Never waits on the device.
+	 * @param L The Lua state.
+	 * @param handle The handle of the mapping, which must be polled.
+	 * @return The number of values pushed.
+	 */
+	int luaLatest(lua_State* L, Mapping::Handle handle);
+
+	/**
+	 * Pushes a table of name to latest polled value, for every plan polled
+	 * successfully at least once.
+	 * @param L The Lua state.
+	 * @note The table is pushed onto the stack.
+	 */
+	void luaLatestAll(lua_State* L);
+
    private:
+	struct CacheEntry {
+		std::chrono::steady_clock::time_point time;
+		std::vector<uint16_t> regs;
+	};
+
+	/**
+	 * Gets the key of a value in the register cache.
+	 * @param def The definition of the value.
+	 * @return A key unique to the address space and address of the value.
+	 */
+	static uint32_t cacheKey(const Mapping::ValueDef& def) noexcept;
+
+	/**
+	 * Drops every cached value sharing registers with a value being written,
+	 * whether or not that value is cached itself.
+	 * @param def The definition of the value written.
+	 */
+	void invalidateCache(const Mapping::ValueDef& def) noexcept;
+
+	struct PendingWrite {
+		const Mapping::ValueDef* def;
+		uint32_t offset;  // Offset of the value in the image or masks
+	};
+
+	struct WriteBatch {
+		std::vector<PendingWrite> writes;  // Sorted by address space and addr
+		std::vector<PendingWrite> bitfieldWrites;
+		std::vector<uint16_t> image;
+		std::vector<uint16_t> masks;  // AND masks then OR masks per bitfield
+	};
+
+	/**
+	 * Encodes a table of name to value from the Lua stack into a batch.
+	 * @param L The Lua state.
+	 * @param index The stack index of the table, must not be relative.
+	 * @param batch The batch to encode into.
+	 */
+	void luaEncodeWrites(lua_State* L, int index, WriteBatch& batch);
+
+	/**
+	 * Writes a batch with one request per run of contiguous addresses.
+	 * @param batch The batch to write.
+	 */
+	void executeWrites(const WriteBatch& batch);
+
+	/**
+	 * Writes a value from the top of the Lua stack.
+	 * @param L The Lua state.
+	 * @param def The definition of the value.
+	 * @param name The name of the mapping, used for error messages.
+	 */
+	void luaWriteValue(lua_State* L,
+					   const Mapping::ValueDef& def,
+					   const char* name);
+
+	/**
+	 * Decodes a value from its registers and pushes it onto the Lua stack.
+	 * @param L The Lua state.
+	 * @param def The definition of the value.
+	 * @param regs The registers holding the value, bits are stored as 0 or 1.
+	 * @param name The name of the mapping, used for error messages.
+	 */
+	void luaPushValue(lua_State* L,
+					  const Mapping::ValueDef& def,
+					  const uint16_t* regs,
+					  const char* name);
+
+	/**
+	 * Encodes a value from the Lua stack into its registers.
+	 * @param L The Lua state.
+	 * @param index The stack index of the value.
+	 * @param def The definition of the value.
+	 * @param regs The registers to encode into, bits are stored as 0 or 1.
+	 * @param name The name of the mapping, used for error messages.
+	 */
+	void luaEncodeValue(lua_State* L,
+						int index,
+						const Mapping::ValueDef& def,
+						uint16_t* regs,
+						const char* name);
+
+	/**
+	 * Gets the value of an enum label given instead of a number.
+	 * @param L The Lua state.
+	 * @param index The stack index of the value.
+	 * @param def The definition of the value.
+	 * @param value Set to the value of the label.
+	 * @param name The name of the mapping, used for error messages.
+	 * @return False if the value isn't a label of an enum.
+	 */
+	bool luaToEnumValue(lua_State* L,
+						int index,
+						const Mapping::ValueDef& def,
+						int64_t& value,
+						const char* name) const;
+
+	/**
+	 * Encodes a table of flag to boolean from the Lua stack into the masks
+	 * of a mask write.
+	 * @param L The Lua state.
+	 * @param index The stack index of the table of flags.
+	 * @param def The definition of the bitfield.
+	 * @param andMasks The bits to keep, one mask per register.
+	 * @param orMasks The bits to set, one mask per register.
+	 * @param name The name of the mapping, used for error messages.
+	 */
+	void luaEncodeBitfield(lua_State* L,
+						   int index,
+						   const Mapping::ValueDef& def,
+						   uint16_t* andMasks,
+						   uint16_t* orMasks,
+						   const char* name);
+
+	/**
+	 * Writes the changed registers of a bitfield with mask writes.
+	 * @param def The definition of the bitfield.
+	 * @param andMasks The bits to keep, one mask per register.
+	 * @param orMasks The bits to set, one mask per register.
+	 */
+	void writeBitfield(const Mapping::ValueDef& def,
+					   const uint16_t* andMasks,
+					   const uint16_t* orMasks);
+
+	/**
+	 * Locks the device and selects the slave of this context, which a poller
+	 * or another context may have changed since.
+	 * @return The lock, held until the end of the transaction.
+	 */
+	std::unique_lock<std::recursive_mutex> lockDevice() const;
+
+	/** Gets what the slave of this context accepts. */
+	ModbusDevice::Capabilities getCapabilities() const;
+
+	/**
+	 * Reads every block of the plan into the context's plan buffer.
+	 * @param plan The plan to execute.
+	 * @return The register buffer of the plan.
+	 */
+	const uint16_t* executePlan(const ReadPlan& plan);
+
+	/**
+	 * Decodes the runs of a plan in bulk into the context's value buffer.
+	 * @param plan The plan that was executed.
+	 * @param regs The register buffer of the plan.
+	 * @return The decoded values indexed like the entries of the plan, only
+	 * valid for entries in a run.
+	 */
+	const double* decodeRuns(const ReadPlan& plan, const uint16_t* regs);
+
+	/**
+	 * Pushes a value of an executed plan onto the Lua stack.
+	 * @param L The Lua state.
+	 * @param plan The plan that was executed.
+	 * @param index The index of the entry in the plan.
+	 * @param regs The register buffer of the plan.
+	 * @param values The values returned by decodeRuns().
+	 */
+	void luaPushEntry(lua_State* L,
+					  const ReadPlan& plan,
+					  size_t index,
+					  const uint16_t* regs,
+					  const double* values);
+
 	int m_deviceId = 0;
 
 	std::shared_ptr<ModbusDevice> m_device;
 	std::shared_ptr<Mapping> m_mapping;
+
+	// Sized for the longest value in the mapping, so single reads and writes
+	// don't allocate
+	std::vector<uint16_t> m_scratch;
+	std::vector<uint16_t> m_planBuffer;
+	std::vector<double> m_planValues;
+	std::unordered_map<uint32_t, CacheEntry> m_cache;
+	int m_stringsRef = LUA_NOREF;
+
+	std::unique_ptr<Poller> m_poller;
+	// Plan and entry of every polled value by handle, plan -1 if not polled
+	std::vector<std::pair<int32_t, uint32_t>> m_polled;
+	std::vector<uint16_t> m_latestBuffer;
 };
@@ -0,0 +1,181 @@
+#include "modbus-device-mbap.hpp"
+#include <modbus/modbus.h>
+#include <algorithm>
+#include <cerrno>
+
+unsigned int ModbusDeviceMbap::readBits(int addr, int nb, uint8_t* dest) {
+	mbap::Transaction tx;
+	tx.function = mbap::READ_COILS;
+	tx.addr = static_cast<uint16_t>(addr);
+	tx.nb = static_cast<uint16_t>(nb);
+	tx.destBits = dest;
+	return executeOne(tx, static_cast<unsigned int>(nb));
+}
+
+unsigned int ModbusDeviceMbap::readInputBits(int addr, int nb, uint8_t* dest) {
+	mbap::Transaction tx;
+	tx.function = mbap::READ_DISCRETE_INPUTS;
+	tx.addr = static_cast<uint16_t>(addr);
+	tx.nb = static_cast<uint16_t>(nb);
+	tx.destBits = dest;
+	return executeOne(tx, static_cast<unsigned int>(nb));
+}
+
+unsigned int ModbusDeviceMbap::readRegisters(int addr, int nb, uint16_t* dest) {
+	mbap::Transaction tx;
+	tx.function = mbap::READ_HOLDING_REGISTERS;
+	tx.addr = static_cast<uint16_t>(addr);
+	tx.nb = static_cast<uint16_t>(nb);
+	tx.dest = dest;
+	return executeOne(tx, static_cast<unsigned int>(nb));
+}
+
+unsigned int ModbusDeviceMbap::readInputRegisters(int addr,
+												  int nb,
+												  uint16_t* dest) {
+	mbap::Transaction tx;
+	tx.function = mbap::READ_INPUT_REGISTERS;
+	tx.addr = static_cast<uint16_t>(addr);
+	tx.nb = static_cast<uint16_t>(nb);
+	tx.dest = dest;
+	return executeOne(tx, static_cast<unsigned int>(nb));
+}
+
+unsigned int ModbusDeviceMbap::writeBit(int addr, uint8_t value) {
+	mbap::Transaction tx;
+	tx.function = mbap::WRITE_SINGLE_COIL;
+	tx.writeAddr = static_cast<uint16_t>(addr);
+	tx.value = value;
+	return executeOne(tx, 1);
+}
+
+unsigned int ModbusDeviceMbap::writeBits(int addr, int nb, const uint8_t* src) {
+	mbap::Transaction tx;
+	tx.function = mbap::WRITE_MULTIPLE_COILS;
+	tx.writeAddr = static_cast<uint16_t>(addr);
+	tx.writeNb = static_cast<uint16_t>(nb);
+	tx.srcBits = src;
+	return executeOne(tx, static_cast<unsigned int>(nb));
+}
+
+unsigned int ModbusDeviceMbap::writeRegister(int addr, uint16_t value) {
+	mbap::Transaction tx;
+	tx.function = mbap::WRITE_SINGLE_REGISTER;
+	tx.writeAddr = static_cast<uint16_t>(addr);
+	tx.value = value;
+	return executeOne(tx, 1);
+}
+
+unsigned int ModbusDeviceMbap::writeRegisters(int addr,
+											  int nb,
+											  const uint16_t* src) {
+	mbap::Transaction tx;
+	tx.function = mbap::WRITE_MULTIPLE_REGISTERS;
+	tx.writeAddr = static_cast<uint16_t>(addr);
+	tx.writeNb = static_cast<uint16_t>(nb);
+	tx.src = src;
+	return executeOne(tx, static_cast<unsigned int>(nb));
+}
+
+int ModbusDeviceMbap::requestMaskWrite(int addr,
+									   uint16_t andMask,
+									   uint16_t orMask) {
+	mbap::Transaction tx;
+	tx.function = mbap::MASK_WRITE_REGISTER;
+	tx.writeAddr = static_cast<uint16_t>(addr);
+	tx.value = andMask;
+	tx.orMask = orMask;
+	try {
+		return static_cast<int>(executeOne(tx, 1));
+	} catch (const ModbusException& ex) {
+		errno = ex.getError();
+		return -1;
+	}
+}
+
+int ModbusDeviceMbap::requestWriteAndRead(int writeAddr,
+										  int writeNb,
+										  const uint16_t* src,
+										  int readAddr,
+										  int readNb,
+										  uint16_t* dest) {
+	mbap::Transaction tx;
+	tx.function = mbap::WRITE_AND_READ_REGISTERS;
+	tx.addr = static_cast<uint16_t>(readAddr);
+	tx.nb = static_cast<uint16_t>(readNb);
+	tx.dest = dest;
+	tx.writeAddr = static_cast<uint16_t>(writeAddr);
+	tx.writeNb = static_cast<uint16_t>(writeNb);
+	tx.src = src;
+	try {
+		return static_cast<int>(
+			executeOne(tx, static_cast<unsigned int>(readNb)));
+	} catch (const ModbusException& ex) {
+		errno = ex.getError();
+		return -1;
+	}
+}
+
+void ModbusDeviceMbap::readRanges(const ReadRange* ranges, size_t count) {
+	buildReads(ranges, count, getCapabilities(), m_reads);
+	execute(m_reads.data(), m_reads.size());
+
+	// A range rejected as too large is read again on its own, learning the
+	// limit of the slave on the way
+	size_t retried = count;
+	for (const auto& tx : m_reads) {
+		if (tx.error == 0 || tx.tag == retried) {
+			continue;
+		}
+		if (tx.error != EMBXILVAL) {
+			throw ModbusException(tx.error);
+		}
+		retried = tx.tag;
+		ModbusDevice::readRanges(&ranges[tx.tag], 1);
+	}
+}
+
+void ModbusDeviceMbap::buildReads(
+	const ReadRange* ranges,
+	size_t count,
+	const Capabilities& caps,
+	std::vector<mbap::Transaction>& transactions) {
+	transactions.clear();
+	for (size_t i = 0; i < count; ++i) {
+		const auto& range = ranges[i];
+		const int limit =
+			range.bits ? caps.maxReadBits : caps.maxReadRegisters;
+		for (int done = 0; done < range.nb;) {
+			const int chunk = std::min(range.nb - done, limit);
+
+			mbap::Transaction tx;
+			if (range.bits) {
+				tx.function =
+					range.input ? mbap::READ_DISCRETE_INPUTS : mbap::READ_COILS;
+			} else {
+				tx.function = range.input ? mbap::READ_INPUT_REGISTERS
+										  : mbap::READ_HOLDING_REGISTERS;
+			}
+			tx.addr = static_cast<uint16_t>(range.addr + done);
+			tx.nb = static_cast<uint16_t>(chunk);
+			tx.dest = range.dest + done;
+			tx.tag = i;
+			transactions.push_back(tx);
+
+			done += chunk;
+		}
+	}
+}
+
+unsigned int ModbusDeviceMbap::executeOne(mbap::Transaction& tx,
+										  unsigned int result) {
+	execute(&tx, 1);
+	if (tx.error != 0) {
+		throw ModbusException(tx.error);
+	}
+	return result;
+}
+
+uint8_t ModbusDeviceMbap::getUnit() const noexcept {
+	return m_slave < 0 ? mbap::DEFAULT_UNIT : static_cast<uint8_t>(m_slave);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "mbap.hpp"
+#include "modbus-device.hpp"
+
+/**
+ * Modbus/TCP device that frames requests itself instead of going through
+ * libmodbus. Every request is turned into mbap::Transaction objects, which
+ * subclasses execute on their own transport, several at a time if they can.
+ */
+class ModbusDeviceMbap : public ModbusDeviceTcp {
+   public:
+	unsigned int readBits(int addr, int nb, uint8_t* dest) override;
+	unsigned int readInputBits(int addr, int nb, uint8_t* dest) override;
+	unsigned int readRegisters(int addr, int nb, uint16_t* dest) override;
+	unsigned int readInputRegisters(int addr, int nb, uint16_t* dest) override;
+	unsigned int writeBit(int addr, uint8_t value) override;
+	unsigned int writeBits(int addr, int nb, const uint8_t* src) override;
+	unsigned int writeRegister(int addr, uint16_t value) override;
+	unsigned int writeRegisters(int addr, int nb, const uint16_t* src) override;
+
+	/**
+	 * Reads the ranges with all of their requests executed together. Ranges
+	 * the slave rejects as too large are read again one request at a time,
+	 * which lowers the limit.
+	 */
+	void readRanges(const ReadRange* ranges, size_t count) override;
+
+	/**
+	 * Splits ranges into read transactions the slave accepts, each tagged
+	 * with the index of its range.
+	 * @param ranges The ranges to read.
+	 * @param count The number of ranges.
+	 * @param caps The limits of the slave.
+	 * @param transactions Replaced with the transactions.
+	 */
+	static void buildReads(const ReadRange* ranges,
+						   size_t count,
+						   const Capabilities& caps,
+						   std::vector<mbap::Transaction>& transactions);
+
+	/** Gets the unit id of the current slave. */
+	uint8_t getUnit() const noexcept;
+
+   protected:
+	ModbusDeviceMbap() noexcept = default;
+
+	int requestMaskWrite(int addr, uint16_t andMask, uint16_t orMask) override;
+	int requestWriteAndRead(int writeAddr,
+							int writeNb,
+							const uint16_t* src,
+							int readAddr,
+							int readNb,
+							uint16_t* dest) override;
+
+	/**
+	 * Executes transactions. Errors of the responses are left in each
+	 * transaction.
+	 * @throws ModbusException If the transport fails.
+	 */
+	virtual void execute(mbap::Transaction* transactions, size_t count) = 0;
+
+	/**
+	 * Executes a single transaction.
+	 * @return The result given.
+	 * @throws ModbusException If the transaction failed.
+	 */
+	unsigned int executeOne(mbap::Transaction& tx, unsigned int result);
+
+   private:
+	std::vector<mbap::Transaction> m_reads;
+};
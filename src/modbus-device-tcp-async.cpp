@@ -0,0 +1,91 @@
+#include "modbus-device-tcp-async.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+
+ModbusDeviceTcpAsync::ModbusDeviceTcpAsync(const char* host,
+										   int port,
+										   unsigned int window,
+										   std::shared_ptr<EventLoop> loop)
+	: m_loop(loop ? std::move(loop) : EventLoop::shared()),
+	  m_host(host),
+	  m_port(port) {
+	if (window == 0) {
+		throw std::invalid_argument("Window must be at least 1");
+	}
+	m_options.window = window;
+}
+
+ModbusDeviceTcpAsync::~ModbusDeviceTcpAsync() {
+	close();
+}
+
+void ModbusDeviceTcpAsync::connect() {
+	close();
+
+	// Only the first attempt is reported, the loop keeps retrying on its own
+	struct Attempt {
+		std::promise<int> result;
+		bool reported = false;	// Only touched on the loop thread
+	};
+	auto attempt = std::make_shared<Attempt>();
+	auto result = attempt->result.get_future();
+	m_connection =
+		m_loop->open(m_host, m_port, m_options, [attempt](int error) {
+			if (!attempt->reported) {
+				attempt->reported = true;
+				attempt->result.set_value(error);
+			}
+		});
+
+	const int error = result.get();
+	if (error != 0) {
+		close();
+		throw ModbusException(error);
+	}
+	m_connected = true;
+}
+
+void ModbusDeviceTcpAsync::close() noexcept {
+	m_connected = false;
+	const auto connection = m_connection.exchange(0);
+	if (connection == 0) {
+		return;
+	}
+	try {
+		m_loop->close(connection);
+	} catch (const std::exception&) {
+		// Only fails to allocate, the connection then dies with the loop
+	}
+}
+
+void ModbusDeviceTcpAsync::submit(uint8_t unit,
+								  mbap::Transaction* transactions,
+								  size_t count,
+								  std::function<void()> done) {
+	const auto start = std::chrono::steady_clock::now();
+	m_loop->submit(
+		m_connection, unit, transactions, count,
+		[this, transactions, count, start, done = std::move(done)] {
+			const size_t errors = std::count_if(
+				transactions, transactions + count,
+				[](const mbap::Transaction& tx) { return tx.error != 0; });
+			recordFrames(count, errors,
+						 std::chrono::steady_clock::now() - start);
+			done();
+		});
+}
+
+void ModbusDeviceTcpAsync::execute(mbap::Transaction* transactions,
+								   size_t count) {
+	if (m_connection == 0) {
+		throw ModbusException(EBADF);
+	}
+
+	std::promise<void> done;
+	auto future = done.get_future();
+	submit(getUnit(), transactions, count, [&done] { done.set_value(); });
+	future.wait();
+}
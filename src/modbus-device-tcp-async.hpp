@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include "event-loop.hpp"
+#include "mbap.hpp"
+#include "modbus-device-mbap.hpp"
+
+/**
+ * Modbus/TCP device whose connection is driven by an EventLoop, so a single
+ * thread serves any number of them. The loop keeps the connection up on its
+ * own once connected, requests failing with ENOTCONN while it is down.
+ *
+ * Calls block until their requests are done, like the other devices. Pollers
+ * instead submit requests and are called back on the loop thread, so they
+ * never hold a thread while waiting for the device.
+ */
+class ModbusDeviceTcpAsync : public ModbusDeviceMbap {
+   public:
+	/**
+	 * @param host The address or host name of the server.
+	 * @param port The TCP port of the server.
+	 * @param window The number of requests kept in flight, from 1 for
+	 * servers that handle a single request at a time.
+	 * @param loop The loop to drive the connection from, the shared one if
+	 * null.
+	 */
+	ModbusDeviceTcpAsync(const char* host,
+						 int port,
+						 unsigned int window,
+						 std::shared_ptr<EventLoop> loop = nullptr);
+
+	~ModbusDeviceTcpAsync() override;
+
+	/**
+	 * Connects, waiting for the first attempt only.
+	 * @throws ModbusException If the attempt fails.
+	 */
+	void connect() override;
+	void close() noexcept override;
+
+	/** Responses are never left waiting to be read, there is none to drop. */
+	unsigned int flush() override { return 0; }
+
+	/**
+	 * Sets the time to wait for the connection and for each response, from
+	 * the next connection on.
+	 * @param ms The timeout in milliseconds.
+	 */
+	void setTimeout(unsigned int ms) noexcept { m_options.timeoutMs = ms; }
+
+	unsigned int getWindow() const noexcept { return m_options.window; }
+
+	EventLoop& getLoop() const noexcept { return *m_loop; }
+
+	/**
+	 * Submits transactions without waiting for them, see EventLoop::submit().
+	 * @param unit The unit id to address.
+	 * @param transactions The transactions, which must stay valid until done
+	 * is called.
+	 * @param count The number of transactions.
+	 * @param done Called on the loop thread once all of them are complete.
+	 */
+	void submit(uint8_t unit,
+				mbap::Transaction* transactions,
+				size_t count,
+				std::function<void()> done);
+
+   protected:
+	/** Blocks until done, so it must not be called from the loop thread. */
+	void execute(mbap::Transaction* transactions, size_t count) override;
+
+   private:
+	std::shared_ptr<EventLoop> m_loop;
+	std::string m_host;
+	int m_port;
+	EventLoop::ConnectionOptions m_options;
+	// Read by pollers on the loop thread
+	std::atomic<EventLoop::ConnectionId> m_connection{0};
+};
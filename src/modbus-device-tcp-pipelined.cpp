@@ -0,0 +1,264 @@
+#include "modbus-device-tcp-pipelined.hpp"
+#include <fcntl.h>
+#include <modbus/modbus.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Waits for the socket to be ready.
+ * @return false on timeout, with errno set.
+ */
+bool waitFor(int socket, short events, Clock::time_point deadline) {
+	for (;;) {
+		const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+			deadline - Clock::now());
+		pollfd fd = {socket, events, 0};
+		const int rc =
+			::poll(&fd, 1, static_cast<int>(std::max<int64_t>(left.count(), 0)));
+		if (rc > 0) {
+			return true;
+		}
+		if (rc == 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+}
+
+/**
+ * Connects a non-blocking socket to one of the addresses of a host.
+ * @return The socket, or -1 with errno set.
+ */
+int connectTo(const addrinfo& info, Clock::time_point deadline) {
+	const int fd = ::socket(info.ai_family,
+							info.ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+							info.ai_protocol);
+	if (fd == -1) {
+		return -1;
+	}
+
+	// Requests are small and sent back to back, Nagle would hold them back
+	const int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	int error = 0;
+	if (::connect(fd, info.ai_addr, info.ai_addrlen) == -1) {
+		error = errno;
+		if (error == EINPROGRESS) {
+			socklen_t size = sizeof(error);
+			if (!waitFor(fd, POLLOUT, deadline)) {
+				error = errno;
+			} else if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) ==
+					   -1) {
+				error = errno;
+			}
+		}
+	}
+	if (error != 0) {
+		::close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+}  // namespace
+
+ModbusDeviceTcpPipelined::ModbusDeviceTcpPipelined(const char* host,
+												   int port,
+												   unsigned int window)
+	: m_host(host), m_port(port), m_window(window) {
+	if (window == 0 || window > MAX_WINDOW) {
+		throw std::invalid_argument("Window must be between 1 and " +
+									std::to_string(MAX_WINDOW));
+	}
+}
+
+ModbusDeviceTcpPipelined::~ModbusDeviceTcpPipelined() {
+	close();
+}
+
+void ModbusDeviceTcpPipelined::connect() {
+	close();
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* infos = nullptr;
+	const std::string port = std::to_string(m_port);
+	const int rc = ::getaddrinfo(m_host.c_str(), port.c_str(), &hints, &infos);
+	if (rc != 0) {
+		throw std::runtime_error("Failed to resolve " + m_host + ": " +
+								 gai_strerror(rc));
+	}
+
+	const auto deadline = Clock::now() + std::chrono::milliseconds(m_timeoutMs);
+	int error = ECONNREFUSED;
+	for (addrinfo* info = infos; info && m_socket == -1; info = info->ai_next) {
+		m_socket = connectTo(*info, deadline);
+		error = errno;
+	}
+	::freeaddrinfo(infos);
+	if (m_socket == -1) {
+		throw ModbusException(error);
+	}
+
+	m_receivedSize = 0;
+	m_connected = true;
+}
+
+void ModbusDeviceTcpPipelined::close() noexcept {
+	m_connected = false;
+	if (m_socket != -1) {
+		::close(m_socket);
+		m_socket = -1;
+	}
+}
+
+unsigned int ModbusDeviceTcpPipelined::flush() {
+	size_t dropped = m_receivedSize;
+	m_receivedSize = 0;
+	if (m_socket == -1) {
+		return static_cast<unsigned int>(dropped);
+	}
+
+	for (;;) {
+		const ssize_t rc = ::recv(m_socket, m_received.data(),
+								  m_received.size(), MSG_DONTWAIT);
+		if (rc > 0) {
+			dropped += static_cast<size_t>(rc);
+		} else if (rc == -1 && errno == EINTR) {
+			continue;
+		} else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return static_cast<unsigned int>(dropped);
+		} else {
+			fail(rc == 0 ? ECONNRESET : errno);
+		}
+	}
+}
+
+void ModbusDeviceTcpPipelined::execute(mbap::Transaction* transactions,
+									   size_t count) {
+	if (m_socket == -1) {
+		throw ModbusException(EBADF);
+	}
+
+	const auto start = Clock::now();
+	size_t sent = 0;
+	size_t done = 0;
+	try {
+		while (done < count) {
+			while (sent < count && sent - done < m_window) {
+				send(transactions[sent++]);
+			}
+			receive(transactions, sent);
+			++done;
+		}
+	} catch (const ModbusException&) {
+		recordFrames(sent, sent - done, Clock::now() - start);
+		throw;
+	}
+
+	const size_t errors =
+		std::count_if(transactions, transactions + count,
+					  [](const mbap::Transaction& tx) { return tx.error != 0; });
+	recordFrames(count, errors, Clock::now() - start);
+}
+
+void ModbusDeviceTcpPipelined::send(mbap::Transaction& tx) {
+	tx.id = m_nextId++;
+	tx.error = 0;
+	const size_t size = mbap::encode(tx, getUnit(), m_frame.data());
+	if (size == 0) {
+		throw ModbusException(EMBMDATA);
+	}
+
+	const auto deadline = Clock::now() + std::chrono::milliseconds(m_timeoutMs);
+	for (size_t written = 0; written < size;) {
+		const ssize_t rc = ::send(m_socket, m_frame.data() + written,
+								  size - written, MSG_NOSIGNAL);
+		if (rc >= 0) {
+			written += static_cast<size_t>(rc);
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (!waitFor(m_socket, POLLOUT, deadline)) {
+				fail(errno);
+			}
+		} else if (errno != EINTR) {
+			fail(errno);
+		}
+	}
+	tx.pending = true;
+}
+
+void ModbusDeviceTcpPipelined::receive(mbap::Transaction* transactions,
+									   size_t count) {
+	const auto deadline = Clock::now() + std::chrono::milliseconds(m_timeoutMs);
+	for (;;) {
+		// Decode the frames already received
+		while (m_receivedSize >= mbap::HEADER_SIZE) {
+			uint16_t id;
+			size_t size;
+			if (!mbap::parse_header(m_received.data(), id, size)) {
+				fail(EMBBADDATA);
+			}
+			if (m_receivedSize < size) {
+				break;
+			}
+
+			auto* tx = std::find_if(transactions, transactions + count,
+									[id](const mbap::Transaction& tx) {
+										return tx.pending && tx.id == id;
+									});
+			const bool matched = tx != transactions + count;
+			if (matched) {
+				mbap::decode(*tx, m_received.data(), size);
+				tx->pending = false;
+			}
+
+			m_receivedSize -= size;
+			memmove(m_received.data(), m_received.data() + size,
+					m_receivedSize);
+			if (matched) {
+				return;
+			}
+		}
+
+		if (!waitFor(m_socket, POLLIN, deadline)) {
+			// Late responses will be dropped, the connection stays usable
+			if (errno == ETIMEDOUT) {
+				throw ModbusException(ETIMEDOUT);
+			}
+			fail(errno);
+		}
+		const ssize_t rc =
+			::recv(m_socket, m_received.data() + m_receivedSize,
+				   m_received.size() - m_receivedSize, 0);
+		if (rc > 0) {
+			m_receivedSize += static_cast<size_t>(rc);
+		} else if (rc == 0) {
+			fail(ECONNRESET);
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			fail(errno);
+		}
+	}
+}
+
+void ModbusDeviceTcpPipelined::fail(int error) {
+	close();
+	throw ModbusException(error);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "mbap.hpp"
+#include "modbus-device-mbap.hpp"
+
+/**
+ * Modbus/TCP device with a socket of its own rather than one of libmodbus,
+ * so several requests can be in flight on the connection at once.
+ * Responses are matched to their request by transaction id, whatever order
+ * the server answers in.
+ *
+ * The reads of a plan are pipelined up to the window size, single requests
+ * wait for their response as they do with libmodbus.
+ */
+class ModbusDeviceTcpPipelined : public ModbusDeviceMbap {
+   public:
+	/** Largest number of requests in flight. */
+	static constexpr unsigned int MAX_WINDOW = 32;
+
+	/** Default time to wait for a response, the same as libmodbus. */
+	static constexpr unsigned int DEFAULT_TIMEOUT_MS = 500;
+
+	/**
+	 * @param host The address or host name of the server.
+	 * @param port The TCP port of the server.
+	 * @param window The number of requests kept in flight, from 1 for
+	 * servers that handle a single request at a time to MAX_WINDOW.
+	 */
+	ModbusDeviceTcpPipelined(const char* host, int port, unsigned int window);
+
+	~ModbusDeviceTcpPipelined() override;
+
+	void connect() override;
+	void close() noexcept override;
+	unsigned int flush() override;
+
+	/**
+	 * Sets the time to wait for the connection and for each response.
+	 * @param ms The timeout in milliseconds.
+	 */
+	void setTimeout(unsigned int ms) noexcept { m_timeoutMs = ms; }
+
+	unsigned int getWindow() const noexcept { return m_window; }
+
+   protected:
+	void execute(mbap::Transaction* transactions, size_t count) override;
+
+   private:
+	void send(mbap::Transaction& tx);
+
+	/**
+	 * Waits for the next response to one of the transactions and decodes
+	 * it. Responses to transactions given up on earlier are dropped.
+	 */
+	void receive(mbap::Transaction* transactions, size_t count);
+
+	/** Closes the connection, which is out of sync, and throws. */
+	[[noreturn]] void fail(int error);
+
+	std::string m_host;
+	int m_port;
+	unsigned int m_window;
+	unsigned int m_timeoutMs = DEFAULT_TIMEOUT_MS;
+
+	int m_socket = -1;
+	uint16_t m_nextId = 0;
+	std::array<uint8_t, mbap::MAX_FRAME_SIZE> m_frame;
+	std::array<uint8_t, mbap::MAX_FRAME_SIZE * 4> m_received;
+	size_t m_receivedSize = 0;
+};
@@ -1,9 +1,66 @@
 #include "modbus-device.hpp"
 #include <modbus/modbus.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <fstream>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <value-utils.hpp>
+#include "nlohmann/json.hpp"
 
-ModbusDevice::ModbusDevice(modbus_t* ctx) : m_ctx(ctx) {
+uint16_t ModbusDevice::TransportCost::maxGap() const noexcept {
+	if (registerUs <= 0.0) {
+		// Extra registers are free, only the risk of a refused read limits
+		// the gap
+		return MAX_GAP;
+	}
+	const double gap = frameUs / registerUs;
+	return static_cast<uint16_t>(std::min(gap, static_cast<double>(MAX_GAP)));
+}
+
+namespace {
+int64_t steadyUs() noexcept {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+uint64_t toUs(std::chrono::steady_clock::duration duration) noexcept {
+	return static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::microseconds>(duration)
+			.count());
+}
+}  // namespace
+
+double ModbusDevice::BusStats::occupancy() const noexcept {
+	if (elapsedUs == 0) {
+		return 0.0;
+	}
+	return std::min(static_cast<double>(busyUs + gapUs) / elapsedUs, 1.0);
+}
+
+ModbusException::ModbusException(int error)
+	: std::runtime_error(modbus_strerror(error)), m_error(error) {}
+
+bool ModbusException::isIllegalFunction() const noexcept {
+	return m_error == EMBXILFUN;
+}
+
+bool ModbusException::isIllegalDataAddress() const noexcept {
+	return m_error == EMBXILADD;
+}
+
+bool ModbusException::isIllegalDataValue() const noexcept {
+	return m_error == EMBXILVAL;
+}
+
+ModbusDevice::ModbusDevice() noexcept
+	: m_ctx(nullptr), m_statsStartUs(steadyUs()) {}
+
+ModbusDevice::ModbusDevice(modbus_t* ctx)
+	: m_ctx(ctx), m_statsStartUs(steadyUs()) {
 	if (m_ctx == nullptr) {
 		throw std::runtime_error("Failed to create Modbus context");
 	}
@@ -18,7 +75,7 @@ ModbusDevice::~ModbusDevice() {
 
 void ModbusDevice::connect() {
 	if (modbus_connect(m_ctx) == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	m_connected = true;
 }
@@ -33,39 +90,172 @@ void ModbusDevice::close() noexcept {
 unsigned int ModbusDevice::flush() {
 	int rc = modbus_flush(m_ctx);
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
 
 void ModbusDevice::setSlave(int slave) {
-	if (modbus_set_slave(m_ctx, slave) == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+	if (m_ctx ? modbus_set_slave(m_ctx, slave) == -1
+			  : slave < 0 || slave > 255) {
+		throw ModbusException(m_ctx ? errno : EINVAL);
+	}
+	m_slave = slave;
+}
+
+ModbusDevice::BusStats ModbusDevice::getBusStats() const noexcept {
+	BusStats stats;
+	stats.frames = m_frames.load(std::memory_order_relaxed);
+	stats.errors = m_frameErrors.load(std::memory_order_relaxed);
+	stats.busyUs = m_busyUs.load(std::memory_order_relaxed);
+	stats.gapUs = m_gapUs.load(std::memory_order_relaxed);
+	stats.elapsedUs = static_cast<uint64_t>(
+		steadyUs() - m_statsStartUs.load(std::memory_order_relaxed));
+	return stats;
+}
+
+void ModbusDevice::resetBusStats() noexcept {
+	m_frames.store(0, std::memory_order_relaxed);
+	m_frameErrors.store(0, std::memory_order_relaxed);
+	m_busyUs.store(0, std::memory_order_relaxed);
+	m_gapUs.store(0, std::memory_order_relaxed);
+	m_statsStartUs.store(steadyUs(), std::memory_order_relaxed);
+}
+
+template <typename Request>
+int ModbusDevice::transact(Request&& request) {
+	// A slave only takes a frame for a new request after enough silence,
+	// and libmodbus sends as soon as it is asked to
+	auto start = std::chrono::steady_clock::now();
+	const auto earliest =
+		m_frameEnd + std::chrono::microseconds(m_frameGapUs);
+	if (start < earliest) {
+		std::this_thread::sleep_until(earliest);
+		const auto now = std::chrono::steady_clock::now();
+		m_gapUs.fetch_add(toUs(now - start), std::memory_order_relaxed);
+		start = now;
+	}
+
+	const int rc = request();
+	const int error = errno;
+
+	m_frameEnd = std::chrono::steady_clock::now();
+	m_frames.fetch_add(1, std::memory_order_relaxed);
+	if (rc == -1) {
+		m_frameErrors.fetch_add(1, std::memory_order_relaxed);
+	}
+	m_busyUs.fetch_add(toUs(m_frameEnd - start), std::memory_order_relaxed);
+
+	errno = error;
+	return rc;
+}
+
+void ModbusDevice::recordFrames(
+	uint64_t frames,
+	uint64_t errors,
+	std::chrono::steady_clock::duration busy) noexcept {
+	m_frames.fetch_add(frames, std::memory_order_relaxed);
+	m_frameErrors.fetch_add(errors, std::memory_order_relaxed);
+	m_busyUs.fetch_add(toUs(busy), std::memory_order_relaxed);
+}
+
+void ModbusDevice::saveProfile(const char* path) const {
+	nlohmann::json j = nlohmann::json::object();
+	for (const auto& [slave, caps] : m_capabilities) {
+		j[slave < 0 ? "default" : std::to_string(slave)] = {
+			{"max_read_registers", caps.maxReadRegisters},
+			{"max_write_registers", caps.maxWriteRegisters},
+			{"max_read_bits", caps.maxReadBits},
+			{"max_write_bits", caps.maxWriteBits},
+			{"mask_write", caps.maskWrite},
+			{"write_and_read", caps.writeAndRead},
+		};
+	}
+
+	std::ofstream file(path);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to open profile file for writing");
+	}
+	file << j.dump(1, '\t') << '\n';
+}
+
+void ModbusDevice::loadProfile(const char* path) {
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to open profile file");
+	}
+
+	nlohmann::json j;
+	try {
+		j = nlohmann::json::parse(file);
+	} catch (const nlohmann::json::parse_error& e) {
+		throw std::runtime_error(std::string("JSON parse error: ") + e.what());
+	}
+	if (!j.is_object()) {
+		throw std::runtime_error("Profile file must contain an object");
+	}
+
+	for (const auto& item : j.items()) {
+		const std::string& key = item.key();
+		int slave = -1;
+		if (key != "default") {
+			size_t end = 0;
+			try {
+				slave = std::stoi(key, &end);
+			} catch (const std::logic_error&) {
+				end = 0;
+			}
+			if (end == 0 || end != key.size() || slave < 0 || slave > 255) {
+				throw std::runtime_error("Invalid slave in profile: \"" + key +
+										 "\"");
+			}
+		}
+		auto& caps = m_capabilities[slave];
+		const auto& value = item.value();
+
+		// Never go beyond what the protocol allows
+		caps.maxReadRegisters =
+			std::clamp(value.value("max_read_registers", MAX_READ_REGISTERS),
+					   1, MAX_READ_REGISTERS);
+		caps.maxWriteRegisters =
+			std::clamp(value.value("max_write_registers", MAX_WRITE_REGISTERS),
+					   1, MAX_WRITE_REGISTERS);
+		caps.maxReadBits = std::clamp(
+			value.value("max_read_bits", MAX_READ_BITS), 1, MAX_READ_BITS);
+		caps.maxWriteBits = std::clamp(
+			value.value("max_write_bits", MAX_WRITE_BITS), 1, MAX_WRITE_BITS);
+		caps.maskWrite = value.value("mask_write", true);
+		caps.writeAndRead = value.value("write_and_read", true);
 	}
 }
 
 unsigned int ModbusDevice::readBits(int addr, int nb, uint8_t* dest) {
-	int rc = modbus_read_bits(m_ctx, addr, nb, dest);
+	int rc =
+		transact([&] { return modbus_read_bits(m_ctx, addr, nb, dest); });
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
 
 unsigned int ModbusDevice::readInputBits(int addr, int nb, uint8_t* dest) {
-	int rc = modbus_read_input_bits(m_ctx, addr, nb, dest);
+	int rc = transact(
+		[&] { return modbus_read_input_bits(m_ctx, addr, nb, dest); });
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
 
 unsigned int ModbusDevice::readRegisters(int addr, int nb, uint16_t* dest) {
 #ifndef MODBUSPLUS_COMPAT_READ_REG_8BIT
-	int rc = modbus_read_registers(m_ctx, addr, nb, dest);
+	int rc = transact(
+		[&] { return modbus_read_registers(m_ctx, addr, nb, dest); });
 #else
-	int rc = modbus_read_registers(m_ctx, addr, nb,
-								   reinterpret_cast<uint8_t*>(dest));
+	int rc = transact([&] {
+		return modbus_read_registers(m_ctx, addr, nb,
+									 reinterpret_cast<uint8_t*>(dest));
+	});
 
 	// Swap bytes for each register to convert to big-endian
 	for (int i = 0; i < nb; ++i) {
@@ -73,7 +263,7 @@ unsigned int ModbusDevice::readRegisters(int addr, int nb, uint16_t* dest) {
 	}
 #endif
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
@@ -82,10 +272,14 @@ unsigned int ModbusDevice::readInputRegisters(int addr,
 											  int nb,
 											  uint16_t* dest) {
 #ifndef MODBUSPLUS_COMPAT_READ_REG_8BIT
-	int rc = modbus_read_input_registers(m_ctx, addr, nb, dest);
+	int rc = transact([&] {
+		return modbus_read_input_registers(m_ctx, addr, nb, dest);
+	});
 #else
-	int rc = modbus_read_input_registers(m_ctx, addr, nb,
-										 reinterpret_cast<uint8_t*>(dest));
+	int rc = transact([&] {
+		return modbus_read_input_registers(m_ctx, addr, nb,
+										   reinterpret_cast<uint8_t*>(dest));
+	});
 
 	// Swap bytes for each register to convert to big-endian
 	for (int i = 0; i < nb; ++i) {
@@ -93,36 +287,44 @@ unsigned int ModbusDevice::readInputRegisters(int addr,
 	}
 #endif
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
 
 unsigned int ModbusDevice::writeBit(int addr, uint8_t value) {
-	int rc = modbus_write_bit(m_ctx, addr, value);
+	int rc = transact([&] { return modbus_write_bit(m_ctx, addr, value); });
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
 
 unsigned int ModbusDevice::writeBits(int addr, int nb, const uint8_t* src) {
 #ifndef MODBUSPLUS_COMPAT_WRITE_BITS_16BIT
-	int rc = modbus_write_bits(m_ctx, addr, nb, src);
+	int rc =
+		transact([&] { return modbus_write_bits(m_ctx, addr, nb, src); });
 #else
-	auto vec = value_utils::pack_coils_to_u16(src, nb);
-	int rc = modbus_write_bits(m_ctx, addr, nb, vec.data());
+	// libmodbus refuses more bits than fit in a request anyway
+	if (nb > MAX_WRITE_BITS) {
+		throw ModbusException(EMBMDATA);
+	}
+	uint16_t packed[(MAX_WRITE_BITS + 7) / 8];
+	value_utils::pack_coils_to_u16(src, nb, packed);
+	int rc =
+		transact([&] { return modbus_write_bits(m_ctx, addr, nb, packed); });
 #endif
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
 
 unsigned int ModbusDevice::writeRegister(int addr, uint16_t value) {
-	int rc = modbus_write_register(m_ctx, addr, value);
+	int rc =
+		transact([&] { return modbus_write_register(m_ctx, addr, value); });
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
@@ -130,13 +332,169 @@ unsigned int ModbusDevice::writeRegister(int addr, uint16_t value) {
 unsigned int ModbusDevice::writeRegisters(int addr,
 										  int nb,
 										  const uint16_t* src) {
-	int rc = modbus_write_registers(m_ctx, addr, nb, src);
+	int rc = transact(
+		[&] { return modbus_write_registers(m_ctx, addr, nb, src); });
 	if (rc == -1) {
-		throw std::runtime_error(modbus_strerror(errno));
+		throw ModbusException(errno);
 	}
 	return static_cast<unsigned int>(rc);
 }
 
+void ModbusDevice::readBitRange(bool input, int addr, int nb, uint16_t* dest) {
+	auto& caps = getCapabilities();
+
+	// Large enough for either bit layout of a full request
+	uint8_t bits[MAX_READ_BITS];
+	for (int done = 0; done < nb;) {
+		const int chunk = std::min(nb - done, caps.maxReadBits);
+		try {
+			if (input) {
+				readInputBits(addr + done, chunk, bits);
+			} else {
+				readBits(addr + done, chunk, bits);
+			}
+		} catch (const ModbusException& ex) {
+			// The slave accepts fewer bits per request than the protocol.
+			// Only a request of the full size tells, a shorter one was
+			// rejected for another reason.
+			if (!ex.isIllegalDataValue() || chunk != caps.maxReadBits ||
+				chunk == 1) {
+				throw;
+			}
+			caps.maxReadBits = chunk / 2;
+			continue;
+		}
+#ifdef MODBUSPLUS_COMPAT_READ_REG_8BIT
+		value_utils::unpack_bits_msb(bits, chunk, dest + done);
+#else
+		value_utils::unpack_bits(bits, chunk, dest + done);
+#endif
+		done += chunk;
+	}
+}
+
+void ModbusDevice::readRegisterRange(bool input,
+									 int addr,
+									 int nb,
+									 uint16_t* dest) {
+	auto& caps = getCapabilities();
+	for (int done = 0; done < nb;) {
+		const int chunk = std::min(nb - done, caps.maxReadRegisters);
+		try {
+			if (input) {
+				readInputRegisters(addr + done, chunk, dest + done);
+			} else {
+				readRegisters(addr + done, chunk, dest + done);
+			}
+		} catch (const ModbusException& ex) {
+			// The slave accepts fewer registers per request than the protocol.
+			// Only a request of the full size tells, a shorter one was
+			// rejected for another reason.
+			if (!ex.isIllegalDataValue() || chunk != caps.maxReadRegisters ||
+				chunk == 1) {
+				throw;
+			}
+			caps.maxReadRegisters = chunk / 2;
+			continue;
+		}
+		done += chunk;
+	}
+}
+
+void ModbusDevice::readRanges(const ReadRange* ranges, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		const auto& range = ranges[i];
+		if (range.bits) {
+			readBitRange(range.input, range.addr, range.nb, range.dest);
+		} else {
+			readRegisterRange(range.input, range.addr, range.nb, range.dest);
+		}
+	}
+}
+
+int ModbusDevice::requestMaskWrite(int addr,
+								   uint16_t andMask,
+								   uint16_t orMask) {
+	return transact([&] {
+		return modbus_mask_write_register(m_ctx, addr, andMask, orMask);
+	});
+}
+
+int ModbusDevice::requestWriteAndRead(int writeAddr,
+									  int writeNb,
+									  const uint16_t* src,
+									  int readAddr,
+									  int readNb,
+									  uint16_t* dest) {
+	return transact([&] {
+		return modbus_write_and_read_registers(m_ctx, writeAddr, writeNb, src,
+											   readAddr, readNb, dest);
+	});
+}
+
+unsigned int ModbusDevice::maskWriteRegister(int addr,
+											 uint16_t andMask,
+											 uint16_t orMask) {
+	auto& caps = getCapabilities();
+	if (caps.maskWrite) {
+		int rc = requestMaskWrite(addr, andMask, orMask);
+		if (rc != -1) {
+			return static_cast<unsigned int>(rc);
+		}
+		if (errno != EMBXILFUN) {
+			throw ModbusException(errno);
+		}
+
+		// Remember that the slave lacks FC22 so we don't ask again
+		caps.maskWrite = false;
+	}
+
+	// Fall back to a read-modify-write of the register, read only the first
+	// time since the value written is kept
+	const uint32_t key = (static_cast<uint32_t>(m_slave & 0xFFFF) << 16) |
+						 static_cast<uint16_t>(addr);
+	auto it = m_maskedRegisters.find(key);
+	uint16_t value = 0;
+	if (it != m_maskedRegisters.end()) {
+		value = it->second;
+	} else {
+		readRegisters(addr, 1, &value);
+	}
+	value = (value & andMask) | (orMask & ~andMask);
+
+	// Whether a failed write reached the slave is unknown
+	m_maskedRegisters.erase(key);
+	const unsigned int rc = writeRegister(addr, value);
+	m_maskedRegisters[key] = value;
+	return rc;
+}
+
+unsigned int ModbusDevice::writeAndReadRegisters(int writeAddr,
+												 int writeNb,
+												 const uint16_t* src,
+												 int readAddr,
+												 int readNb,
+												 uint16_t* dest) {
+	auto& caps = getCapabilities();
+	if (caps.writeAndRead) {
+		int rc = requestWriteAndRead(writeAddr, writeNb, src, readAddr, readNb,
+									 dest);
+		if (rc != -1) {
+			return static_cast<unsigned int>(rc);
+		}
+		if (errno != EMBXILFUN) {
+			throw ModbusException(errno);
+		}
+
+		// Remember that the slave lacks FC23 so we don't ask again
+		caps.writeAndRead = false;
+	}
+
+	// Fall back to a write followed by a read
+	writeRegisters(writeAddr, writeNb, src);
+	return readRegisters(readAddr, readNb, dest);
+}
+
 #ifndef MODBUSPLUS_COMPAT_HWSW_FLOWCONTROL
 ModbusDeviceRtu::ModbusDeviceRtu(const char* device,
 								 int baud,
@@ -149,6 +507,7 @@ ModbusDeviceRtu::ModbusDeviceRtu(const char* device,
 								  static_cast<int>(data_bits),
 								  static_cast<int>(stop_bits))) {
 	modbus_rtu_set_serial_mode(m_ctx, MODBUS_RTU_RS485);
+	initTransportCost(baud, parity, data_bits, stop_bits);
 }
 #else
 ModbusDeviceRtu::ModbusDeviceRtu(const char* device,
@@ -164,8 +523,47 @@ ModbusDeviceRtu::ModbusDeviceRtu(const char* device,
 								  static_cast<int>(stop_bits),
 								  static_cast<int>(flow_control))) {
 	modbus_rtu_set_serial_mode(m_ctx, MODBUS_RTU_RS485);
+	initTransportCost(baud, parity, data_bits, stop_bits);
 }
 #endif
 
+void ModbusDeviceRtu::initTransportCost(int baud,
+										Parity parity,
+										DataBits data_bits,
+										StopBits stop_bits) noexcept {
+	// Start bit, data bits, optional parity bit and stop bits
+	const int bitsPerChar = 1 + static_cast<int>(data_bits) +
+							(parity == Parity::None ? 0 : 1) +
+							static_cast<int>(stop_bits);
+	m_charUs = bitsPerChar * 1000000.0 / baud;
+
+	// Every register read adds two bytes to the response
+	m_cost.registerUs = 2.0 * m_charUs;
+
+	// 3.5 characters, fixed at 1750us above 19200 baud by the specification
+	m_frameGapUs = baud > 19200
+					   ? 1750u
+					   : static_cast<unsigned int>(std::ceil(3.5 * m_charUs));
+	setTurnaround(DEFAULT_TURNAROUND_US);
+}
+
+void ModbusDeviceRtu::setTurnaround(unsigned int us) noexcept {
+	// An 8 byte request, a 5 byte response header and a 3.5 character silent
+	// interval after each frame
+	m_cost.frameUs = (8 + 5 + 2 * 3.5) * m_charUs + us;
+}
+
 ModbusDeviceTcp::ModbusDeviceTcp(const char* ip, int port)
-	: ModbusDevice(modbus_new_tcp(ip, port)) {}
+	: ModbusDevice(modbus_new_tcp(ip, port)) {
+	setRoundTripTime(DEFAULT_RTT_US);
+}
+
+ModbusDeviceTcp::ModbusDeviceTcp() noexcept {
+	setRoundTripTime(DEFAULT_RTT_US);
+}
+
+void ModbusDeviceTcp::setRoundTripTime(unsigned int us) noexcept {
+	// Register data is negligible next to the round trip on a TCP link
+	m_cost.frameUs = us;
+	m_cost.registerUs = 0.0;
+}
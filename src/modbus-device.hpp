@@ -1,14 +1,127 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
 #include "modbusplus-config.hpp"
 
 // Forward declaration of modbus_t
 typedef struct _modbus modbus_t;
 
+/**
+ * Error raised by a failed Modbus operation.
+ */
+class ModbusException : public std::runtime_error {
+   public:
+	/**
+	 * @param error The errno value set by libmodbus.
+	 */
+	explicit ModbusException(int error);
+
+	int getError() const noexcept { return m_error; }
+
+	/** The device answered with an illegal function exception. */
+	bool isIllegalFunction() const noexcept;
+
+	/** The device answered with an illegal data address exception. */
+	bool isIllegalDataAddress() const noexcept;
+
+	/** The device answered with an illegal data value exception. */
+	bool isIllegalDataValue() const noexcept;
+
+   private:
+	int m_error;
+};
+
 class ModbusDevice {
    public:
-	ModbusDevice() = delete;
+	/** Maximum number of registers in a single read request (PDU limit). */
+	static constexpr int MAX_READ_REGISTERS = 125;
+
+	/** Maximum number of bits in a single read request (PDU limit). */
+	static constexpr int MAX_READ_BITS = 2000;
+
+	/** Maximum number of registers in a single write request (PDU limit). */
+	static constexpr int MAX_WRITE_REGISTERS = 123;
+
+	/** Maximum number of bits in a single write request (PDU limit). */
+	static constexpr int MAX_WRITE_BITS = 1968;
+
+	/** Maximum number of registers written by a write and read request. */
+	static constexpr int MAX_WR_WRITE_REGISTERS = 121;
+
+	/** Maximum number of registers read by a write and read request. */
+	static constexpr int MAX_WR_READ_REGISTERS = 125;
+
+	/**
+	 * Estimated time cost of a read on the transport. Used to decide when
+	 * reading a few unused registers is cheaper than sending another request.
+	 */
+	struct TransportCost {
+		/**
+		 * Largest gap bridged however cheap extra registers are, as many
+		 * slaves refuse reads spanning unmapped addresses.
+		 */
+		static constexpr uint16_t MAX_GAP = 8;
+
+		double frameUs = 0.0;	  // Fixed cost of each request/response pair
+		double registerUs = 0.0;  // Cost of each additional register read
+
+		/**
+		 * Gets the largest gap of unused registers worth reading to avoid an
+		 * extra request.
+		 * @return The number of registers, at most MAX_GAP.
+		 */
+		uint16_t maxGap() const noexcept;
+	};
+
+	/**
+	 * What a device behind the transport accepts. Starts at the protocol
+	 * limits and is narrowed as exception responses are received.
+	 */
+	struct Capabilities {
+		int maxReadRegisters = MAX_READ_REGISTERS;
+		int maxWriteRegisters = MAX_WRITE_REGISTERS;
+		int maxReadBits = MAX_READ_BITS;
+		int maxWriteBits = MAX_WRITE_BITS;
+		bool maskWrite = true;	   // FC22
+		bool writeAndRead = true;  // FC23
+	};
+
+	/**
+	 * Use of the bus since the statistics were last reset. Every request and
+	 * its response count as a frame, whether it succeeded or not.
+	 */
+	struct BusStats {
+		uint64_t frames = 0;
+		uint64_t errors = 0;	 // Frames that failed
+		uint64_t busyUs = 0;	 // Time from each request to its response
+		uint64_t gapUs = 0;		 // Time spent waiting for silent intervals
+		uint64_t elapsedUs = 0;	 // Time since the reset
+
+		/**
+		 * Gets the share of the elapsed time the bus was in use, silent
+		 * intervals included.
+		 * @return A ratio between 0 and 1.
+		 */
+		double occupancy() const noexcept;
+	};
+
+	/**
+	 * A range of bits or registers to read with readRanges().
+	 */
+	struct ReadRange {
+		bool bits;	  // Coils or discrete inputs rather than registers
+		bool input;	  // Discrete inputs or input registers
+		int addr;
+		int nb;
+		uint16_t* dest;	 // One word per register, or per bit holding 0 or 1
+	};
+
 	ModbusDevice(const ModbusDevice&) = delete;
 	ModbusDevice& operator=(const ModbusDevice&) = delete;
 	ModbusDevice(ModbusDevice&&) = delete;
@@ -16,16 +129,54 @@ class ModbusDevice {
 
 	virtual ~ModbusDevice();
 
-	void connect();
-	void close() noexcept;
-	unsigned int flush();
+	virtual void connect();
+	virtual void close() noexcept;
+	virtual unsigned int flush();
 
 	void setSlave(int slave);
 
+	/**
+	 * Gets the capabilities of the current slave.
+	 * @return The capabilities, which may be adjusted.
+	 */
+	Capabilities& getCapabilities() { return m_capabilities[m_slave]; }
+
+	/**
+	 * Saves the capabilities learned for every slave to a JSON file, so they
+	 * don't have to be learned again on the next start.
+	 * @param path The path of the file to write.
+	 */
+	void saveProfile(const char* path) const;
+
+	/**
+	 * Loads capabilities saved with saveProfile().
+	 * @param path The path of the file to read.
+	 */
+	void loadProfile(const char* path);
+
 	bool isConnected() const noexcept {
 		return m_connected;
 	}
 
+	const TransportCost& getTransportCost() const noexcept { return m_cost; }
+
+	/**
+	 * Gets the use of the bus, which may be read while another thread is
+	 * talking to the device.
+	 * @return The statistics since the last reset.
+	 */
+	BusStats getBusStats() const noexcept;
+
+	void resetBusStats() noexcept;
+
+	/**
+	 * Gets the mutex serializing use of the device between the Lua state and
+	 * pollers. Hold it for the whole of a transaction that must not be
+	 * interleaved with others.
+	 * @return The mutex.
+	 */
+	std::recursive_mutex& getMutex() noexcept { return m_mutex; }
+
 	/**
 	 * Read bits (coils) from the Modbus device.
 	 * @param addr The starting address to read from.
@@ -33,7 +184,7 @@ class ModbusDevice {
 	 * @param dest Pointer to the destination buffer to store the read bits.
 	 * @return The number of bits read.
 	 */
-	unsigned int readBits(int addr, int nb, uint8_t* dest);
+	virtual unsigned int readBits(int addr, int nb, uint8_t* dest);
 
 	/**
 	 * Read input bits (discrete inputs) from the Modbus device.
@@ -43,7 +194,7 @@ class ModbusDevice {
 	 * bits.
 	 * @return The number of input bits read.
 	 */
-	unsigned int readInputBits(int addr, int nb, uint8_t* dest);
+	virtual unsigned int readInputBits(int addr, int nb, uint8_t* dest);
 
 	/**
 	 * Read holding registers from the Modbus device.
@@ -53,7 +204,7 @@ class ModbusDevice {
 	 * registers.
 	 * @return The number of registers read.
 	 */
-	unsigned int readRegisters(int addr, int nb, uint16_t* dest);
+	virtual unsigned int readRegisters(int addr, int nb, uint16_t* dest);
 
 	/**
 	 * Read input registers from the Modbus device.
@@ -63,7 +214,7 @@ class ModbusDevice {
 	 * registers.
 	 * @return The number of input registers read.
 	 */
-	unsigned int readInputRegisters(int addr, int nb, uint16_t* dest);
+	virtual unsigned int readInputRegisters(int addr, int nb, uint16_t* dest);
 
 	/**
 	 * Write a single bit (coil) to the Modbus device.
@@ -71,7 +222,7 @@ class ModbusDevice {
 	 * @param value The value to write (true or false).
 	 * @return The number of bits written (1 if successful).
 	 */
-	unsigned int writeBit(int addr, uint8_t value);
+	virtual unsigned int writeBit(int addr, uint8_t value);
 
 	/**
 	 * Write multiple bits (coils) to the Modbus device.
@@ -80,7 +231,7 @@ class ModbusDevice {
 	 * @param src Pointer to the source buffer containing the bits to write.
 	 * @return The number of bits written.
 	 */
-	unsigned int writeBits(int addr, int nb, const uint8_t* src);
+	virtual unsigned int writeBits(int addr, int nb, const uint8_t* src);
 
 	/**
 	 * Write a single holding register to the Modbus device.
@@ -88,7 +239,7 @@ class ModbusDevice {
 	 * @param value The value to write.
 	 * @return The number of registers written (1 if successful).
 	 */
-	unsigned int writeRegister(int addr, uint16_t value);
+	virtual unsigned int writeRegister(int addr, uint16_t value);
 
 	/**
 	 * Write multiple holding registers to the Modbus device.
@@ -98,13 +249,145 @@ class ModbusDevice {
 	 * write.
 	 * @return The number of registers written.
 	 */
-	unsigned int writeRegisters(int addr, int nb, const uint16_t* src);
+	virtual unsigned int writeRegisters(int addr, int nb, const uint16_t* src);
+
+	/**
+	 * Read any number of bits, split into as many requests as the slave
+	 * needs. A slave rejecting a request of the full size with an illegal
+	 * data value exception has its limit lowered and the read is retried.
+	 * @param input Whether to read discrete inputs rather than coils.
+	 * @param addr The starting address to read from.
+	 * @param nb The number of bits to read.
+	 * @param dest Destination buffer of one word per bit, holding 0 or 1.
+	 */
+	void readBitRange(bool input, int addr, int nb, uint16_t* dest);
+
+	/**
+	 * Read any number of registers, split into as many requests as the slave
+	 * needs. A slave rejecting a request of the full size with an illegal
+	 * data value exception has its limit lowered and the read is retried.
+	 * @param input Whether to read input registers rather than holding
+	 * registers.
+	 * @param addr The starting address to read from.
+	 * @param nb The number of registers to read.
+	 * @param dest Pointer to the destination buffer to store the registers.
+	 */
+	void readRegisterRange(bool input, int addr, int nb, uint16_t* dest);
+
+	/**
+	 * Read several ranges of bits or registers, each with readBitRange() or
+	 * readRegisterRange(). Transports able to have several requests in
+	 * flight send them without waiting for each response.
+	 * @param ranges The ranges to read.
+	 * @param count The number of ranges.
+	 */
+	virtual void readRanges(const ReadRange* ranges, size_t count);
+
+	/**
+	 * Modify bits of a holding register with a mask write (FC22). The
+	 * register becomes (current & andMask) | (orMask & ~andMask).
+	 * @param addr The address to write to.
+	 * @param andMask The bits to keep.
+	 * @param orMask The bits to set among those not kept.
+	 * @return The number of registers written (1 if successful).
+	 * @note Slaves that answer with an illegal function exception are
+	 * remembered and handled with a read-modify-write instead. The register
+	 * is only read the first time, the value written is kept for the next
+	 * mask writes, so changes made by the slave itself or another master are
+	 * not seen until forgetMaskedRegisters().
+	 */
+	unsigned int maskWriteRegister(int addr, uint16_t andMask, uint16_t orMask);
+
+	/**
+	 * Drops the registers kept by mask writes to slaves lacking FC22, so the
+	 * next mask write of each reads it again.
+	 */
+	void forgetMaskedRegisters() noexcept { m_maskedRegisters.clear(); }
+
+	/**
+	 * Write then read holding registers in a single transaction (FC23).
+	 * @param writeAddr The starting address to write to.
+	 * @param writeNb The number of registers to write.
+	 * @param src Pointer to the source buffer containing the registers to
+	 * write.
+	 * @param readAddr The starting address to read from.
+	 * @param readNb The number of registers to read.
+	 * @param dest Pointer to the destination buffer to store the read
+	 * registers.
+	 * @return The number of registers read.
+	 * @note Slaves that answer with an illegal function exception are
+	 * remembered and handled with a write followed by a read instead.
+	 */
+	unsigned int writeAndReadRegisters(int writeAddr,
+									   int writeNb,
+									   const uint16_t* src,
+									   int readAddr,
+									   int readNb,
+									   uint16_t* dest);
 
    protected:
 	ModbusDevice(modbus_t* ctx);
 
+	/**
+	 * For transports that frame requests themselves rather than going
+	 * through libmodbus. They must override every request.
+	 */
+	ModbusDevice() noexcept;
+
+	/**
+	 * Sends a request once the silent interval after the last frame has
+	 * passed and accounts for it in the bus statistics.
+	 * @param request Calls libmodbus and returns its result.
+	 * @return The result of the request, with errno preserved.
+	 */
+	template <typename Request>
+	int transact(Request&& request);
+
+	/**
+	 * Accounts for frames exchanged without transact(), such as pipelined
+	 * ones, in the bus statistics.
+	 * @param frames The number of frames.
+	 * @param errors The number of frames that failed.
+	 * @param busy The time spent exchanging them.
+	 */
+	void recordFrames(uint64_t frames,
+					  uint64_t errors,
+					  std::chrono::steady_clock::duration busy) noexcept;
+
+	/**
+	 * Sends a single mask write (FC22) request, without any fallback.
+	 * @return The number of registers written, or -1 with errno set.
+	 */
+	virtual int requestMaskWrite(int addr, uint16_t andMask, uint16_t orMask);
+
+	/**
+	 * Sends a single write and read (FC23) request, without any fallback.
+	 * @return The number of registers read, or -1 with errno set.
+	 */
+	virtual int requestWriteAndRead(int writeAddr,
+									int writeNb,
+									const uint16_t* src,
+									int readAddr,
+									int readNb,
+									uint16_t* dest);
+
 	bool m_connected = false;
+	int m_slave = -1;
 	modbus_t* m_ctx;
+	std::unordered_map<int, Capabilities> m_capabilities;
+	// Registers last written by read-modify-write mask writes, keyed by slave
+	// and address
+	std::unordered_map<uint32_t, uint16_t> m_maskedRegisters;
+	TransportCost m_cost;
+	std::recursive_mutex m_mutex;
+
+	unsigned int m_frameGapUs = 0;	// Silence required between two frames
+	std::chrono::steady_clock::time_point m_frameEnd;
+	std::atomic<uint64_t> m_frames{0};
+	std::atomic<uint64_t> m_frameErrors{0};
+	std::atomic<uint64_t> m_busyUs{0};
+	std::atomic<uint64_t> m_gapUs{0};
+	std::atomic<int64_t> m_statsStartUs{0};
 };
 
 class ModbusDeviceRtu : public ModbusDevice {
@@ -128,9 +411,41 @@ class ModbusDeviceRtu : public ModbusDevice {
 					StopBits stop_bits = StopBits::One,
 					FlowControl flow_control = FlowControl::None);
 #endif
+
+	/**
+	 * Sets the time the device takes to start answering a request, which is
+	 * added to the cost of every frame.
+	 * @param us The turnaround time in microseconds.
+	 */
+	void setTurnaround(unsigned int us) noexcept;
+
+	/** Default turnaround time in microseconds. */
+	static constexpr unsigned int DEFAULT_TURNAROUND_US = 5000;
+
+   private:
+	void initTransportCost(int baud,
+						   Parity parity,
+						   DataBits data_bits,
+						   StopBits stop_bits) noexcept;
+
+	double m_charUs = 0.0;
 };
 
 class ModbusDeviceTcp : public ModbusDevice {
    public:
 	ModbusDeviceTcp(const char* ip, int port);
+
+	/**
+	 * Sets the round trip time to the device, which is the cost of every
+	 * frame.
+	 * @param us The round trip time in microseconds.
+	 */
+	void setRoundTripTime(unsigned int us) noexcept;
+
+	/** Default round trip time in microseconds. */
+	static constexpr unsigned int DEFAULT_RTT_US = 5000;
+
+   protected:
+	/** For transports that talk to the socket themselves. */
+	ModbusDeviceTcp() noexcept;
 };
@@ -0,0 +1,156 @@
+#include "poll-scheduler.hpp"
+#include <algorithm>
+
+PollScheduler::PollScheduler(size_t maxWorkers)
+	: m_maxWorkers(std::max<size_t>(maxWorkers, 1)) {}
+
+PollScheduler::~PollScheduler() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_wakeup.notify_all();
+	for (auto& worker : m_workers) {
+		worker.join();
+	}
+}
+
+std::shared_ptr<PollScheduler> PollScheduler::shared() {
+	// Held weakly, a module unloaded with workers still running would crash
+	static std::mutex mutex;
+	static std::weak_ptr<PollScheduler> instance;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto scheduler = instance.lock();
+	if (!scheduler) {
+		scheduler = std::make_shared<PollScheduler>();
+		instance = scheduler;
+	}
+	return scheduler;
+}
+
+PollScheduler::TaskId PollScheduler::add(const void* bus,
+										 std::chrono::milliseconds period,
+										 std::function<void()> task) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = std::find_if(m_buses.begin(), m_buses.end(),
+						   [bus](const auto& b) { return b->key == bus; });
+	if (it == m_buses.end()) {
+		m_buses.push_back(std::make_unique<Bus>());
+		m_buses.back()->key = bus;
+		it = std::prev(m_buses.end());
+
+		// One worker per bus, so a slow link never holds up another
+		if (m_workers.size() < std::min(m_buses.size(), m_maxWorkers)) {
+			m_workers.emplace_back(&PollScheduler::work, this);
+		}
+	}
+
+	const TaskId id = m_nextId++;
+	(*it)->tasks.push_back(std::make_unique<Task>(
+		Task{id, period, Clock::now(), std::move(task)}));
+	m_wakeup.notify_one();
+	return id;
+}
+
+void PollScheduler::remove(TaskId id) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (auto busIt = m_buses.begin(); busIt != m_buses.end(); ++busIt) {
+		Bus& bus = **busIt;
+		auto it = std::find_if(bus.tasks.begin(), bus.tasks.end(),
+							   [id](const auto& task) { return task->id == id; });
+		if (it == bus.tasks.end()) {
+			continue;
+		}
+
+		// The bus can't go away while it still has the task
+		const Task* task = it->get();
+		m_wakeup.wait(lock, [&] { return bus.running != task; });
+		bus.tasks.erase(std::find_if(
+			bus.tasks.begin(), bus.tasks.end(),
+			[id](const auto& task) { return task->id == id; }));
+
+		if (bus.tasks.empty()) {
+			m_buses.erase(std::find_if(
+				m_buses.begin(), m_buses.end(),
+				[&bus](const auto& b) { return b.get() == &bus; }));
+		}
+		return;
+	}
+}
+
+size_t PollScheduler::getWorkerCount() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_workers.size();
+}
+
+size_t PollScheduler::getBusCount() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_buses.size();
+}
+
+PollScheduler::Task* PollScheduler::nextDue(Bus& bus,
+											Clock::time_point now) noexcept {
+	Task* next = nullptr;
+	for (auto& task : bus.tasks) {
+		if (task->due <= now && (!next || task->due < next->due)) {
+			next = task.get();
+		}
+	}
+	return next;
+}
+
+void PollScheduler::work() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stopping) {
+		// Take the earliest task among the buses no other worker is on
+		Bus* bus = nullptr;
+		Task* task = nullptr;
+		for (auto& b : m_buses) {
+			if (b->running) {
+				continue;
+			}
+			for (auto& t : b->tasks) {
+				if (!task || t->due < task->due) {
+					bus = b.get();
+					task = t.get();
+				}
+			}
+		}
+
+		if (!task) {
+			m_wakeup.wait(lock);
+			continue;
+		}
+		if (task->due > Clock::now()) {
+			// By value, the task may be removed while waiting
+			const auto due = task->due;
+			m_wakeup.wait_until(lock, due);
+			continue;
+		}
+
+		// Stay on the bus while it has tasks due, so the port goes from one
+		// frame to the next without waiting for a worker to wake up
+		while (task) {
+			bus->running = task;
+			lock.unlock();
+			task->run();
+			lock.lock();
+
+			// A slow run skips the periods it missed rather than running
+			// back to back to catch up
+			const auto now = Clock::now();
+			task->due += task->period;
+			if (task->due <= now) {
+				task->due = now + task->period;
+			}
+
+			task = m_stopping ? nullptr : nextDue(*bus, now);
+			bus->running = task;
+
+			// Wakes remove() and the workers waiting for this bus
+			m_wakeup.notify_all();
+		}
+	}
+}
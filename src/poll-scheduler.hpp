@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs periodic tasks for many buses on a pool of worker threads. A bus is a
+ * single link to one or more slaves, such as a TCP connection or an RS485
+ * port, so tasks of different buses run in parallel while tasks of the same
+ * bus always run one at a time. A worker keeps going through the tasks due
+ * on its bus before looking at others, so a busy port is never left idle.
+ *
+ * Workers are started as buses are added, up to the maximum given.
+ */
+class PollScheduler {
+   public:
+	using TaskId = uint64_t;
+
+	/** Maximum number of workers of the shared scheduler. */
+	static constexpr size_t DEFAULT_MAX_WORKERS = 64;
+
+	explicit PollScheduler(size_t maxWorkers = DEFAULT_MAX_WORKERS);
+
+	PollScheduler(const PollScheduler&) = delete;
+	PollScheduler& operator=(const PollScheduler&) = delete;
+
+	~PollScheduler();
+
+	/**
+	 * Gets the scheduler shared by every poller. It only lives as long as
+	 * someone holds it, so no thread outlives the last poller.
+	 * @return The shared scheduler.
+	 */
+	static std::shared_ptr<PollScheduler> shared();
+
+	/**
+	 * Adds a task, which is due immediately.
+	 * @param bus Identifies the bus the task talks to, usually the device.
+	 * @param period The time between two runs of the task.
+	 * @param task The function to run, which must not throw.
+	 * @return An id to remove the task with.
+	 */
+	TaskId add(const void* bus,
+			   std::chrono::milliseconds period,
+			   std::function<void()> task);
+
+	/**
+	 * Removes a task, waiting for it to finish if it is running.
+	 * @param id The id returned by add().
+	 */
+	void remove(TaskId id);
+
+	size_t getWorkerCount() const;
+
+	size_t getBusCount() const;
+
+   private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Task {
+		TaskId id;
+		std::chrono::milliseconds period;
+		Clock::time_point due;
+		std::function<void()> run;
+	};
+
+	struct Bus {
+		const void* key;
+		std::vector<std::unique_ptr<Task>> tasks;
+		const Task* running = nullptr;
+	};
+
+	/** Gets the earliest task of the bus due at the given time, if any. */
+	static Task* nextDue(Bus& bus, Clock::time_point now) noexcept;
+
+	void work();
+
+	const size_t m_maxWorkers;
+	TaskId m_nextId = 1;
+	std::vector<std::unique_ptr<Bus>> m_buses;
+	std::vector<std::thread> m_workers;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_wakeup;
+	bool m_stopping = false;
+};
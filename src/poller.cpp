@@ -0,0 +1,253 @@
+#include "poller.hpp"
+#include <modbus/modbus.h>
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include "modbus-device-tcp-async.hpp"
+
+Poller::Snapshot::Snapshot(uint32_t size)
+	: m_regs(new std::atomic<uint16_t>[size]), m_size(size) {
+	for (uint32_t i = 0; i < size; ++i) {
+		m_regs[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void Poller::Snapshot::publish(const uint16_t* regs, int64_t timeMs) noexcept {
+	// Readers retry while the sequence is odd or has changed under them
+	const uint32_t sequence = m_sequence.load(std::memory_order_relaxed);
+	m_sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (uint32_t i = 0; i < m_size; ++i) {
+		m_regs[i].store(regs[i], std::memory_order_relaxed);
+	}
+	m_timeMs.store(timeMs, std::memory_order_relaxed);
+
+	m_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+int64_t Poller::Snapshot::read(uint16_t* dest) const noexcept {
+	for (;;) {
+		const uint32_t before = m_sequence.load(std::memory_order_acquire);
+		if (before & 1u) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		for (uint32_t i = 0; i < m_size; ++i) {
+			dest[i] = m_regs[i].load(std::memory_order_relaxed);
+		}
+		const int64_t timeMs = m_timeMs.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_sequence.load(std::memory_order_relaxed) == before) {
+			return timeMs;
+		}
+	}
+}
+
+Poller::Job::Job(std::shared_ptr<const ReadPlan> plan,
+				 std::chrono::milliseconds period)
+	: plan(std::move(plan)),
+	  period(period),
+	  regs(this->plan->getRegisterCount(), 0),
+	  snapshot(this->plan->getRegisterCount()) {}
+
+Poller::Poller(std::shared_ptr<ModbusDevice> device,
+			   int deviceId,
+			   std::shared_ptr<PollScheduler> scheduler)
+	: m_device(std::move(device)),
+	  m_deviceId(deviceId),
+	  m_scheduler(scheduler ? std::move(scheduler) : PollScheduler::shared()),
+	  m_async(dynamic_cast<ModbusDeviceTcpAsync*>(m_device.get())) {}
+
+Poller::~Poller() {
+	stop();
+}
+
+size_t Poller::addPlan(std::shared_ptr<const ReadPlan> plan,
+					   std::chrono::milliseconds period) {
+	if (isRunning()) {
+		throw std::runtime_error("Plans cannot be added while polling");
+	}
+	if (period.count() <= 0) {
+		throw std::invalid_argument("Poll period must be positive");
+	}
+	m_jobs.push_back(std::make_unique<Job>(std::move(plan), period));
+	return m_jobs.size() - 1;
+}
+
+void Poller::start() {
+	if (isRunning()) {
+		return;
+	}
+	if (m_async) {
+		startAsync();
+		m_running = true;
+		return;
+	}
+
+	m_tasks.reserve(m_jobs.size());
+	for (auto& job : m_jobs) {
+		Job* target = job.get();
+		m_tasks.push_back(m_scheduler->add(m_device.get(), job->period,
+										   [this, target] { poll(*target); }));
+	}
+	m_running = true;
+}
+
+void Poller::stop() noexcept {
+	if (!isRunning()) {
+		return;
+	}
+
+	for (const auto id : m_tasks) {
+		m_scheduler->remove(id);
+	}
+	m_tasks.clear();
+
+	if (m_async) {
+		for (const auto id : m_timers) {
+			m_async->getLoop().removeTimer(id);
+		}
+		m_timers.clear();
+
+		// Submitted polls write into the jobs until they finish
+		std::unique_lock<std::mutex> lock(m_pendingMutex);
+		m_idle.wait(lock, [this] { return m_pending == 0; });
+	}
+	m_running = false;
+}
+
+int64_t Poller::now() noexcept {
+	const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch());
+	return std::max<int64_t>(ms.count(), 1);
+}
+
+void Poller::poll(Job& job) noexcept {
+	try {
+		std::lock_guard<std::recursive_mutex> device(m_device->getMutex());
+		if (m_deviceId >= 0) {
+			m_device->setSlave(m_deviceId);
+		}
+		job.plan->execute(*m_device, job.regs.data());
+	} catch (const std::exception&) {
+		++m_errors;
+		return;
+	}
+	job.snapshot.publish(job.regs.data(), now());
+}
+
+void Poller::startAsync() {
+	std::lock_guard<std::recursive_mutex> device(m_device->getMutex());
+	if (m_deviceId >= 0) {
+		m_device->setSlave(m_deviceId);
+	}
+	m_unit = m_async->getUnit();
+	m_caps = m_device->getCapabilities();
+
+	// The requests of every plan are built once, and again whenever the slave
+	// refuses some
+	for (auto& job : m_jobs) {
+		build(*job);
+	}
+
+	m_timers.reserve(m_jobs.size());
+	for (auto& job : m_jobs) {
+		Job* target = job.get();
+		m_timers.push_back(m_async->getLoop().addTimer(
+			job->period, [this, target] { submit(*target); }));
+	}
+}
+
+void Poller::build(Job& job) {
+	// Limits learned here and by synchronous reads are merged, only when the
+	// device is free as it may be waiting for the loop thread
+	std::unique_lock<std::recursive_mutex> device(m_device->getMutex(),
+												  std::try_to_lock);
+	if (device) {
+		if (m_deviceId >= 0) {
+			m_device->setSlave(m_deviceId);
+		}
+		auto& caps = m_device->getCapabilities();
+		caps.maxReadRegisters = m_caps.maxReadRegisters =
+			std::min(caps.maxReadRegisters, m_caps.maxReadRegisters);
+		caps.maxReadBits = m_caps.maxReadBits =
+			std::min(caps.maxReadBits, m_caps.maxReadBits);
+	}
+
+	job.plan->getRanges(job.regs.data(), job.ranges, job.rangeBlocks);
+	ModbusDeviceMbap::buildReads(job.ranges.data(), job.ranges.size(), m_caps,
+								 job.transactions);
+}
+
+void Poller::submit(Job& job) {
+	// Still waiting on the previous poll, this period is skipped
+	if (job.inFlight) {
+		return;
+	}
+	job.inFlight = true;
+	{
+		std::lock_guard<std::mutex> lock(m_pendingMutex);
+		++m_pending;
+	}
+	m_async->submit(m_unit, job.transactions.data(), job.transactions.size(),
+					[this, &job] { finish(job); });
+}
+
+void Poller::finish(Job& job) noexcept {
+	bool failed = false;
+	bool rebuild = false;
+	for (const auto& tx : job.transactions) {
+		if (tx.error != 0) {
+			failed = true;
+			rebuild = adapt(job, tx) || rebuild;
+		}
+	}
+
+	if (!failed) {
+		job.snapshot.publish(job.regs.data(), now());
+	} else if (rebuild) {
+		// Sent again straight away, still counted as pending
+		try {
+			build(job);
+			m_async->submit(m_unit, job.transactions.data(),
+							job.transactions.size(),
+							[this, &job] { finish(job); });
+			return;
+		} catch (const std::exception&) {
+			++m_errors;
+		}
+	} else {
+		++m_errors;
+	}
+	job.inFlight = false;
+
+	// Notified under the lock, stop() may destroy the poller right after
+	std::lock_guard<std::mutex> lock(m_pendingMutex);
+	--m_pending;
+	m_idle.notify_all();
+}
+
+bool Poller::adapt(const Job& job, const mbap::Transaction& tx) noexcept {
+	// Possibly a gap the slave refuses to read
+	if (tx.error == EMBXILADD) {
+		return job.plan->split(job.rangeBlocks[tx.tag]);
+	}
+	if (tx.error != EMBXILVAL) {
+		return false;
+	}
+
+	// The slave accepts fewer registers per request than the protocol. Only
+	// a request of the full size tells, a shorter one was rejected for
+	// another reason.
+	const bool bits = tx.function == mbap::READ_COILS ||
+					  tx.function == mbap::READ_DISCRETE_INPUTS;
+	int& limit = bits ? m_caps.maxReadBits : m_caps.maxReadRegisters;
+	if (tx.nb != limit || limit == 1) {
+		return false;
+	}
+	limit /= 2;
+	return true;
+}
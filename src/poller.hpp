@@ -0,0 +1,176 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "event-loop.hpp"
+#include "mbap.hpp"
+#include "modbus-device.hpp"
+#include "poll-scheduler.hpp"
+#include "read-plan.hpp"
+
+class ModbusDeviceTcpAsync;
+
+/**
+ * Executes read plans on a device from the workers of a PollScheduler, each
+ * at a fixed period, and publishes the registers read. The latest values can
+ * then be decoded at any time without waiting on the device.
+ *
+ * The device is the bus, so pollers of contexts sharing a device take turns,
+ * while pollers of different devices run in parallel. The device is also
+ * shared with the Lua state, so every poll holds the device mutex for the
+ * duration of a plan.
+ *
+ * Devices driven by an EventLoop are polled from timers of the loop instead,
+ * every request of a plan being submitted at once. A poll still in progress
+ * when the next one is due makes it skip that period. Like a synchronous
+ * poll, one refused for a bridged gap or a request too large is sent again
+ * at once with its requests rebuilt.
+ */
+class Poller {
+   public:
+	/**
+	 * The registers of a plan from its last successful execution. Published
+	 * under a sequence lock, so the poller never waits for readers and
+	 * readers never see a half written image.
+	 */
+	class Snapshot {
+	   public:
+		explicit Snapshot(uint32_t size);
+
+		/**
+		 * Publishes new registers. Only called from the poller thread.
+		 * @param regs The registers, getSize() words.
+		 * @param timeMs The time of the read, see now().
+		 */
+		void publish(const uint16_t* regs, int64_t timeMs) noexcept;
+
+		/**
+		 * Copies the registers of the last publication.
+		 * @param dest Destination buffer of at least getSize() words.
+		 * @return The time of the publication, or 0 if nothing has been
+		 * published yet.
+		 */
+		int64_t read(uint16_t* dest) const noexcept;
+
+		uint32_t getSize() const noexcept { return m_size; }
+
+	   private:
+		// Odd while a publication is in progress
+		std::atomic<uint32_t> m_sequence{0};
+		std::atomic<int64_t> m_timeMs{0};
+		std::unique_ptr<std::atomic<uint16_t>[]> m_regs;
+		uint32_t m_size;
+	};
+
+	/**
+	 * @param device The device to poll, which must be connected.
+	 * @param deviceId The slave to select before every poll, or -1 to keep
+	 * the current one.
+	 * @param scheduler The scheduler to poll from, the shared one if null.
+	 */
+	Poller(std::shared_ptr<ModbusDevice> device,
+		   int deviceId = -1,
+		   std::shared_ptr<PollScheduler> scheduler = nullptr);
+
+	Poller(const Poller&) = delete;
+	Poller& operator=(const Poller&) = delete;
+
+	~Poller();
+
+	/**
+	 * Adds a plan to poll. Plans can only be added while stopped.
+	 * @param plan The plan to execute.
+	 * @param period The time between two executions of the plan.
+	 * @return The index of the plan.
+	 */
+	size_t addPlan(std::shared_ptr<const ReadPlan> plan,
+				   std::chrono::milliseconds period);
+
+	/**
+	 * Starts polling, every plan being due immediately.
+	 */
+	void start();
+
+	/**
+	 * Stops polling and waits for polls in progress to finish. Snapshots keep
+	 * their last values.
+	 */
+	void stop() noexcept;
+
+	bool isRunning() const noexcept { return m_running; }
+
+	size_t getPlanCount() const noexcept { return m_jobs.size(); }
+
+	const ReadPlan& getPlan(size_t index) const { return *m_jobs[index]->plan; }
+
+	const Snapshot& getSnapshot(size_t index) const {
+		return m_jobs[index]->snapshot;
+	}
+
+	/**
+	 * Gets the number of polls that failed. A failed poll leaves the
+	 * snapshot of its plan as it was.
+	 * @return The number of failed polls.
+	 */
+	uint64_t getErrorCount() const noexcept { return m_errors; }
+
+	/**
+	 * Gets the current time on the clock used for publications.
+	 * @return Milliseconds on a monotonic clock, never 0.
+	 */
+	static int64_t now() noexcept;
+
+   private:
+	struct Job {
+		Job(std::shared_ptr<const ReadPlan> plan,
+			std::chrono::milliseconds period);
+
+		std::shared_ptr<const ReadPlan> plan;
+		std::chrono::milliseconds period;
+		std::vector<uint16_t> regs;	 // Only touched by the polls of the job
+		Snapshot snapshot;
+
+		// Polls through an EventLoop, only touched on the loop thread
+		std::vector<mbap::Transaction> transactions;
+		std::vector<ModbusDevice::ReadRange> ranges;
+		std::vector<uint32_t> rangeBlocks;	// Block of each range
+		bool inFlight = false;
+	};
+
+	void poll(Job& job) noexcept;
+
+	void startAsync();
+
+	/** Builds the requests of a job from its plan and the current limits. */
+	void build(Job& job);
+	void submit(Job& job);
+	void finish(Job& job) noexcept;
+
+	/**
+	 * Adapts to a request the slave refused, by reading the gaps of its
+	 * block no more or lowering the limit it exceeded.
+	 * @return True if the requests of the job need rebuilding.
+	 */
+	bool adapt(const Job& job, const mbap::Transaction& tx) noexcept;
+
+	std::shared_ptr<ModbusDevice> m_device;
+	int m_deviceId;
+	std::shared_ptr<PollScheduler> m_scheduler;
+	std::vector<std::unique_ptr<Job>> m_jobs;
+	std::vector<PollScheduler::TaskId> m_tasks;
+	ModbusDeviceTcpAsync* m_async;	// The device, if driven by a loop
+	uint8_t m_unit = 0;
+	// Limits of the async polls, shared with the device whenever it is free
+	ModbusDevice::Capabilities m_caps;
+	std::vector<EventLoop::TimerId> m_timers;
+	std::mutex m_pendingMutex;
+	std::condition_variable m_idle;
+	size_t m_pending = 0;	 // Polls submitted and not yet finished
+	bool m_running = false;
+	std::atomic<uint64_t> m_errors{0};
+};
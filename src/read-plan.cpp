@@ -0,0 +1,247 @@
+#include "read-plan.hpp"
+#include <algorithm>
+#include "value-utils.hpp"
+
+ReadPlan::ReadPlan(std::shared_ptr<const Mapping> mapping,
+				   const std::vector<std::string>& names,
+				   uint16_t maxGap,
+				   const ModbusDevice::Capabilities& caps)
+	: m_mapping(std::move(mapping)) {
+	m_entries.reserve(names.size());
+	for (const auto& name : names) {
+		m_entries.push_back({&m_mapping->getValueDef(name), name, 0});
+	}
+	build(maxGap, caps);
+}
+
+ReadPlan::ReadPlan(std::shared_ptr<const Mapping> mapping,
+				   uint16_t maxGap,
+				   const ModbusDevice::Capabilities& caps)
+	: m_mapping(std::move(mapping)) {
+	const Mapping::Handle count = m_mapping->getValueCount();
+	m_entries.reserve(count);
+	for (Mapping::Handle handle = 0; handle < count; ++handle) {
+		m_entries.push_back({&m_mapping->getValueDefAt(handle),
+							 m_mapping->getName(handle), 0});
+	}
+	build(maxGap, caps);
+}
+
+void ReadPlan::build(uint16_t maxGap,
+					 const ModbusDevice::Capabilities& caps) {
+	// Sort so that values sharing an address space are next to each other in
+	// ascending address order
+	std::sort(m_entries.begin(), m_entries.end(),
+			  [](const Entry& lhs, const Entry& rhs) {
+				  const bool lhsBit =
+					  lhs.def->format == Mapping::ValueDefFormat::bit;
+				  const bool rhsBit =
+					  rhs.def->format == Mapping::ValueDefFormat::bit;
+				  if (lhsBit != rhsBit) {
+					  return lhsBit < rhsBit;
+				  }
+				  if (lhs.def->type != rhs.def->type) {
+					  return lhs.def->type < rhs.def->type;
+				  }
+				  return lhs.def->addr < rhs.def->addr;
+			  });
+
+	for (auto& entry : m_entries) {
+		const auto& def = *entry.def;
+		const bool bits = def.format == Mapping::ValueDefFormat::bit;
+
+		// Bits are much cheaper than registers, so larger gaps are worth
+		// bridging, but requests are limited by a different size
+		const uint32_t gap = bits ? maxGap * 16u : maxGap;
+		const uint32_t limit = bits ? caps.maxReadBits : caps.maxReadRegisters;
+
+		const uint32_t end = static_cast<uint32_t>(def.addr) + def.length;
+
+		// Merge into the previous block if the ranges touch, overlap or are
+		// separated by a small readable gap and the result still fits in a
+		// single request
+		if (!m_blocks.empty()) {
+			auto& block = m_blocks.back();
+			const uint32_t blockEnd =
+				static_cast<uint32_t>(block.addr) + block.length;
+			const uint32_t mergedEnd = std::max(blockEnd, end);
+			if (block.bits == bits && block.type == def.type &&
+				def.addr <= blockEnd + gap && mergedEnd - block.addr <= limit &&
+				(def.addr <= blockEnd ||
+				 m_mapping->isReadable(def.type, bits, blockEnd, def.addr))) {
+				entry.offset = block.offset + (def.addr - block.addr);
+				m_registerCount += mergedEnd - blockEnd;
+				block.length = static_cast<uint16_t>(mergedEnd - block.addr);
+
+				// Parts only ever span values that touch
+				auto& part = m_parts.back();
+				if (def.addr <= blockEnd) {
+					part.length = static_cast<uint16_t>(mergedEnd - part.addr);
+				} else {
+					m_parts.push_back({entry.offset, def.addr, def.length,
+									   def.type, bits});
+					++block.partCount;
+				}
+				continue;
+			}
+		}
+
+		m_blocks.push_back({m_registerCount, def.addr, def.length, def.type,
+							bits, static_cast<uint32_t>(m_parts.size())});
+		m_parts.push_back(m_blocks.back());
+		entry.offset = m_registerCount;
+		m_registerCount += def.length;
+	}
+
+	m_split.reset(new std::atomic<bool>[m_blocks.size()]);
+	for (size_t i = 0; i < m_blocks.size(); ++i) {
+		m_split[i].store(false, std::memory_order_relaxed);
+	}
+
+	buildRuns();
+}
+
+void ReadPlan::buildRuns() {
+	const auto canDecodeArray = [](const Mapping::ValueDef& def) {
+		return value_utils::is_array_format(def.format) && def.linked.empty();
+	};
+
+	for (size_t i = 0; i < m_entries.size();) {
+		const auto& def = *m_entries[i].def;
+		if (!canDecodeArray(def)) {
+			++i;
+			continue;
+		}
+
+		// Extend the run while the next value follows directly in the buffer
+		size_t end = i + 1;
+		while (end < m_entries.size()) {
+			const auto& prev = m_entries[end - 1];
+			const auto& next = *m_entries[end].def;
+			if (!canDecodeArray(next) || next.format != def.format ||
+				next.order != def.order || next.scale != def.scale ||
+				m_entries[end].offset != prev.offset + prev.def->length) {
+				break;
+			}
+			++end;
+		}
+
+		// A single value is decoded just as fast on its own
+		if (end - i > 1) {
+			m_runs.push_back({static_cast<uint32_t>(i),
+							  static_cast<uint32_t>(end - i)});
+			for (size_t j = i; j < end; ++j) {
+				m_entries[j].bulk = true;
+			}
+		}
+		i = end;
+	}
+}
+
+void ReadPlan::execute(ModbusDevice& device, uint16_t* regs) const {
+	// Blocks are handed over together, so a device able to pipeline requests
+	// can keep several in flight
+	constexpr size_t BATCH_SIZE = 32;
+	ModbusDevice::ReadRange ranges[BATCH_SIZE];
+	size_t count = 0;
+	size_t first = 0;
+	const auto flush = [&](size_t last) {
+		if (count == 0) {
+			first = last;
+			return;
+		}
+		try {
+			device.readRanges(ranges, count);
+		} catch (const ModbusException& ex) {
+			// Possibly a gap the slave refuses to read, find out block by
+			// block unless the batch held a single one
+			if (!ex.isIllegalDataAddress()) {
+				throw;
+			}
+			if (last - first == 1) {
+				if (m_blocks[first].partCount == 1) {
+					throw;
+				}
+				m_split[first].store(true, std::memory_order_relaxed);
+			}
+			executeSplit(device, regs, first, last);
+		}
+		count = 0;
+		first = last;
+	};
+
+	for (size_t i = 0; i < m_blocks.size(); ++i) {
+		const auto& block = m_blocks[i];
+		if (!m_split[i].load(std::memory_order_relaxed)) {
+			if (count == BATCH_SIZE) {
+				flush(i);
+			}
+			ranges[count++] = getRange(block, regs);
+			continue;
+		}
+
+		// The parts of a block go in the same batch, so a failed batch is
+		// retried by whole blocks
+		if (count + block.partCount > BATCH_SIZE) {
+			flush(i);
+		}
+		if (block.partCount > BATCH_SIZE) {
+			executeSplit(device, regs, i, i + 1);
+			first = i + 1;
+			continue;
+		}
+		for (uint32_t j = 0; j < block.partCount; ++j) {
+			ranges[count++] = getRange(m_parts[block.firstPart + j], regs);
+		}
+	}
+	flush(m_blocks.size());
+}
+
+void ReadPlan::getRanges(uint16_t* regs,
+						 std::vector<ModbusDevice::ReadRange>& ranges,
+						 std::vector<uint32_t>& blocks) const {
+	ranges.clear();
+	blocks.clear();
+	for (size_t i = 0; i < m_blocks.size(); ++i) {
+		const auto& block = m_blocks[i];
+		if (!m_split[i].load(std::memory_order_relaxed)) {
+			ranges.push_back(getRange(block, regs));
+			blocks.push_back(static_cast<uint32_t>(i));
+			continue;
+		}
+		for (uint32_t j = 0; j < block.partCount; ++j) {
+			ranges.push_back(getRange(m_parts[block.firstPart + j], regs));
+			blocks.push_back(static_cast<uint32_t>(i));
+		}
+	}
+}
+
+bool ReadPlan::split(size_t index) const noexcept {
+	return m_blocks[index].partCount > 1 &&
+		   !m_split[index].exchange(true, std::memory_order_relaxed);
+}
+
+void ReadPlan::executeSplit(ModbusDevice& device,
+							uint16_t* regs,
+							size_t first,
+							size_t last) const {
+	for (size_t i = first; i < last; ++i) {
+		const auto& block = m_blocks[i];
+		if (!m_split[i].load(std::memory_order_relaxed)) {
+			const auto range = getRange(block, regs);
+			try {
+				device.readRanges(&range, 1);
+				continue;
+			} catch (const ModbusException& ex) {
+				if (!ex.isIllegalDataAddress() || block.partCount == 1) {
+					throw;
+				}
+			}
+			m_split[i].store(true, std::memory_order_relaxed);
+		}
+		for (uint32_t j = 0; j < block.partCount; ++j) {
+			const auto range = getRange(m_parts[block.firstPart + j], regs);
+			device.readRanges(&range, 1);
+		}
+	}
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "mapping.hpp"
+#include "modbus-device.hpp"
+
+/**
+ * Groups a set of value definitions into as few Modbus requests as possible.
+ *
+ * Values of the same type whose register ranges are adjacent or overlap are
+ * merged into a single block. Small gaps between values are bridged as well
+ * when reading the unused registers is cheaper than an extra request, unless
+ * the mapping lists them as unreadable. Every value is then decoded from a
+ * shared register buffer at a fixed offset. A bridged block the slave
+ * refuses with an illegal data address exception is read without its gaps
+ * from then on.
+ *
+ * A plan is immutable once built, so it can be compiled once and executed on
+ * every poll cycle without resolving any names again.
+ */
+class ReadPlan {
+   public:
+	struct Block {
+		uint32_t offset;  // Offset of the block in the register buffer
+		uint16_t addr;
+		uint16_t length;
+		Mapping::ValueDefType type;
+		bool bits;	// Coils or discrete inputs rather than registers
+		uint32_t firstPart = 0;	 // Ranges of the block without its gaps
+		uint32_t partCount = 1;
+	};
+
+	struct Entry {
+		const Mapping::ValueDef* def;
+		std::string name;
+		uint32_t offset;	 // Offset of the value in the register buffer
+		bool bulk = false;	 // Decoded as part of a run
+	};
+
+	/**
+	 * Consecutive entries stored back to back in the register buffer that
+	 * share a format, byte order and scale, so they can be decoded in one
+	 * pass with value_utils::decode_array().
+	 */
+	struct Run {
+		uint32_t first;	 // Index of the first entry
+		uint32_t count;
+	};
+
+	/**
+	 * Builds a plan for the given value names.
+	 * @param mapping The mapping to resolve the names against.
+	 * @param names The names of the values to read.
+	 * @param maxGap The largest number of unused registers to read between
+	 * two values instead of starting a new request.
+	 * @param caps The request sizes the device accepts.
+	 */
+	ReadPlan(std::shared_ptr<const Mapping> mapping,
+			 const std::vector<std::string>& names,
+			 uint16_t maxGap = 0,
+			 const ModbusDevice::Capabilities& caps = {});
+
+	/**
+	 * Builds a plan for every value in the mapping.
+	 * @param mapping The mapping to read.
+	 * @param maxGap The largest number of unused registers to read between
+	 * two values instead of starting a new request.
+	 * @param caps The request sizes the device accepts.
+	 */
+	explicit ReadPlan(std::shared_ptr<const Mapping> mapping,
+					  uint16_t maxGap = 0,
+					  const ModbusDevice::Capabilities& caps = {});
+
+	/**
+	 * Reads every block of the plan from the device.
+	 * @param device The device to read from.
+	 * @param regs Destination buffer of at least getRegisterCount() words.
+	 * @note Bit values are stored as 0 or 1 in their own word. Blocks the
+	 * device rejects as too large are split further.
+	 */
+	void execute(ModbusDevice& device, uint16_t* regs) const;
+
+	/**
+	 * Gets the range to read for a block, for callers that issue the
+	 * requests themselves.
+	 * @param block The block.
+	 * @param regs The register buffer of the plan.
+	 * @return The range, stored at the offset of the block in the buffer.
+	 */
+	static ModbusDevice::ReadRange getRange(const Block& block,
+											uint16_t* regs) noexcept {
+		return {block.bits, block.type == Mapping::ValueDefType::input,
+				block.addr, block.length, regs + block.offset};
+	}
+
+	/**
+	 * Gets the ranges to read the plan in, for callers that issue the
+	 * requests themselves. Blocks whose gaps the slave refused are read in
+	 * parts.
+	 * @param regs The register buffer of the plan.
+	 * @param ranges Replaced with the ranges.
+	 * @param blocks Replaced with the index of the block of each range.
+	 */
+	void getRanges(uint16_t* regs,
+				   std::vector<ModbusDevice::ReadRange>& ranges,
+				   std::vector<uint32_t>& blocks) const;
+
+	/**
+	 * Reads a block in parts from now on, after the slave refused its gaps
+	 * with an illegal data address exception.
+	 * @param index The index of the block.
+	 * @return False if the block has no gaps or is already read in parts.
+	 */
+	bool split(size_t index) const noexcept;
+
+	const Mapping& getMapping() const noexcept { return *m_mapping; }
+
+	const std::vector<Block>& getBlocks() const noexcept { return m_blocks; }
+
+	/**
+	 * Gets the ranges a block is read in once its gaps are refused, each a
+	 * block of its own at its place in the register buffer.
+	 */
+	const std::vector<Block>& getParts() const noexcept { return m_parts; }
+
+	const std::vector<Entry>& getEntries() const noexcept { return m_entries; }
+
+	const std::vector<Run>& getRuns() const noexcept { return m_runs; }
+
+	/**
+	 * Gets the size of the register buffer needed to execute the plan.
+	 * @return The number of 16-bit words.
+	 */
+	uint32_t getRegisterCount() const noexcept { return m_registerCount; }
+
+   private:
+	void build(uint16_t maxGap, const ModbusDevice::Capabilities& caps);
+	void buildRuns();
+
+	/** Reads blocks one by one, in parts for those whose gaps are refused. */
+	void executeSplit(ModbusDevice& device,
+					  uint16_t* regs,
+					  size_t first,
+					  size_t last) const;
+
+	std::shared_ptr<const Mapping> m_mapping;
+	std::vector<Block> m_blocks;
+	std::vector<Block> m_parts;
+
+	// Blocks read in parts, shared by every execution of the plan
+	std::unique_ptr<std::atomic<bool>[]> m_split;
+	std::vector<Entry> m_entries;
+	std::vector<Run> m_runs;
+	uint32_t m_registerCount = 0;
+};
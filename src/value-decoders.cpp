@@ -0,0 +1,342 @@
+#include "value-decoders.hpp"
+#include <cstring>
+#include <iterator>
+#include <lua.hpp>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include "value-utils.hpp"
+
+namespace {
+using Format = Mapping::ValueDefFormat;
+using Order = Mapping::ValueDefOrder;
+using Decoder = Mapping::ValueDecoder;
+
+template <typename T>
+T load(const uint16_t* regs);
+
+template <>
+uint16_t load<uint16_t>(const uint16_t* regs) {
+	return regs[0];
+}
+
+template <>
+uint32_t load<uint32_t>(const uint16_t* regs) {
+	return (static_cast<uint32_t>(regs[0]) << 16) |
+		   static_cast<uint32_t>(regs[1]);
+}
+
+template <>
+uint64_t load<uint64_t>(const uint16_t* regs) {
+	return (static_cast<uint64_t>(regs[0]) << 48) |
+		   (static_cast<uint64_t>(regs[1]) << 32) |
+		   (static_cast<uint64_t>(regs[2]) << 16) |
+		   static_cast<uint64_t>(regs[3]);
+}
+
+void pushString(lua_State* L,
+				const Mapping& mapping,
+				uint32_t id,
+				int strings) {
+	if (strings != 0) {
+		// Already interned, so no hashing
+		lua_rawgeti(L, strings, static_cast<int>(id) + 1);
+	} else {
+		const auto& str = mapping.getString(id);
+		lua_pushlstring(L, str.c_str(), str.size());
+	}
+}
+
+void pushEnum(lua_State* L,
+			  const Mapping& mapping,
+			  const Mapping::ValueDef& def,
+			  int64_t value,
+			  const char* name,
+			  int strings) {
+	const int64_t id = def.enumDef->find(value);
+	if (id < 0) {
+		throw std::runtime_error("Enum value not found for value " +
+								 std::to_string(value) +
+								 " in mapping: " + std::string(name));
+	}
+	pushString(L, mapping, static_cast<uint32_t>(id), strings);
+}
+
+/**
+ * Decodes an integer. The unsigned value is used for enum lookups, while the
+ * value pushed has the signedness of the format.
+ */
+template <typename U, typename S, Order O, bool Scaled, bool Linked>
+void decodeInteger(lua_State* L,
+				   const Mapping& mapping,
+				   const Mapping::ValueDef& def,
+				   const uint16_t* regs,
+				   const char* name,
+				   int strings) {
+	U value = value_utils::map_byte_order<O>(load<U>(regs));
+	S value_s = static_cast<S>(value);
+
+	if constexpr (Scaled) {
+		value = static_cast<U>(static_cast<double>(value) * def.scale);
+		value_s = static_cast<S>(static_cast<double>(value_s) * def.scale);
+	}
+
+	if constexpr (Linked) {
+		pushEnum(L, mapping, def, static_cast<int64_t>(value), name, strings);
+	} else if constexpr (sizeof(S) == 8) {
+		// Unsigned values above the range of lua_Integer would wrap
+		lua_pushnumber(L, static_cast<lua_Number>(value_s));
+	} else {
+		lua_pushinteger(L, value_s);
+	}
+}
+
+template <typename F, typename U, Order O, bool Scaled>
+void decodeFloat(lua_State* L,
+				 const Mapping&,
+				 const Mapping::ValueDef& def,
+				 const uint16_t* regs,
+				 const char*,
+				 int) {
+	const U raw = value_utils::map_byte_order<O>(load<U>(regs));
+
+	F value;
+	memcpy(&value, &raw, sizeof(F));
+	if constexpr (Scaled) {
+		value = static_cast<F>(static_cast<double>(value) * def.scale);
+	}
+
+	lua_pushnumber(L, static_cast<lua_Number>(value));
+}
+
+void decodeBit(lua_State* L,
+			   const Mapping&,
+			   const Mapping::ValueDef&,
+			   const uint16_t* regs,
+			   const char*,
+			   int) {
+	lua_pushboolean(L, regs[0] != 0);
+}
+
+bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+		   c == '\f';
+}
+
+template <Order O, bool Trim>
+void decodeString(lua_State* L,
+				  const Mapping&,
+				  const Mapping::ValueDef& def,
+				  const uint16_t* regs,
+				  const char*,
+				  int) {
+	// ab and ba hold two characters per register, a and b only one
+	constexpr bool wide = O == Order::ab || O == Order::ba;
+	const size_t size = wide ? def.length * 2u : def.length;
+
+	// Typical strings are written straight into a Lua buffer, longer ones
+	// need the heap
+	luaL_Buffer buffer;
+	std::string heapValue;
+	char* strValue;
+	if (size <= LUAL_BUFFERSIZE) {
+		luaL_buffinit(L, &buffer);
+		strValue = luaL_prepbuffer(&buffer);
+	} else {
+		heapValue.resize(size);
+		strValue = &heapValue[0];
+	}
+
+	if constexpr (wide) {
+		value_utils::unpack_bytes(regs, def.length, O == Order::ab, strValue);
+	} else {
+		for (size_t i = 0; i < def.length; ++i) {
+			strValue[i] = static_cast<char>(O == Order::a ? regs[i] >> 8
+														  : regs[i] & 0x00FF);
+		}
+	}
+
+	// The string ends at the first null character
+	const void* nul = memchr(strValue, '\0', size);
+	size_t end = nul ? static_cast<const char*>(nul) - strValue : size;
+	size_t begin = 0;
+	if constexpr (Trim) {
+		while (end > begin && isSpace(strValue[end - 1])) {
+			--end;
+		}
+		while (begin < end && isSpace(strValue[begin])) {
+			++begin;
+		}
+	}
+
+	if (size > LUAL_BUFFERSIZE) {
+		lua_pushlstring(L, strValue + begin, end - begin);
+		return;
+	}
+	if (begin > 0) {
+		memmove(strValue, strValue + begin, end - begin);
+	}
+	luaL_addsize(&buffer, end - begin);
+	luaL_pushresult(&buffer);
+}
+
+void decodeBitfield(lua_State* L,
+					const Mapping& mapping,
+					const Mapping::ValueDef& def,
+					const uint16_t* regs,
+					const char*,
+					int strings) {
+	lua_createtable(L, 0, static_cast<int>(def.bitfieldDef->size()));
+	value_decoders::fillBitfield(L, mapping, def, regs, strings,
+								 lua_gettop(L));
+}
+
+void decodeUnsupported(lua_State*,
+					   const Mapping&,
+					   const Mapping::ValueDef&,
+					   const uint16_t*,
+					   const char* name,
+					   int) {
+	throw std::runtime_error("Unsupported format in luaRead for mapping: " +
+							 std::string(name));
+}
+
+template <typename U, typename S, Order O>
+Decoder selectInteger(const Mapping::ValueDef& def) {
+	const bool scaled = def.scale != 1.0;
+	const bool linked = !def.linked.empty();
+	if (scaled) {
+		return linked ? decodeInteger<U, S, O, true, true>
+					  : decodeInteger<U, S, O, true, false>;
+	}
+	return linked ? decodeInteger<U, S, O, false, true>
+				  : decodeInteger<U, S, O, false, false>;
+}
+
+template <typename F, typename U, Order O>
+Decoder selectFloat(const Mapping::ValueDef& def) {
+	return def.scale != 1.0 ? decodeFloat<F, U, O, true>
+							: decodeFloat<F, U, O, false>;
+}
+
+template <typename U, typename S>
+struct IntegerSelector {
+	template <Order O>
+	static Decoder select(const Mapping::ValueDef& def) {
+		return selectInteger<U, S, O>(def);
+	}
+};
+
+template <typename F, typename U>
+struct FloatSelector {
+	template <Order O>
+	static Decoder select(const Mapping::ValueDef& def) {
+		return selectFloat<F, U, O>(def);
+	}
+};
+
+/**
+ * Instantiates a decoder for every order of value_utils::BYTE_ORDERS of the
+ * size of U and picks the one matching the definition.
+ */
+template <typename U, typename Selector, size_t... I>
+Decoder selectOrder(const Mapping::ValueDef& def, std::index_sequence<I...>) {
+	Decoder decoder = decodeUnsupported;
+	(
+		[&] {
+			constexpr Order order = value_utils::BYTE_ORDERS[I].order;
+			if constexpr (value_utils::byte_order_size(order) == sizeof(U)) {
+				if (def.order == order) {
+					decoder = Selector::template select<order>(def);
+				}
+			}
+		}(),
+		...);
+	return decoder;
+}
+
+template <typename U, typename Selector>
+Decoder selectOrder(const Mapping::ValueDef& def) {
+	return selectOrder<U, Selector>(
+		def, std::make_index_sequence<std::size(value_utils::BYTE_ORDERS)>());
+}
+
+template <typename U, typename S>
+Decoder selectIntegerFormat(const Mapping::ValueDef& def) {
+	return selectOrder<U, IntegerSelector<U, S>>(def);
+}
+
+template <typename F, typename U>
+Decoder selectFloatFormat(const Mapping::ValueDef& def) {
+	return selectOrder<U, FloatSelector<F, U>>(def);
+}
+
+template <Order O>
+Decoder selectString(const Mapping::ValueDef& def) {
+	return def.trim ? decodeString<O, true> : decodeString<O, false>;
+}
+
+Decoder selectString(const Mapping::ValueDef& def) {
+	switch (def.order) {
+		case Order::ab:
+			return selectString<Order::ab>(def);
+		case Order::ba:
+			return selectString<Order::ba>(def);
+		case Order::a:
+			return selectString<Order::a>(def);
+		case Order::b:
+			return selectString<Order::b>(def);
+		default:
+			return decodeUnsupported;
+	}
+}
+}  // namespace
+
+namespace value_decoders {
+Mapping::ValueDecoder select(const Mapping::ValueDef& def) {
+	switch (def.format) {
+		case Format::bit:
+			return decodeBit;
+		case Format::u16:
+			return selectIntegerFormat<uint16_t, uint16_t>(def);
+		case Format::i16:
+			return selectIntegerFormat<uint16_t, int16_t>(def);
+		case Format::u32:
+			return selectIntegerFormat<uint32_t, uint32_t>(def);
+		case Format::i32:
+			return selectIntegerFormat<uint32_t, int32_t>(def);
+		case Format::u64:
+			return selectIntegerFormat<uint64_t, uint64_t>(def);
+		case Format::i64:
+			return selectIntegerFormat<uint64_t, int64_t>(def);
+		case Format::f32:
+			return selectFloatFormat<float, uint32_t>(def);
+		case Format::f64:
+			return selectFloatFormat<double, uint64_t>(def);
+		case Format::str:
+			return selectString(def);
+		case Format::bitfield:
+			return decodeBitfield;
+		default:
+			return decodeUnsupported;
+	}
+}
+}  // namespace value_decoders
+
+void value_decoders::fillBitfield(lua_State* L,
+								  const Mapping& mapping,
+								  const Mapping::ValueDef& def,
+								  const uint16_t* regs,
+								  int strings,
+								  int tableIndex) {
+	// Flags are sorted, so the registers are walked in order
+	for (const auto& flag : *def.bitfieldDef) {
+		uint16_t regIndex = flag.bit / 16;
+		uint16_t bitInReg = flag.bit % 16;
+		uint16_t regValue = regs[regIndex];
+		bool bitSet = (regValue & (1u << bitInReg)) != 0;
+		pushString(L, mapping, flag.string, strings);
+		lua_pushboolean(L, bitSet);
+		lua_rawset(L, tableIndex);
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "mapping.hpp"
+
+namespace value_decoders {
+/**
+ * Chooses the decoder for a value definition.
+ *
+ * Decoders are specialized on the format, byte order, whether a scale applies
+ * and whether an enum is linked, so decoding a value makes no decisions that
+ * could have been made when the mapping was loaded.
+ * @param def The value definition, with everything but the decoder set.
+ * @return The decoder to store in the definition.
+ */
+Mapping::ValueDecoder select(const Mapping::ValueDef& def);
+
+/**
+ * Sets a boolean field for every flag of a bitfield in an existing table, in
+ * ascending bit order.
+ * @param L The Lua state.
+ * @param mapping The mapping of the bitfield.
+ * @param def The definition of the bitfield.
+ * @param regs The registers of the bitfield.
+ * @param strings Stack index of the interned strings, or 0 to push the flag
+ * names from the mapping.
+ * @param tableIndex Stack index of the table to fill.
+ */
+void fillBitfield(lua_State* L,
+				  const Mapping& mapping,
+				  const Mapping::ValueDef& def,
+				  const uint16_t* regs,
+				  int strings,
+				  int tableIndex);
+}  // namespace value_decoders
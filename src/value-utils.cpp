@@ -1,9 +1,234 @@
 #include "value-utils.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define MODBUSPLUS_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define MODBUSPLUS_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+using value_utils::BytePermutation;
+
+// Every order must move each byte exactly once and be undone by its inverse
+constexpr bool is_valid(const BytePermutation& map,
+						const BytePermutation& unmap) {
+	unsigned int seen = 0;
+	for (size_t i = 0; i < map.size; ++i) {
+		seen |= 1u << map.from[i];
+		if (map.from[unmap.from[i]] != i) {
+			return false;
+		}
+	}
+	return seen == (1u << map.size) - 1;
+}
+
+constexpr bool all_valid() {
+	for (const auto& entry : value_utils::BYTE_ORDERS) {
+		const auto index = static_cast<size_t>(entry.order);
+		if (!is_valid(value_utils::detail::PERMUTATIONS.map[index],
+					  value_utils::detail::PERMUTATIONS.unmap[index])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static_assert(all_valid(), "Invalid byte order in BYTE_ORDERS");
+static_assert(value_utils::map_byte_order<Mapping::ValueDefOrder::cdab>(
+				  uint32_t{0x12345678}) == 0x56781234,
+			  "Word swap is wrong");
+static_assert(value_utils::map_byte_order<Mapping::ValueDefOrder::ghefcdab>(
+				  uint64_t{0x0123456789ABCDEF}) == 0xCDEF89AB45670123,
+			  "Word reversal is wrong");
+
+// Moves the bytes of every 16 byte group of src into dest, byte i of a group
+// coming from byte mask[i] of the same group
+using ShuffleFn = void (*)(const uint8_t* src,
+						   uint8_t* dest,
+						   size_t size,
+						   const uint8_t* mask);
+
+void shuffle_scalar(const uint8_t* src,
+					uint8_t* dest,
+					size_t size,
+					const uint8_t* mask) {
+	for (size_t i = 0; i < size; i += 16) {
+		const size_t n = std::min<size_t>(16, size - i);
+		for (size_t j = 0; j < n; ++j) {
+			dest[i + j] = src[i + mask[j]];
+		}
+	}
+}
+
+#if defined(MODBUSPLUS_SIMD_X86)
+__attribute__((target("ssse3"))) void shuffle_ssse3(const uint8_t* src,
+													uint8_t* dest,
+													size_t size,
+													const uint8_t* mask) {
+	const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask));
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		const __m128i v =
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i),
+						 _mm_shuffle_epi8(v, m));
+	}
+	shuffle_scalar(src + i, dest + i, size - i, mask);
+}
+
+__attribute__((target("avx2"))) void shuffle_avx2(const uint8_t* src,
+												  uint8_t* dest,
+												  size_t size,
+												  const uint8_t* mask) {
+	// Values never cross a 16 byte lane, so an in-lane shuffle is enough
+	const __m256i m = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(mask)));
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		const __m256i v =
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i),
+							_mm256_shuffle_epi8(v, m));
+	}
+	shuffle_scalar(src + i, dest + i, size - i, mask);
+}
+#elif defined(MODBUSPLUS_SIMD_NEON)
+void shuffle_neon(const uint8_t* src,
+				  uint8_t* dest,
+				  size_t size,
+				  const uint8_t* mask) {
+	const uint8x16_t m = vld1q_u8(mask);
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		vst1q_u8(dest + i, vqtbl1q_u8(vld1q_u8(src + i), m));
+	}
+	shuffle_scalar(src + i, dest + i, size - i, mask);
+}
+#endif
+
+ShuffleFn select_shuffle() {
+#if defined(MODBUSPLUS_SIMD_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return shuffle_avx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return shuffle_ssse3;
+	}
+#elif defined(MODBUSPLUS_SIMD_NEON)
+	return shuffle_neon;
+#endif
+	return shuffle_scalar;
+}
+
+/**
+ * Builds the shuffle mask turning values stored in registers into native
+ * values. The mask is found by decoding a value whose bytes hold their own
+ * positions, so it always agrees with map_byte_order().
+ */
+template <typename U>
+void build_mask(Mapping::ValueDefOrder order, uint8_t* mask) {
+	uint8_t positions[sizeof(U)];
+	std::iota(positions, positions + sizeof(U), 0);
+	uint16_t regs[sizeof(U) / 2];
+	memcpy(regs, positions, sizeof(U));
+
+	// Registers are big endian, the first one holding the high word
+	uint64_t raw = 0;
+	for (const uint16_t reg : regs) {
+		raw = (raw << 16) | reg;
+	}
+	const U value = value_utils::map_byte_order(static_cast<U>(raw), order);
+
+	uint8_t perm[sizeof(U)];
+	memcpy(perm, &value, sizeof(U));
+	for (size_t i = 0; i < 16; ++i) {
+		mask[i] = static_cast<uint8_t>(i - i % sizeof(U) + perm[i % sizeof(U)]);
+	}
+}
+
+template <typename T, bool Integer>
+void to_double(const uint8_t* src, size_t count, double scale, double* dest) {
+	if (scale == 1.0) {
+		for (size_t i = 0; i < count; ++i) {
+			T value;
+			memcpy(&value, src + i * sizeof(T), sizeof(T));
+			dest[i] = static_cast<double>(value);
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		T value;
+		memcpy(&value, src + i * sizeof(T), sizeof(T));
+		const double scaled = static_cast<double>(value) * scale;
+		if constexpr (std::is_same_v<T, float>) {
+			// Scaled floats stay single precision
+			dest[i] = static_cast<double>(static_cast<float>(scaled));
+		} else if constexpr (Integer) {
+			dest[i] = std::trunc(scaled);
+		} else {
+			dest[i] = scaled;
+		}
+	}
+}
+
+template <typename U, typename T, bool Integer>
+void decode(const uint16_t* regs,
+			size_t count,
+			Mapping::ValueDefOrder order,
+			double scale,
+			double* dest) {
+	static const ShuffleFn shuffle = select_shuffle();
+
+	uint8_t mask[16];
+	build_mask<U>(order, mask);
+
+	// Reorder a chunk at a time into a buffer small enough for the stack
+	constexpr size_t CHUNK = 64;
+	alignas(32) uint8_t native[CHUNK * sizeof(U)];
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(regs);
+	for (size_t done = 0; done < count; done += CHUNK) {
+		const size_t n = std::min(CHUNK, count - done);
+		shuffle(src + done * sizeof(U), native, n * sizeof(U), mask);
+		to_double<T, Integer>(native, n, scale, dest + done);
+	}
+}
+
+// Registers are native words, so whether their bytes need swapping to be in
+// the order they are sent depends on the host
+bool needs_swap(bool highFirst) {
+	const uint16_t probe = 0x0102;
+	uint8_t first;
+	memcpy(&first, &probe, 1);
+	const bool littleEndian = first == 0x02;
+	return highFirst == littleEndian;
+}
+
+constexpr uint8_t SWAP_MASK[16] = {1, 0, 3,  2,  5,  4,  7,  6,
+								   9, 8, 11, 10, 13, 12, 15, 14};
+}  // namespace
 
 std::vector<uint16_t> value_utils::pack_coils_to_u16(const uint8_t* coils,
 													 int nb) {
+	std::vector<uint16_t> packed((nb + 7) / 8, 0);
+	pack_coils_to_u16(coils, nb, packed.data());
+	return packed;
+}
+
+void value_utils::pack_coils_to_u16(const uint8_t* coils,
+									int nb,
+									uint16_t* packed) {
 	int byte_count = (nb + 7) / 8;
-	std::vector<uint16_t> packed(byte_count, 0);
 
 	for (int i = 0; i < byte_count; ++i) {
 		uint8_t b = 0;
@@ -15,6 +240,119 @@ std::vector<uint16_t> value_utils::pack_coils_to_u16(const uint8_t* coils,
 		}
 		packed[i] = static_cast<uint16_t>(b);  // Upper bits remain 0
 	}
+}
 
-	return packed;
+void value_utils::unpack_bits(const uint8_t* src, int nb, uint16_t* dest) {
+	// Simple enough for the compiler to vectorise
+	for (int i = 0; i < nb; ++i) {
+		dest[i] = src[i] != 0 ? 1 : 0;
+	}
+}
+
+void value_utils::unpack_bits_msb(const uint8_t* src, int nb, uint16_t* dest) {
+	// Whole bytes first, eight bits at a time
+	const int whole = nb / 8;
+	for (int i = 0; i < whole; ++i) {
+		const unsigned int b = src[i];
+		uint16_t* out = dest + i * 8;
+		out[0] = (b >> 7) & 1u;
+		out[1] = (b >> 6) & 1u;
+		out[2] = (b >> 5) & 1u;
+		out[3] = (b >> 4) & 1u;
+		out[4] = (b >> 3) & 1u;
+		out[5] = (b >> 2) & 1u;
+		out[6] = (b >> 1) & 1u;
+		out[7] = b & 1u;
+	}
+
+	// Then the remaining bits of the last byte
+	for (int i = whole * 8; i < nb; ++i) {
+		dest[i] = (src[i / 8] >> (7 - i % 8)) & 1u;
+	}
+}
+
+void value_utils::unpack_bytes(const uint16_t* regs,
+							   size_t count,
+							   bool highFirst,
+							   char* dest) {
+	static const ShuffleFn shuffle = select_shuffle();
+
+	if (!needs_swap(highFirst)) {
+		memcpy(dest, regs, count * 2);
+		return;
+	}
+	shuffle(reinterpret_cast<const uint8_t*>(regs),
+			reinterpret_cast<uint8_t*>(dest), count * 2, SWAP_MASK);
+}
+
+void value_utils::pack_bytes(const char* src,
+							 size_t size,
+							 bool highFirst,
+							 uint16_t* dest) {
+	static const ShuffleFn shuffle = select_shuffle();
+
+	const size_t whole = size / 2 * 2;
+	if (!needs_swap(highFirst)) {
+		memcpy(dest, src, whole);
+	} else {
+		shuffle(reinterpret_cast<const uint8_t*>(src),
+				reinterpret_cast<uint8_t*>(dest), whole, SWAP_MASK);
+	}
+
+	if (whole < size) {
+		const auto last = static_cast<uint8_t>(src[whole]);
+		dest[whole / 2] = highFirst ? static_cast<uint16_t>(last << 8) : last;
+	}
+}
+
+bool value_utils::is_array_format(Mapping::ValueDefFormat format) noexcept {
+	switch (format) {
+		case Mapping::ValueDefFormat::u16:
+		case Mapping::ValueDefFormat::i16:
+		case Mapping::ValueDefFormat::u32:
+		case Mapping::ValueDefFormat::i32:
+		case Mapping::ValueDefFormat::u64:
+		case Mapping::ValueDefFormat::i64:
+		case Mapping::ValueDefFormat::f32:
+		case Mapping::ValueDefFormat::f64:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void value_utils::decode_array(const uint16_t* regs,
+							   size_t count,
+							   Mapping::ValueDefFormat format,
+							   Mapping::ValueDefOrder order,
+							   double scale,
+							   double* dest) {
+	switch (format) {
+		case Mapping::ValueDefFormat::u16:
+			decode<uint16_t, uint16_t, true>(regs, count, order, scale, dest);
+			return;
+		case Mapping::ValueDefFormat::i16:
+			decode<uint16_t, int16_t, true>(regs, count, order, scale, dest);
+			return;
+		case Mapping::ValueDefFormat::u32:
+			decode<uint32_t, uint32_t, true>(regs, count, order, scale, dest);
+			return;
+		case Mapping::ValueDefFormat::i32:
+			decode<uint32_t, int32_t, true>(regs, count, order, scale, dest);
+			return;
+		case Mapping::ValueDefFormat::u64:
+			decode<uint64_t, uint64_t, true>(regs, count, order, scale, dest);
+			return;
+		case Mapping::ValueDefFormat::i64:
+			decode<uint64_t, int64_t, true>(regs, count, order, scale, dest);
+			return;
+		case Mapping::ValueDefFormat::f32:
+			decode<uint32_t, float, false>(regs, count, order, scale, dest);
+			return;
+		case Mapping::ValueDefFormat::f64:
+			decode<uint64_t, double, false>(regs, count, order, scale, dest);
+			return;
+		default:
+			throw std::invalid_argument("Format cannot be decoded as an array");
+	}
 }
@@ -1,94 +1,291 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <utility>
 #include <vector>
 #include "mapping.hpp"
 
 namespace value_utils {
 std::vector<uint16_t> pack_coils_to_u16(const uint8_t* coils, int nb);
 
-inline uint16_t map_byte_order(uint16_t value,
-							   Mapping::ValueDefOrder ab_order) {
-	if (ab_order == Mapping::ValueDefOrder::ba) {
-		return (value >> 8) | (value << 8);
+/**
+ * Packs bits stored one per byte eight to a word, least significant bit
+ * first, without allocating.
+ * @param coils The bits, one per byte.
+ * @param nb The number of bits.
+ * @param dest The destination, (nb + 7) / 8 words.
+ */
+void pack_coils_to_u16(const uint8_t* coils, int nb, uint16_t* dest);
+
+/**
+ * Unpacks bits stored one per byte, as read by libmodbus, into one word per
+ * bit holding 0 or 1.
+ * @param src The bits, one per byte.
+ * @param nb The number of bits.
+ * @param dest The destination, one word per bit.
+ */
+void unpack_bits(const uint8_t* src, int nb, uint16_t* dest);
+
+/**
+ * Unpacks bits packed eight per byte, most significant bit first, into one
+ * word per bit holding 0 or 1.
+ * @param src The packed bits.
+ * @param nb The number of bits.
+ * @param dest The destination, one word per bit.
+ */
+void unpack_bits_msb(const uint8_t* src, int nb, uint16_t* dest);
+
+/**
+ * Copies the bytes of registers in the order they are sent, two per
+ * register, reordering them with the same shuffles as decode_array().
+ * @param regs The registers.
+ * @param count The number of registers.
+ * @param highFirst True for the high byte of each register first (ab),
+ * false for the low byte first (ba).
+ * @param dest The destination, count * 2 bytes.
+ */
+void unpack_bytes(const uint16_t* regs,
+				  size_t count,
+				  bool highFirst,
+				  char* dest);
+
+/**
+ * Packs bytes into registers two at a time, the reverse of unpack_bytes().
+ * @param src The bytes.
+ * @param size The number of bytes, an odd last byte is padded with 0.
+ * @param highFirst True for the first byte in the high byte of each register
+ * (ab), false for the low byte (ba).
+ * @param dest The destination, (size + 1) / 2 registers.
+ */
+void pack_bytes(const char* src, size_t size, bool highFirst, uint16_t* dest);
+
+/**
+ * Checks whether values of a format can be decoded with decode_array().
+ * @param format The format of the values.
+ * @return True for the integer formats, f32 and f64.
+ */
+bool is_array_format(Mapping::ValueDefFormat format) noexcept;
+
+/**
+ * Decodes values stored back to back in registers into doubles, giving the
+ * same results as decoding them one at a time. The bytes are reordered with
+ * SSSE3 or AVX2 on x86 and NEON on ARM when available.
+ * @param regs The registers, the width of the format for each value.
+ * @param count The number of values.
+ * @param format The format of the values, see is_array_format().
+ * @param order The byte order of the values.
+ * @param scale The scale to apply, integers are truncated after scaling.
+ * @param dest The destination, one double per value.
+ */
+void decode_array(const uint16_t* regs,
+				  size_t count,
+				  Mapping::ValueDefFormat format,
+				  Mapping::ValueDefOrder order,
+				  double scale,
+				  double* dest);
+
+/**
+ * A byte order of integers and floats. Byte i of the registers holds the
+ * byte name[i] of the value, 'a' being the most significant.
+ */
+struct ByteOrder {
+	Mapping::ValueDefOrder order;
+	const char* name;
+};
+
+/**
+ * Every byte order of 16, 32 and 64-bit values. The 64-bit ones keep the
+ * four registers in order, reversed, swapped in pairs or swapped as pairs,
+ * each with or without swapping the bytes of every register.
+ */
+inline constexpr ByteOrder BYTE_ORDERS[] = {
+	{Mapping::ValueDefOrder::ab, "ab"},
+	{Mapping::ValueDefOrder::ba, "ba"},
+	{Mapping::ValueDefOrder::abcd, "abcd"},
+	{Mapping::ValueDefOrder::dcba, "dcba"},
+	{Mapping::ValueDefOrder::badc, "badc"},
+	{Mapping::ValueDefOrder::cdab, "cdab"},
+	{Mapping::ValueDefOrder::abcdefgh, "abcdefgh"},
+	{Mapping::ValueDefOrder::badcfehg, "badcfehg"},
+	{Mapping::ValueDefOrder::cdabghef, "cdabghef"},
+	{Mapping::ValueDefOrder::dcbahgfe, "dcbahgfe"},
+	{Mapping::ValueDefOrder::efghabcd, "efghabcd"},
+	{Mapping::ValueDefOrder::fehgbadc, "fehgbadc"},
+	{Mapping::ValueDefOrder::ghefcdab, "ghefcdab"},
+	{Mapping::ValueDefOrder::hgfedcba, "hgfedcba"},
+};
+
+/**
+ * Where every byte of a value comes from, counting from the most significant
+ * byte. The size is 0 for orders that only apply to strings.
+ */
+struct BytePermutation {
+	size_t size = 0;
+	uint8_t from[8] = {};
+};
+
+/**
+ * Gets the size in bytes of the values an order applies to.
+ * @return 2, 4 or 8, or 0 for orders that only apply to strings.
+ */
+constexpr size_t byte_order_size(Mapping::ValueDefOrder order) {
+	for (const auto& entry : BYTE_ORDERS) {
+		if (entry.order == order) {
+			size_t size = 0;
+			while (entry.name[size] != '\0') {
+				++size;
+			}
+			return size;
+		}
 	}
-	return value;
+	return 0;
 }
 
-inline uint16_t unmap_byte_order(uint16_t value,
-								 Mapping::ValueDefOrder ab_order) {
-	// Same as map_byte_order since swapping is symmetric
-	return map_byte_order(value, ab_order);
+/**
+ * Gets the permutation turning register contents into a value.
+ */
+constexpr BytePermutation byte_permutation(Mapping::ValueDefOrder order) {
+	BytePermutation perm;
+	for (const auto& entry : BYTE_ORDERS) {
+		if (entry.order == order) {
+			perm.size = byte_order_size(order);
+			for (size_t i = 0; i < perm.size; ++i) {
+				perm.from[entry.name[i] - 'a'] = static_cast<uint8_t>(i);
+			}
+		}
+	}
+	return perm;
 }
 
-inline uint32_t map_byte_order(uint32_t value, Mapping::ValueDefOrder order) {
-	const uint32_t a = value & 0xFF000000;
-	const uint32_t b = value & 0x00FF0000;
-	const uint32_t c = value & 0x0000FF00;
-	const uint32_t d = value & 0x000000FF;
-
-	switch (order) {
-		case Mapping::ValueDefOrder::abcd:
-			// No change needed
-			return value;
-		case Mapping::ValueDefOrder::dcba:
-			return (d << 24) | (c << 8) | (b >> 8) | (a >> 24);
-		case Mapping::ValueDefOrder::badc:
-			return (b << 8) | (a >> 8) | (d << 8) | (c >> 8);
-		case Mapping::ValueDefOrder::cdab:
-			return ((c | d) << 16) | ((a | b) >> 16);
-		default:
-			return value;  // Unsupported order, return as is
+/**
+ * Gets the permutation undoing another one.
+ */
+constexpr BytePermutation inverse(const BytePermutation& perm) {
+	BytePermutation result;
+	result.size = perm.size;
+	for (size_t i = 0; i < perm.size; ++i) {
+		result.from[perm.from[i]] = static_cast<uint8_t>(i);
 	}
+	return result;
 }
 
-inline uint32_t unmap_byte_order(uint32_t value, Mapping::ValueDefOrder order) {
-	const uint32_t a = value & 0xFF000000;
-	const uint32_t b = value & 0x00FF0000;
-	const uint32_t c = value & 0x0000FF00;
-	const uint32_t d = value & 0x000000FF;
-
-	switch (order) {
-		case Mapping::ValueDefOrder::abcd:
-			// No change needed
-			return value;
-		case Mapping::ValueDefOrder::dcba:
-			return (a >> 24) | (b >> 8) | (c << 8) | (d << 24);
-		case Mapping::ValueDefOrder::badc:
-			return (a >> 8) | (b << 8) | (c >> 8) | (d << 8);
-		case Mapping::ValueDefOrder::cdab:
-			return ((a | b) >> 16) | ((c | d) << 16);
-		default:
-			return value;  // Unsupported order, return as is
+/**
+ * Moves the bytes of a value. Values of a size the permutation doesn't
+ * apply to are returned as is.
+ */
+template <typename U>
+constexpr U permute_bytes(U value, const BytePermutation& perm) {
+	if (perm.size != sizeof(U)) {
+		return value;
 	}
+
+	U result = 0;
+	for (size_t i = 0; i < sizeof(U); ++i) {
+		const size_t from = (sizeof(U) - 1 - perm.from[i]) * 8;
+		const size_t to = (sizeof(U) - 1 - i) * 8;
+		result |= static_cast<U>(static_cast<U>((value >> from) & 0xFF) << to);
+	}
+	return result;
 }
 
-inline uint64_t map_byte_order(uint64_t value, Mapping::ValueDefOrder order) {
-	const uint64_t a = value & 0xFF00000000000000;
-	const uint64_t b = value & 0x00FF000000000000;
-	const uint64_t c = value & 0x0000FF0000000000;
-	const uint64_t d = value & 0x000000FF00000000;
-	const uint64_t e = value & 0x00000000FF000000;
-	const uint64_t f = value & 0x0000000000FF0000;
-	const uint64_t g = value & 0x000000000000FF00;
-	const uint64_t h = value & 0x00000000000000FF;
-
-	switch (order) {
-		case Mapping::ValueDefOrder::abcdefgh:
-			// No change needed
-			return value;
-		default:
-			return value;  // Unsupported order, return as is
+namespace detail {
+constexpr size_t ORDER_COUNT =
+	static_cast<size_t>(Mapping::ValueDefOrder::hgfedcba) + 1;
+
+struct Permutations {
+	BytePermutation map[ORDER_COUNT];
+	BytePermutation unmap[ORDER_COUNT];
+};
+
+constexpr Permutations build_permutations() {
+	Permutations perms;
+	for (size_t i = 0; i < ORDER_COUNT; ++i) {
+		const auto order = static_cast<Mapping::ValueDefOrder>(i);
+		perms.map[i] = byte_permutation(order);
+		perms.unmap[i] = inverse(perms.map[i]);
 	}
+	return perms;
+}
+
+// Looked up by order, so no order is searched for at runtime
+inline constexpr Permutations PERMUTATIONS = build_permutations();
+}  // namespace detail
+
+namespace detail {
+template <size_t From, size_t To, typename U>
+constexpr U move_byte(U value) {
+	constexpr size_t fromShift = (sizeof(U) - 1 - From) * 8;
+	constexpr size_t toShift = (sizeof(U) - 1 - To) * 8;
+	return static_cast<U>(static_cast<U>((value >> fromShift) & 0xFF)
+						  << toShift);
 }
 
-inline uint64_t unmap_byte_order(uint64_t value, Mapping::ValueDefOrder order) {
-	switch (order) {
-		case Mapping::ValueDefOrder::abcdefgh:
-			// No change needed
-			return value;
-		default:
-			return value;  // Unsupported order, return as is
+template <Mapping::ValueDefOrder O, bool Inverse>
+struct OrderPermutation {
+	static constexpr BytePermutation value =
+		Inverse ? PERMUTATIONS.unmap[static_cast<size_t>(O)]
+				: PERMUTATIONS.map[static_cast<size_t>(O)];
+};
+
+// Every shift is a constant, so the compiler can use a byte swap or rotate
+template <typename Perm, typename U, size_t... I>
+constexpr U permute_bytes(U value, std::index_sequence<I...>) {
+	if constexpr (Perm::value.size != sizeof(U)) {
+		return value;
+	} else {
+		return static_cast<U>(
+			(move_byte<Perm::value.from[I], I>(value) | ...));
 	}
 }
+}  // namespace detail
+
+/**
+ * Turns register contents into a value when the order is known at compile
+ * time, without looking anything up at runtime.
+ */
+template <Mapping::ValueDefOrder O, typename U>
+constexpr U map_byte_order(U value) {
+	return detail::permute_bytes<detail::OrderPermutation<O, false>>(
+		value, std::make_index_sequence<sizeof(U)>());
+}
+
+template <Mapping::ValueDefOrder O, typename U>
+constexpr U unmap_byte_order(U value) {
+	return detail::permute_bytes<detail::OrderPermutation<O, true>>(
+		value, std::make_index_sequence<sizeof(U)>());
+}
+
+inline uint16_t map_byte_order(uint16_t value, Mapping::ValueDefOrder order) {
+	return permute_bytes(value,
+						 detail::PERMUTATIONS.map[static_cast<size_t>(order)]);
+}
+
+inline uint16_t unmap_byte_order(uint16_t value,
+								 Mapping::ValueDefOrder order) {
+	return permute_bytes(
+		value, detail::PERMUTATIONS.unmap[static_cast<size_t>(order)]);
+}
+
+inline uint32_t map_byte_order(uint32_t value, Mapping::ValueDefOrder order) {
+	return permute_bytes(value,
+						 detail::PERMUTATIONS.map[static_cast<size_t>(order)]);
+}
+
+inline uint32_t unmap_byte_order(uint32_t value,
+								 Mapping::ValueDefOrder order) {
+	return permute_bytes(
+		value, detail::PERMUTATIONS.unmap[static_cast<size_t>(order)]);
+}
+
+inline uint64_t map_byte_order(uint64_t value, Mapping::ValueDefOrder order) {
+	return permute_bytes(value,
+						 detail::PERMUTATIONS.map[static_cast<size_t>(order)]);
+}
+
+inline uint64_t unmap_byte_order(uint64_t value,
+								 Mapping::ValueDefOrder order) {
+	return permute_bytes(
+		value, detail::PERMUTATIONS.unmap[static_cast<size_t>(order)]);
+}
 }  // namespace value_utils
@@ -0,0 +1,312 @@
+#include "../src/event-loop.hpp"
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <modbus/modbus.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "../src/modbus-device-tcp-async.hpp"
+#include "../src/poller.hpp"
+#include "load-mapping.hpp"
+
+namespace {
+// Serves holding registers holding their own address, or never answers.
+// Reads touching a refused address fail with an illegal data address
+// exception, reads of more than a limit with an illegal data value one.
+class AddressServer {
+   public:
+	explicit AddressServer(bool silent = false,
+						   int refused = -1,
+						   int limit = 125)
+		: m_silent(silent), m_refused(refused), m_limit(limit) {
+		m_listener = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		bind(m_listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+		listen(m_listener, 1);
+		socklen_t size = sizeof(addr);
+		getsockname(m_listener, reinterpret_cast<sockaddr*>(&addr), &size);
+		m_port = ntohs(addr.sin_port);
+		m_thread = std::thread(&AddressServer::serve, this);
+	}
+
+	~AddressServer() {
+		m_thread.join();
+		close(m_listener);
+	}
+
+	int getPort() const { return m_port; }
+
+	std::atomic<int> requests{0};
+
+   private:
+	void serve() {
+		const int client = accept(m_listener, nullptr, nullptr);
+		uint8_t req[12];
+		while (recv(client, req, sizeof(req), MSG_WAITALL) == sizeof(req)) {
+			if (m_silent) {
+				continue;
+			}
+			const int addr = (req[8] << 8) | req[9];
+			const int nb = (req[10] << 8) | req[11];
+			++requests;
+			if (nb > m_limit || (m_refused >= addr && m_refused < addr + nb)) {
+				const uint8_t exception[] = {
+					req[0], req[1], 0, 0, 0, 3, req[6], 0x83,
+					static_cast<uint8_t>(nb > m_limit ? 3 : 2)};
+				send(client, exception, sizeof(exception), 0);
+				continue;
+			}
+			std::vector<uint8_t> response = {
+				req[0], req[1], 0, 0, 0, static_cast<uint8_t>(3 + nb * 2),
+				req[6], 3,		static_cast<uint8_t>(nb * 2)};
+			for (int i = 0; i < nb; ++i) {
+				response.push_back(static_cast<uint8_t>((addr + i) >> 8));
+				response.push_back(static_cast<uint8_t>(addr + i));
+			}
+			send(client, response.data(), response.size(), 0);
+		}
+		close(client);
+	}
+
+	bool m_silent;
+	int m_refused;
+	int m_limit;
+	int m_listener;
+	int m_port;
+	std::thread m_thread;
+};
+
+// Gets a port nothing listens on
+int closed_port() {
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+	socklen_t size = sizeof(addr);
+	getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &size);
+	close(fd);
+	return ntohs(addr.sin_port);
+}
+
+mbap::Transaction read_tx(uint16_t addr, uint16_t nb, uint16_t* dest) {
+	mbap::Transaction tx;
+	tx.function = mbap::READ_HOLDING_REGISTERS;
+	tx.addr = addr;
+	tx.nb = nb;
+	tx.dest = dest;
+	return tx;
+}
+
+// Opens a connection and waits for the result of the first attempt
+int open(EventLoop& loop,
+		 int port,
+		 const EventLoop::ConnectionOptions& options,
+		 EventLoop::ConnectionId& id) {
+	auto result = std::make_shared<std::promise<int>>();
+	auto reported = std::make_shared<bool>(false);
+	id = loop.open("127.0.0.1", port, options, [result, reported](int error) {
+		if (!*reported) {
+			*reported = true;
+			result->set_value(error);
+		}
+	});
+	return result->get_future().get();
+}
+
+void submit(EventLoop& loop,
+			EventLoop::ConnectionId id,
+			mbap::Transaction* txs,
+			size_t count) {
+	std::promise<void> done;
+	loop.submit(id, 1, txs, count, [&done] { done.set_value(); });
+	done.get_future().wait();
+}
+}  // namespace
+
+TEST(event_loop, completes_batches) {
+	AddressServer server;
+	EventLoop loop;
+	EventLoop::ConnectionOptions options;
+	options.window = 2;
+	EventLoop::ConnectionId id;
+	ASSERT_EQ(open(loop, server.getPort(), options, id), 0);
+	EXPECT_EQ(loop.getConnectionCount(), 1u);
+
+	uint16_t regs[8] = {};
+	mbap::Transaction txs[4] = {read_tx(10, 2, regs), read_tx(20, 2, regs + 2),
+								read_tx(30, 2, regs + 4),
+								read_tx(40, 2, regs + 6)};
+	submit(loop, id, txs, 4);
+	for (const auto& tx : txs) {
+		EXPECT_EQ(tx.error, 0);
+		EXPECT_FALSE(tx.pending);
+	}
+	EXPECT_EQ(regs[0], 10);
+	EXPECT_EQ(regs[3], 21);
+	EXPECT_EQ(regs[7], 41);
+
+	loop.close(id);
+	EXPECT_EQ(loop.getConnectionCount(), 0u);
+}
+
+TEST(event_loop, times_out_requests) {
+	AddressServer server(true);
+	EventLoop loop;
+	EventLoop::ConnectionOptions options;
+	options.timeoutMs = 20;
+	EventLoop::ConnectionId id;
+	ASSERT_EQ(open(loop, server.getPort(), options, id), 0);
+
+	uint16_t regs[2];
+	mbap::Transaction tx = read_tx(0, 2, regs);
+	const auto start = std::chrono::steady_clock::now();
+	submit(loop, id, &tx, 1);
+	EXPECT_EQ(tx.error, ETIMEDOUT);
+	EXPECT_GE(std::chrono::steady_clock::now() - start,
+			  std::chrono::milliseconds(20));
+
+	loop.close(id);
+}
+
+TEST(event_loop, fails_requests_while_down) {
+	EventLoop loop;
+	EventLoop::ConnectionOptions options;
+	options.reconnectMs = 60000;
+	EventLoop::ConnectionId id;
+	EXPECT_EQ(open(loop, closed_port(), options, id), ECONNREFUSED);
+
+	uint16_t regs[2];
+	mbap::Transaction tx = read_tx(0, 2, regs);
+	submit(loop, id, &tx, 1);
+	EXPECT_EQ(tx.error, ENOTCONN);
+
+	loop.close(id);
+}
+
+TEST(event_loop, runs_timers) {
+	EventLoop loop;
+	std::atomic<int> calls{0};
+	const auto id =
+		loop.addTimer(std::chrono::milliseconds(5), [&] { ++calls; });
+	for (int i = 0; i < 1000 && calls < 3; ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	EXPECT_GE(calls, 3);
+
+	loop.removeTimer(id);
+	const int removed = calls;
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_EQ(calls, removed);
+}
+
+TEST(event_loop, destroyed_by_its_callback) {
+	auto loop = std::make_shared<EventLoop>();
+	auto owner = std::make_shared<std::shared_ptr<EventLoop>>(loop);
+	auto released = std::make_shared<std::promise<void>>();
+	auto destroyed = std::make_shared<std::promise<void>>();
+	auto releasedFuture = released->get_future().share();
+	loop->addTimer(std::chrono::milliseconds(1),
+				   [owner, releasedFuture, destroyed] {
+					   releasedFuture.wait();
+					   owner->reset();
+					   destroyed->set_value();
+				   });
+
+	// The timer now holds the last reference
+	loop.reset();
+	released->set_value();
+	EXPECT_EQ(destroyed->get_future().wait_for(std::chrono::seconds(5)),
+			  std::future_status::ready);
+}
+
+TEST(event_loop, async_device) {
+	AddressServer server;
+	auto loop = std::make_shared<EventLoop>();
+	auto device = std::make_shared<ModbusDeviceTcpAsync>(
+		"127.0.0.1", server.getPort(), 4, loop);
+	device->connect();
+	EXPECT_TRUE(device->isConnected());
+
+	uint16_t regs[3] = {};
+	EXPECT_EQ(device->readRegisters(100, 3, regs), 3u);
+	EXPECT_EQ(regs[0], 100);
+	EXPECT_EQ(regs[2], 102);
+
+	// Polled from a timer of the loop
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 7, "format": "u16", "type": "hold"}
+		}
+	})");
+
+	Poller poller(device);
+	poller.addPlan(std::make_shared<ReadPlan>(mapping),
+				   std::chrono::milliseconds(5));
+	poller.start();
+	uint16_t polled = 0;
+	for (int i = 0; i < 1000 && poller.getSnapshot(0).read(&polled) == 0;
+		 ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	poller.stop();
+	EXPECT_EQ(polled, 7);
+	EXPECT_EQ(poller.getErrorCount(), 0u);
+
+	device->close();
+	EXPECT_EQ(loop->getConnectionCount(), 0u);
+}
+
+TEST(event_loop, async_polls_adapt_to_the_slave) {
+	AddressServer server(false, 8, 60);
+	auto loop = std::make_shared<EventLoop>();
+	auto device = std::make_shared<ModbusDeviceTcpAsync>(
+		"127.0.0.1", server.getPort(), 4, loop);
+	device->connect();
+
+	// A gap bridged at 8, and a block longer than the slave accepts
+	std::string json = R"({"values": {
+		"A": {"addr": 7, "format": "u16", "type": "hold"},
+		"B": {"addr": 9, "format": "u16", "type": "hold"})";
+	for (int i = 0; i < 160; ++i) {
+		json += ",\"L" + std::to_string(i) + "\": {\"addr\": " +
+				std::to_string(1000 + i) +
+				R"(, "format": "u16", "type": "hold"})";
+	}
+	json += "}}";
+	auto mapping = load_mapping(json.c_str());
+	auto plan = std::make_shared<ReadPlan>(
+		mapping, device->getTransportCost().maxGap(),
+		device->getCapabilities());
+	ASSERT_EQ(plan->getBlocks()[0].length, 3u);
+	ASSERT_EQ(plan->getBlocks()[0].partCount, 2u);
+
+	Poller poller(device);
+	poller.addPlan(plan, std::chrono::milliseconds(5));
+	poller.start();
+	std::vector<uint16_t> regs(plan->getRegisterCount());
+	for (int i = 0; i < 1000 && poller.getSnapshot(0).read(regs.data()) == 0;
+		 ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	poller.stop();
+
+	// Every poll succeeded, the first one once sent again
+	EXPECT_EQ(poller.getErrorCount(), 0u);
+	EXPECT_EQ(regs[plan->getEntries()[0].offset], 7);
+	EXPECT_EQ(regs[plan->getEntries()[1].offset], 9);
+	EXPECT_EQ(regs.back(), 1159);
+	EXPECT_FALSE(plan->split(0));
+	EXPECT_EQ(device->getCapabilities().maxReadRegisters, 31);
+
+	device->close();
+}
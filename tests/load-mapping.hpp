@@ -0,0 +1,29 @@
+#pragma once
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include "../src/mapping.hpp"
+
+/**
+ * Loads a mapping from JSON through a temporary file, named after the running
+ * test so tests run in parallel never share it.
+ * @param json The content of the mapping file.
+ * @return The mapping.
+ */
+inline std::shared_ptr<Mapping> load_mapping(const char* json) {
+	const auto* test = ::testing::UnitTest::GetInstance()->current_test_info();
+	const std::string path = ::testing::TempDir() + test->test_suite_name() +
+							 "." + test->name() + ".json";
+	std::ofstream(path) << json;
+	try {
+		auto mapping = std::make_shared<Mapping>(path.c_str());
+		std::remove(path.c_str());
+		return mapping;
+	} catch (...) {
+		std::remove(path.c_str());
+		throw;
+	}
+}
@@ -0,0 +1,153 @@
+#include "../src/mapping.hpp"
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include "load-mapping.hpp"
+
+TEST(mapping, enums) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"STATE": {"addr": 0, "format": "u16", "type": "hold", "enum": "state"},
+			"CODE": {"addr": 1, "format": "u32", "type": "hold", "enum": "code"}
+		},
+		"enums": {
+			"state": {"off": 0, "on": 1, "fault": 3},
+			"code": {"ok": 0, "off": 100000, "error": -5}
+		}
+	})");
+
+	// A small range is indexed directly
+	const auto& state = *mapping->getValueDef("STATE").enumDef;
+	EXPECT_FALSE(state.direct.empty());
+	EXPECT_EQ(mapping->getString(state.find(1)), "on");
+	EXPECT_EQ(mapping->getString(state.find(3)), "fault");
+	EXPECT_EQ(state.find(2), -1);
+	EXPECT_EQ(state.find(-1), -1);
+	EXPECT_EQ(state.find(4), -1);
+
+	// A sparse one is searched
+	const auto& code = *mapping->getValueDef("CODE").enumDef;
+	EXPECT_TRUE(code.direct.empty());
+	EXPECT_EQ(mapping->getString(code.find(-5)), "error");
+	EXPECT_EQ(mapping->getString(code.find(100000)), "off");
+	EXPECT_EQ(code.find(1), -1);
+
+	// Labels are shared between enums
+	EXPECT_EQ(code.find(100000), state.find(0));
+}
+
+TEST(mapping, enum_labels) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"MODE": {"addr": 0, "format": "i32", "type": "hold", "enum": "mode"}
+		},
+		"enums": {
+			"mode": {"auto": 0, "manual": 1, "service": -2, "boost": 1000000,
+					 "standby": 0}
+		}
+	})");
+
+	const auto& mode = *mapping->getValueDef("MODE").enumDef;
+	int64_t value = 0;
+	EXPECT_TRUE(mode.findValue("manual", value));
+	EXPECT_EQ(value, 1);
+	EXPECT_TRUE(mode.findValue("service", value));
+	EXPECT_EQ(value, -2);
+	EXPECT_TRUE(mode.findValue("boost", value));
+	EXPECT_EQ(value, 1000000);
+	// Every label of a shared value is written
+	EXPECT_TRUE(mode.findValue("auto", value));
+	EXPECT_EQ(value, 0);
+	EXPECT_TRUE(mode.findValue("standby", value));
+	EXPECT_EQ(value, 0);
+	EXPECT_FALSE(mode.findValue("off", value));
+	EXPECT_FALSE(mode.findValue("", value));
+}
+
+TEST(mapping, bitfields_in_bit_order) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"ALARMS": {"addr": 0, "format": "bitfield", "len": 2, "type": "hold", "bitfield": "alarms"}
+		},
+		"bitfields": {
+			"alarms": {"overheat": 17, "door": 0, "fan": 3}
+		}
+	})");
+
+	const auto& alarms = *mapping->getValueDef("ALARMS").bitfieldDef;
+	ASSERT_EQ(alarms.size(), 3u);
+	EXPECT_EQ(alarms[0].bit, 0);
+	EXPECT_EQ(mapping->getString(alarms[0].string), "door");
+	EXPECT_EQ(alarms[1].bit, 3);
+	EXPECT_EQ(alarms[2].bit, 17);
+	EXPECT_EQ(mapping->getString(alarms[2].string), "overheat");
+}
+
+TEST(mapping, max_age) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 0, "format": "u16", "type": "hold", "max_age_ms": 500},
+			"B": {"addr": 1, "format": "u16", "type": "hold"}
+		}
+	})");
+	EXPECT_EQ(mapping->getValueDef("A").maxAgeMs, 500u);
+	EXPECT_EQ(mapping->getValueDef("B").maxAgeMs, 0u);
+
+	for (const char* maxAge : {"-1", "1.5", "\"10\"", "4294967296"}) {
+		const std::string json =
+			R"({"values": {"A": {"addr": 0, "format": "u16", "type": "hold",
+			"max_age_ms": )" +
+			std::string(maxAge) + "}}}";
+		EXPECT_THROW(load_mapping(json.c_str()), std::runtime_error) << maxAge;
+	}
+}
+
+TEST(mapping, rejects_missing_links) {
+	EXPECT_THROW(load_mapping(R"({
+		"values": {
+			"STATE": {"addr": 0, "format": "u16", "type": "hold", "enum": "state"}
+		}
+	})"),
+				 std::runtime_error);
+}
+
+TEST(mapping, orders_64) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"ENERGY": {"addr": 0, "format": "u64", "type": "input", "order": "ghefcdab"},
+			"OFFSET": {"addr": 4, "format": "i64", "type": "hold"}
+		}
+	})");
+
+	EXPECT_EQ(mapping->getValueDef("ENERGY").order,
+			  Mapping::ValueDefOrder::ghefcdab);
+	EXPECT_EQ(mapping->getValueDef("ENERGY").length, 4);
+	EXPECT_EQ(mapping->getValueDef("OFFSET").order,
+			  Mapping::ValueDefOrder::abcdefgh);
+
+	EXPECT_THROW(load_mapping(R"({
+		"values": {
+			"ENERGY": {"addr": 0, "format": "u64", "type": "input", "order": "cdab"}
+		}
+	})"),
+				 std::runtime_error);
+}
+
+TEST(mapping, trim) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"SERIAL": {"addr": 0, "format": "str", "len": 16, "type": "input"},
+			"NAME": {"addr": 16, "format": "str", "len": 16, "type": "hold", "trim": false}
+		}
+	})");
+
+	EXPECT_TRUE(mapping->getValueDef("SERIAL").trim);
+	EXPECT_FALSE(mapping->getValueDef("NAME").trim);
+
+	EXPECT_THROW(load_mapping(R"({
+		"values": {
+			"COUNT": {"addr": 0, "format": "u16", "type": "hold", "trim": true}
+		}
+	})"),
+				 std::runtime_error);
+}
@@ -0,0 +1,66 @@
+#include "../src/mbap.hpp"
+#include <gtest/gtest.h>
+#include <modbus/modbus.h>
+#include <cstdint>
+
+TEST(mbap, encodes_requests) {
+	mbap::Transaction tx;
+	tx.function = mbap::READ_HOLDING_REGISTERS;
+	tx.addr = 0x0102;
+	tx.nb = 3;
+	tx.id = 0xABCD;
+
+	uint8_t frame[mbap::MAX_FRAME_SIZE];
+	ASSERT_EQ(mbap::encode(tx, 17, frame), 12u);
+	const uint8_t expected[12] = {0xAB, 0xCD, 0, 0, 0, 6,
+								  17,	3,	  1, 2, 0, 3};
+	for (size_t i = 0; i < 12; ++i) {
+		EXPECT_EQ(frame[i], expected[i]) << i;
+	}
+
+	// Too many registers for a single request
+	tx.nb = 126;
+	EXPECT_EQ(mbap::encode(tx, 17, frame), 0u);
+
+	const uint8_t bits[10] = {1, 0, 1, 0, 0, 0, 0, 0, 1, 1};
+	tx = mbap::Transaction();
+	tx.function = mbap::WRITE_MULTIPLE_COILS;
+	tx.writeAddr = 4;
+	tx.writeNb = 10;
+	tx.srcBits = bits;
+	ASSERT_EQ(mbap::encode(tx, 1, frame), 15u);
+	EXPECT_EQ(frame[12], 2);
+	EXPECT_EQ(frame[13], 0x05);
+	EXPECT_EQ(frame[14], 0x03);
+}
+
+TEST(mbap, decodes_responses) {
+	uint16_t regs[2] = {};
+	mbap::Transaction tx;
+	tx.function = mbap::READ_INPUT_REGISTERS;
+	tx.nb = 2;
+	tx.dest = regs;
+
+	const uint8_t response[] = {0, 7, 0, 0, 0, 7, 1, 4, 4, 0x12, 0x34, 0, 1};
+	uint16_t id;
+	size_t size;
+	ASSERT_TRUE(mbap::parse_header(response, id, size));
+	EXPECT_EQ(id, 7);
+	EXPECT_EQ(size, sizeof(response));
+	mbap::decode(tx, response, size);
+	EXPECT_EQ(tx.error, 0);
+	EXPECT_EQ(regs[0], 0x1234);
+	EXPECT_EQ(regs[1], 1);
+
+	const uint8_t exception[] = {0, 7, 0, 0, 0, 3, 1, 0x84, 3};
+	mbap::decode(tx, exception, sizeof(exception));
+	EXPECT_EQ(tx.error, EMBXILVAL);
+
+	// A response to another function
+	const uint8_t other[] = {0, 7, 0, 0, 0, 3, 1, 0x03, 0};
+	mbap::decode(tx, other, sizeof(other));
+	EXPECT_NE(tx.error, 0);
+
+	const uint8_t notModbus[] = {0, 7, 0, 1, 0, 3, 1};
+	EXPECT_FALSE(mbap::parse_header(notModbus, id, size));
+}
@@ -0,0 +1,584 @@
+#include "../src/modbus-device-ctx.hpp"
+#include <gtest/gtest.h>
+#include <modbus/modbus.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <new>
+#include <ostream>
+#include "load-mapping.hpp"
+
+namespace {
+std::atomic<size_t> allocations{0};
+}  // namespace
+
+// Count every allocation made by the test binary
+void* operator new(std::size_t size) {
+	++allocations;
+	if (void* ptr = std::malloc(size ? size : 1)) {
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+namespace {
+// Answers every read with the address of each register
+class FakeDevice : public ModbusDeviceTcp {
+   public:
+	FakeDevice() : ModbusDeviceTcp("127.0.0.1", 502) {}
+
+	unsigned int readBits(int, int nb, uint8_t* dest) override {
+		std::fill(dest, dest + nb, 1);
+		return nb;
+	}
+
+	unsigned int readInputBits(int, int nb, uint8_t* dest) override {
+		std::fill(dest, dest + nb, 1);
+		return nb;
+	}
+
+	unsigned int readRegisters(int addr, int nb, uint16_t* dest) override {
+		lastSlave = m_slave;
+		for (int i = 0; i < nb; ++i) {
+			dest[i] = static_cast<uint16_t>(addr + i);
+		}
+		return nb;
+	}
+
+	unsigned int readInputRegisters(int addr,
+									int nb,
+									uint16_t* dest) override {
+		return readRegisters(addr, nb, dest);
+	}
+
+	int lastSlave = -1;
+};
+
+// Records the function code, address and size of every request, and answers
+// reads of holding registers with what was written
+class RecordingDevice : public FakeDevice {
+   public:
+	struct Request {
+		int fc;
+		int addr;
+		int nb;
+
+		bool operator==(const Request& other) const {
+			return fc == other.fc && addr == other.addr && nb == other.nb;
+		}
+
+		friend std::ostream& operator<<(std::ostream& os, const Request& req) {
+			return os << "FC" << req.fc << " " << req.addr << "+" << req.nb;
+		}
+	};
+
+	unsigned int readRegisters(int addr, int nb, uint16_t* dest) override {
+		requests.push_back({MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb});
+		return load(addr, nb, dest);
+	}
+
+	unsigned int readBits(int addr, int nb, uint8_t* dest) override {
+		requests.push_back({MODBUS_FC_READ_COILS, addr, nb});
+		return FakeDevice::readBits(addr, nb, dest);
+	}
+
+	unsigned int readInputRegisters(int addr,
+									int nb,
+									uint16_t* dest) override {
+		requests.push_back({MODBUS_FC_READ_INPUT_REGISTERS, addr, nb});
+		return FakeDevice::readRegisters(addr, nb, dest);
+	}
+
+	unsigned int writeBit(int addr, uint8_t) override {
+		requests.push_back({MODBUS_FC_WRITE_SINGLE_COIL, addr, 1});
+		return 1;
+	}
+
+	unsigned int writeBits(int addr, int nb, const uint8_t*) override {
+		requests.push_back({MODBUS_FC_WRITE_MULTIPLE_COILS, addr, nb});
+		return nb;
+	}
+
+	unsigned int writeRegister(int addr, uint16_t value) override {
+		requests.push_back({MODBUS_FC_WRITE_SINGLE_REGISTER, addr, 1});
+		return store(addr, 1, &value);
+	}
+
+	unsigned int writeRegisters(int addr,
+								int nb,
+								const uint16_t* src) override {
+		requests.push_back({MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, nb});
+		return store(addr, nb, src);
+	}
+
+	std::vector<Request> requests;
+	std::map<int, uint16_t> registers;
+	int refused = -1;  // Refused by writes with an illegal data value
+	bool writeAndRead = true;
+
+   protected:
+	int requestWriteAndRead(int writeAddr,
+							int writeNb,
+							const uint16_t* src,
+							int readAddr,
+							int readNb,
+							uint16_t* dest) override {
+		requests.push_back(
+			{MODBUS_FC_WRITE_AND_READ_REGISTERS, readAddr, readNb});
+		if (!writeAndRead) {
+			errno = EMBXILFUN;
+			return -1;
+		}
+		store(writeAddr, writeNb, src);
+		return static_cast<int>(load(readAddr, readNb, dest));
+	}
+
+   private:
+	unsigned int load(int addr, int nb, uint16_t* dest) {
+		FakeDevice::readRegisters(addr, nb, dest);
+		for (int i = 0; i < nb; ++i) {
+			auto it = registers.find(addr + i);
+			if (it != registers.end()) {
+				dest[i] = it->second;
+			}
+		}
+		return static_cast<unsigned int>(nb);
+	}
+
+	unsigned int store(int addr, int nb, const uint16_t* src) {
+		if (refused >= addr && refused < addr + nb) {
+			throw ModbusException(EMBXILVAL);
+		}
+		for (int i = 0; i < nb; ++i) {
+			registers[addr + i] = src[i];
+		}
+		return static_cast<unsigned int>(nb);
+	}
+};
+
+// Runs write_many with a table of name to number
+void write_many(ModbusDeviceContext& ctx,
+				std::initializer_list<std::pair<const char*, double>> values) {
+	lua_State* L = luaL_newstate();
+	lua_newtable(L);
+	for (const auto& [name, value] : values) {
+		lua_pushnumber(L, value);
+		lua_setfield(L, 1, name);
+	}
+	try {
+		ctx.luaWriteMany(L, 1);
+	} catch (...) {
+		lua_close(L);
+		throw;
+	}
+	lua_close(L);
+}
+
+// Runs exchange, returning the values read by name
+std::map<std::string, double> exchange(
+	ModbusDeviceContext& ctx,
+	std::initializer_list<std::pair<const char*, double>> writes,
+	std::initializer_list<const char*> reads) {
+	lua_State* L = luaL_newstate();
+	lua_newtable(L);
+	for (const auto& [name, value] : writes) {
+		lua_pushnumber(L, value);
+		lua_setfield(L, 1, name);
+	}
+	lua_newtable(L);
+	int index = 0;
+	for (const char* name : reads) {
+		lua_pushstring(L, name);
+		lua_rawseti(L, 2, ++index);
+	}
+
+	std::map<std::string, double> values;
+	try {
+		ctx.luaExchange(L, 1, 2);
+		for (const char* name : reads) {
+			lua_getfield(L, -1, name);
+			values[name] = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+	} catch (...) {
+		lua_close(L);
+		throw;
+	}
+	lua_close(L);
+	return values;
+}
+
+using Request = RecordingDevice::Request;
+}  // namespace
+
+TEST(modbus_device_ctx, reads_without_allocating) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"BATTERY_VOLTAGE_PHASE_1": {"addr": 10, "format": "u16", "type": "hold"},
+			"POWER": {"addr": 20, "format": "f32", "type": "input"},
+			"SERIAL_NUMBER": {"addr": 30, "format": "str", "len": 20, "type": "hold"},
+			"ENERGY_TOTAL": {"addr": 60, "format": "u32", "type": "input", "max_age_ms": 60000},
+			"RUNNING": {"addr": 0, "format": "bit", "type": "hold"}
+		}
+	})");
+	ModbusDeviceContext ctx(std::make_shared<FakeDevice>(),
+							std::shared_ptr<Mapping>(mapping));
+
+	const char* names[] = {"BATTERY_VOLTAGE_PHASE_1", "POWER", "SERIAL_NUMBER",
+						   "ENERGY_TOTAL", "RUNNING"};
+
+	// The first reads may size the lookup key and fill the cache
+	for (const char* name : names) {
+		ctx.readValue(mapping->getValueDef(name));
+	}
+
+	const size_t before = allocations;
+	for (int i = 0; i < 100; ++i) {
+		for (const char* name : names) {
+			ctx.readValue(mapping->getValueDef(name));
+		}
+	}
+	EXPECT_EQ(allocations - before, 0u);
+
+	EXPECT_EQ(ctx.readValue(mapping->getValueDef("SERIAL_NUMBER"))[19], 49);
+	EXPECT_EQ(ctx.readValue(mapping->getValueDef("RUNNING"))[0], 1);
+}
+
+TEST(modbus_device_ctx, resolves_handles) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 10, "format": "u16", "type": "hold"},
+			"B": {"addr": 20, "format": "u16", "type": "hold"}
+		}
+	})");
+	ModbusDeviceContext ctx(std::make_shared<FakeDevice>(),
+							std::shared_ptr<Mapping>(mapping));
+
+	const auto handle = ctx.getHandle("B");
+	EXPECT_EQ(mapping->getName(handle), "B");
+	EXPECT_EQ(&mapping->getValueDefAt(handle), &mapping->getValueDef("B"));
+	EXPECT_EQ(ctx.readValue(mapping->getValueDefAt(handle))[0], 20);
+
+	EXPECT_THROW(ctx.getHandle("C"), std::runtime_error);
+	EXPECT_THROW(mapping->getValueDefAt(mapping->getValueCount()),
+				 std::runtime_error);
+}
+
+TEST(modbus_device_ctx, selects_its_slave) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 10, "format": "u16", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<FakeDevice>();
+	ModbusDeviceContext first(device, std::shared_ptr<Mapping>(mapping), 1);
+	ModbusDeviceContext second(device, std::shared_ptr<Mapping>(mapping), 2);
+
+	// Each context addresses its own slave whoever used the device last
+	first.readValue(mapping->getValueDef("A"));
+	EXPECT_EQ(device->lastSlave, 1);
+	second.readValue(mapping->getValueDef("A"));
+	EXPECT_EQ(device->lastSlave, 2);
+	first.readValue(mapping->getValueDef("A"));
+	EXPECT_EQ(device->lastSlave, 1);
+}
+
+TEST(modbus_device_ctx, refused_writes_are_not_split) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 0, "format": "u16", "type": "hold"},
+			"B": {"addr": 1, "format": "u32", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<RecordingDevice>();
+	device->refused = 2;
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	// An illegal data value refuses a value, not the size of the request
+	EXPECT_THROW(write_many(ctx, {{"A", 1}, {"B", 2}}), ModbusException);
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 3}}));
+	EXPECT_EQ(device->getCapabilities().maxWriteRegisters,
+			  ModbusDevice::MAX_WRITE_REGISTERS);
+}
+
+TEST(modbus_device_ctx, oversized_values_are_written_whole) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 0, "format": "u16", "type": "hold"},
+			"B": {"addr": 1, "format": "u32", "type": "hold"},
+			"C": {"addr": 3, "format": "u64", "type": "hold"},
+			"D": {"addr": 7, "format": "u16", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<RecordingDevice>();
+	device->getCapabilities().maxWriteRegisters = 2;
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	// C is longer than the slave accepts, but a torn value is never written
+	write_many(ctx, {{"A", 1}, {"B", 2}, {"C", 3}, {"D", 4}});
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 1},
+				   {MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 1, 2},
+				   {MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 3, 4},
+				   {MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 7, 1}}));
+	EXPECT_EQ(device->registers[6], 3);
+}
+
+TEST(modbus_device_ctx, batches_contiguous_writes) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 0, "format": "u16", "type": "hold"},
+			"B": {"addr": 1, "format": "u32", "type": "hold"},
+			"C": {"addr": 3, "format": "u16", "type": "hold"},
+			"D": {"addr": 10, "format": "u16", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<RecordingDevice>();
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	write_many(ctx, {{"D", 4}, {"C", 3}, {"A", 1}, {"B", 2}});
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 4},
+				   {MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 10, 1}}));
+	EXPECT_EQ(device->registers[0], 1);
+	EXPECT_EQ(device->registers[3], 3);
+	EXPECT_EQ(device->registers[10], 4);
+}
+
+TEST(modbus_device_ctx, batches_bits_apart) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 0, "format": "u16", "type": "hold"},
+			"B": {"addr": 1, "format": "u16", "type": "hold"},
+			"RUN": {"addr": 0, "format": "bit", "type": "hold"},
+			"FAN": {"addr": 1, "format": "bit", "type": "hold"},
+			"PUMP": {"addr": 5, "format": "bit", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<RecordingDevice>();
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	// Coils and registers at the same addresses neither overlap nor merge
+	write_many(ctx,
+			   {{"RUN", 1}, {"A", 1}, {"PUMP", 0}, {"B", 2}, {"FAN", 1}});
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 2},
+				   {MODBUS_FC_WRITE_MULTIPLE_COILS, 0, 2},
+				   {MODBUS_FC_WRITE_MULTIPLE_COILS, 5, 1}}));
+}
+
+TEST(modbus_device_ctx, rejects_overlapping_writes) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"WIDE": {"addr": 0, "format": "u64", "type": "hold"},
+			"A": {"addr": 1, "format": "u16", "type": "hold"},
+			"B": {"addr": 3, "format": "u16", "type": "hold"},
+			"C": {"addr": 4, "format": "u16", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<RecordingDevice>();
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	EXPECT_THROW(write_many(ctx, {{"WIDE", 1}, {"A", 2}, {"C", 3}}),
+				 std::runtime_error);
+
+	// Even where the values would go out in separate requests
+	device->getCapabilities().maxWriteRegisters = 1;
+	EXPECT_THROW(write_many(ctx, {{"C", 3}, {"WIDE", 1}, {"B", 2}}),
+				 std::runtime_error);
+	EXPECT_TRUE(device->requests.empty());
+
+	write_many(ctx, {{"A", 2}, {"B", 3}, {"C", 4}});
+	EXPECT_EQ(device->requests.size(), 3u);
+}
+
+namespace {
+const char* EXCHANGE_JSON = R"({
+	"values": {
+		"A": {"addr": 0, "format": "u16", "type": "hold"},
+		"B": {"addr": 1, "format": "u16", "type": "hold"},
+		"C": {"addr": 10, "format": "u16", "type": "hold"},
+		"D": {"addr": 11, "format": "u16", "type": "hold"},
+		"E": {"addr": 13, "format": "u16", "type": "hold"},
+		"F": {"addr": 100, "format": "u16", "type": "hold"}
+	}
+})";
+}  // namespace
+
+TEST(modbus_device_ctx, exchanges_with_fc23) {
+	auto mapping = load_mapping(EXCHANGE_JSON);
+	auto device = std::make_shared<RecordingDevice>();
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	// The write happens before the read, in the same transaction
+	auto values = exchange(ctx, {{"A", 1}, {"B", 2}}, {"C", "D"});
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_AND_READ_REGISTERS, 10, 2}}));
+	EXPECT_EQ(values.at("C"), 10);
+	EXPECT_EQ(device->registers[1], 2);
+
+	values = exchange(ctx, {{"D", 4}}, {"C", "D"});
+	EXPECT_EQ(device->requests.size(), 2u);
+	EXPECT_EQ(values.at("D"), 4);
+}
+
+TEST(modbus_device_ctx, exchanges_within_learned_limits) {
+	auto mapping = load_mapping(EXCHANGE_JSON);
+	auto device = std::make_shared<RecordingDevice>();
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	device->getCapabilities().maxWriteRegisters = 1;
+	exchange(ctx, {{"A", 1}, {"B", 2}}, {"C", "D"});
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 1},
+				   {MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 1, 1},
+				   {MODBUS_FC_READ_HOLDING_REGISTERS, 10, 2}}));
+
+	device->requests.clear();
+	device->getCapabilities().maxWriteRegisters =
+		ModbusDevice::MAX_WRITE_REGISTERS;
+	device->getCapabilities().maxReadRegisters = 1;
+	exchange(ctx, {{"A", 1}, {"B", 2}}, {"C", "D"});
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 2},
+				   {MODBUS_FC_READ_HOLDING_REGISTERS, 10, 1},
+				   {MODBUS_FC_READ_HOLDING_REGISTERS, 11, 1}}));
+}
+
+TEST(modbus_device_ctx, exchanges_bridged_and_several_blocks_apart) {
+	auto mapping = load_mapping(EXCHANGE_JSON);
+	auto device = std::make_shared<RecordingDevice>();
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	// A block bridging a gap is left to the plan, which recovers if refused
+	exchange(ctx, {{"A", 1}}, {"C", "E"});
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 1},
+				   {MODBUS_FC_READ_HOLDING_REGISTERS, 10, 4}}));
+
+	device->requests.clear();
+	exchange(ctx, {{"A", 1}}, {"C", "F"});
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0, 1},
+				   {MODBUS_FC_READ_HOLDING_REGISTERS, 10, 1},
+				   {MODBUS_FC_READ_HOLDING_REGISTERS, 100, 1}}));
+}
+
+TEST(modbus_device_ctx, exchanges_without_fc23) {
+	auto mapping = load_mapping(EXCHANGE_JSON);
+	auto device = std::make_shared<RecordingDevice>();
+	device->writeAndRead = false;
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	// Refused once, then never asked again
+	exchange(ctx, {{"C", 3}}, {"C", "D"});
+	exchange(ctx, {{"C", 4}}, {"C", "D"});
+	EXPECT_FALSE(device->getCapabilities().writeAndRead);
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>(
+				  {{MODBUS_FC_WRITE_AND_READ_REGISTERS, 10, 2},
+				   {MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 10, 1},
+				   {MODBUS_FC_READ_HOLDING_REGISTERS, 10, 2},
+				   {MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 10, 1},
+				   {MODBUS_FC_READ_HOLDING_REGISTERS, 10, 2}}));
+	EXPECT_EQ(device->registers[10], 4);
+}
+
+TEST(modbus_device_ctx, serves_young_values_from_cache) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"SLOW": {"addr": 0, "format": "u16", "type": "hold", "max_age_ms": 60000},
+			"FAST": {"addr": 1, "format": "u16", "type": "hold", "max_age_ms": 1},
+			"LIVE": {"addr": 2, "format": "u16", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<RecordingDevice>();
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+
+	for (int i = 0; i < 2; ++i) {
+		for (const char* name : {"SLOW", "FAST", "LIVE"}) {
+			ctx.readValue(mapping->getValueDef(name));
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	EXPECT_EQ(device->requests,
+			  std::vector<Request>({{MODBUS_FC_READ_HOLDING_REGISTERS, 0, 1},
+									{MODBUS_FC_READ_HOLDING_REGISTERS, 1, 1},
+									{MODBUS_FC_READ_HOLDING_REGISTERS, 2, 1},
+									{MODBUS_FC_READ_HOLDING_REGISTERS, 1, 1},
+									{MODBUS_FC_READ_HOLDING_REGISTERS, 2, 1}}));
+
+	device->requests.clear();
+	ctx.clearCache();
+	ctx.readValue(mapping->getValueDef("SLOW"));
+	EXPECT_EQ(device->requests.size(), 1u);
+}
+
+TEST(modbus_device_ctx, writes_drop_overlapping_cached_values) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"WIDE": {"addr": 0, "format": "u32", "type": "hold", "max_age_ms": 60000},
+			"LOW": {"addr": 1, "format": "u16", "type": "hold", "max_age_ms": 60000},
+			"NEXT": {"addr": 2, "format": "u16", "type": "hold", "max_age_ms": 60000},
+			"RUN": {"addr": 0, "format": "bit", "type": "hold", "max_age_ms": 60000},
+			"HIGH": {"addr": 0, "format": "u16", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<RecordingDevice>();
+	ModbusDeviceContext ctx(device, std::shared_ptr<Mapping>(mapping));
+	const char* cached[] = {"WIDE", "LOW", "NEXT", "RUN"};
+	const auto refill = [&] {
+		device->requests.clear();
+		for (const char* name : cached) {
+			ctx.readValue(mapping->getValueDef(name));
+		}
+		return device->requests;
+	};
+	refill();
+
+	// A value that isn't cached itself still drops those sharing registers
+	write_many(ctx, {{"HIGH", 7}});
+	EXPECT_EQ(refill(), std::vector<Request>(
+							{{MODBUS_FC_READ_HOLDING_REGISTERS, 0, 2}}));
+	EXPECT_EQ(ctx.readValue(mapping->getValueDef("WIDE"))[0], 7);
+
+	write_many(ctx, {{"LOW", 5}});
+	EXPECT_EQ(refill(), std::vector<Request>(
+							{{MODBUS_FC_READ_HOLDING_REGISTERS, 0, 2},
+							 {MODBUS_FC_READ_HOLDING_REGISTERS, 1, 1}}));
+
+	// Coils are another address space
+	write_many(ctx, {{"RUN", 1}});
+	EXPECT_EQ(refill(),
+			  std::vector<Request>({{MODBUS_FC_READ_COILS, 0, 1}}));
+
+	// Single writes drop them the same way
+	lua_State* L = luaL_newstate();
+	lua_pushnumber(L, 9);
+	ctx.luaWrite(L, "HIGH");
+	lua_close(L);
+	EXPECT_EQ(refill(), std::vector<Request>(
+							{{MODBUS_FC_READ_HOLDING_REGISTERS, 0, 2}}));
+}
@@ -0,0 +1,245 @@
+#include "../src/modbus-device.hpp"
+#include <gtest/gtest.h>
+#include <modbus/modbus.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../src/modbus-device-tcp-pipelined.hpp"
+
+namespace {
+// Serves holding registers holding their own address, answering each batch
+// of requests in reverse order once all of it has arrived
+class ReversingServer {
+   public:
+	explicit ReversingServer(size_t batch) : m_batch(batch) {
+		m_listener = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		bind(m_listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+		listen(m_listener, 1);
+		socklen_t size = sizeof(addr);
+		getsockname(m_listener, reinterpret_cast<sockaddr*>(&addr), &size);
+		m_port = ntohs(addr.sin_port);
+		m_thread = std::thread(&ReversingServer::serve, this);
+	}
+
+	~ReversingServer() {
+		m_thread.join();
+		close(m_listener);
+	}
+
+	int getPort() const { return m_port; }
+
+   private:
+	void serve() {
+		const int client = accept(m_listener, nullptr, nullptr);
+		std::vector<std::vector<uint8_t>> requests;
+		uint8_t request[12];
+		while (recv(client, request, sizeof(request), MSG_WAITALL) ==
+			   sizeof(request)) {
+			requests.emplace_back(request, request + sizeof(request));
+			if (requests.size() < m_batch) {
+				continue;
+			}
+			for (auto it = requests.rbegin(); it != requests.rend(); ++it) {
+				const auto& req = *it;
+				const int addr = (req[8] << 8) | req[9];
+				const int nb = (req[10] << 8) | req[11];
+				std::vector<uint8_t> response = {
+					req[0], req[1], 0, 0, 0, static_cast<uint8_t>(3 + nb * 2),
+					req[6], 3,		static_cast<uint8_t>(nb * 2)};
+				for (int i = 0; i < nb; ++i) {
+					response.push_back(static_cast<uint8_t>((addr + i) >> 8));
+					response.push_back(static_cast<uint8_t>(addr + i));
+				}
+				send(client, response.data(), response.size(), 0);
+			}
+			requests.clear();
+		}
+		close(client);
+	}
+
+	size_t m_batch;
+	int m_listener;
+	int m_port;
+	std::thread m_thread;
+};
+
+// Rejects reads of more than a limit, and any touching a refused address,
+// with an illegal data value exception
+class LimitedDevice : public ModbusDeviceTcp {
+   public:
+	LimitedDevice() : ModbusDeviceTcp("127.0.0.1", 502) {}
+
+	unsigned int readRegisters(int addr, int nb, uint16_t*) override {
+		return check(addr, nb);
+	}
+
+	int limit = 60;
+	int refused = -1;
+
+   private:
+	unsigned int check(int addr, int nb) {
+		if (nb > limit || (refused >= addr && refused < addr + nb)) {
+			throw ModbusException(EMBXILVAL);
+		}
+		return static_cast<unsigned int>(nb);
+	}
+};
+
+// Holds a single register, counting the requests made for it
+class MaskingDevice : public ModbusDeviceTcp {
+   public:
+	explicit MaskingDevice(bool maskWrite)
+		: ModbusDeviceTcp("127.0.0.1", 502), m_maskWrite(maskWrite) {}
+
+	unsigned int readRegisters(int, int, uint16_t* dest) override {
+		++reads;
+		dest[0] = value;
+		return 1;
+	}
+
+	unsigned int writeRegister(int, uint16_t src) override {
+		++writes;
+		value = src;
+		return 1;
+	}
+
+	uint16_t value = 0x00F0;
+	int reads = 0;
+	int writes = 0;
+	int maskWrites = 0;
+
+   protected:
+	int requestMaskWrite(int, uint16_t andMask, uint16_t orMask) override {
+		++maskWrites;
+		if (!m_maskWrite) {
+			errno = EMBXILFUN;
+			return -1;
+		}
+		value = (value & andMask) | (orMask & ~andMask);
+		return 1;
+	}
+
+   private:
+	bool m_maskWrite;
+};
+}  // namespace
+
+TEST(modbus_device, learns_read_limit) {
+	LimitedDevice device;
+	std::vector<uint16_t> regs(200);
+	device.readRegisterRange(false, 0, 200, regs.data());
+	EXPECT_EQ(device.getCapabilities().maxReadRegisters, 31);
+
+	// A short tail chunk rejected for another reason leaves the limit alone
+	device.refused = 190;
+	EXPECT_THROW(device.readRegisterRange(false, 0, 200, regs.data()),
+				 ModbusException);
+	EXPECT_EQ(device.getCapabilities().maxReadRegisters, 31);
+}
+
+TEST(modbus_device, mask_writes) {
+	MaskingDevice device(true);
+	device.maskWriteRegister(0, 0xFFFE, 0x0001);
+	device.maskWriteRegister(0, 0xFF7F, 0x0000);
+	EXPECT_EQ(device.value, 0x0071);
+	EXPECT_EQ(device.maskWrites, 2);
+	EXPECT_EQ(device.reads + device.writes, 0);
+}
+
+TEST(modbus_device, mask_writes_without_fc22) {
+	MaskingDevice device(false);
+	device.maskWriteRegister(0, 0xFFFE, 0x0001);
+	EXPECT_FALSE(device.getCapabilities().maskWrite);
+	EXPECT_EQ(device.maskWrites, 1);
+	EXPECT_EQ(device.reads, 1);
+	EXPECT_EQ(device.writes, 1);
+
+	// The register is only read once, then written straight away
+	device.maskWriteRegister(0, 0xFF7F, 0x0000);
+	EXPECT_EQ(device.value, 0x0071);
+	EXPECT_EQ(device.maskWrites, 1);
+	EXPECT_EQ(device.reads, 1);
+	EXPECT_EQ(device.writes, 2);
+
+	// Until it may have changed behind our back
+	device.value = 0x0100;
+	device.forgetMaskedRegisters();
+	device.maskWriteRegister(0, 0xFFFE, 0x0001);
+	EXPECT_EQ(device.value, 0x0101);
+	EXPECT_EQ(device.reads, 2);
+}
+
+TEST(modbus_device, rejects_bad_profile_keys) {
+	const std::string path = ::testing::TempDir() + "bad-profile.json";
+	std::ofstream(path) << R"({"slave1": {"max_read_registers": 10}})";
+	LimitedDevice device;
+	try {
+		device.loadProfile(path.c_str());
+		FAIL() << "Expected an invalid profile";
+	} catch (const std::runtime_error& ex) {
+		EXPECT_NE(std::string(ex.what()).find("slave1"), std::string::npos);
+	}
+	std::remove(path.c_str());
+}
+
+TEST(modbus_device, bus_stats) {
+	// Never connected, so every request fails straight away
+	ModbusDeviceRtu device("/dev/null", 9600);
+	uint16_t regs[2];
+	EXPECT_THROW(device.readRegisters(0, 2, regs), ModbusException);
+	EXPECT_THROW(device.readRegisters(0, 2, regs), ModbusException);
+
+	// The second request waited for 3.5 characters of 10 bits
+	auto stats = device.getBusStats();
+	EXPECT_EQ(stats.frames, 2u);
+	EXPECT_EQ(stats.errors, 2u);
+	EXPECT_GE(stats.gapUs, 3000u);
+	EXPECT_LE(stats.gapUs + stats.busyUs, stats.elapsedUs);
+	EXPECT_GT(stats.occupancy(), 0.0);
+
+	device.resetBusStats();
+	stats = device.getBusStats();
+	EXPECT_EQ(stats.frames, 0u);
+	EXPECT_EQ(stats.gapUs, 0u);
+}
+
+TEST(modbus_device, no_gap_over_tcp) {
+	ModbusDeviceTcp device("127.0.0.1", 502);
+	uint16_t regs[2];
+	EXPECT_THROW(device.readRegisters(0, 2, regs), ModbusException);
+	EXPECT_THROW(device.readRegisters(0, 2, regs), ModbusException);
+	EXPECT_EQ(device.getBusStats().frames, 2u);
+	EXPECT_EQ(device.getBusStats().gapUs, 0u);
+}
+
+TEST(modbus_device, pipelines_tcp_reads) {
+	// The server only answers once four requests are in flight
+	ReversingServer server(4);
+	ModbusDeviceTcpPipelined device("127.0.0.1", server.getPort(), 4);
+	device.connect();
+
+	uint16_t regs[8] = {};
+	const ModbusDevice::ReadRange ranges[4] = {{false, false, 10, 2, regs},
+											   {false, false, 20, 2, regs + 2},
+											   {false, false, 30, 2, regs + 4},
+											   {false, false, 40, 2, regs + 6}};
+	device.readRanges(ranges, 4);
+	EXPECT_EQ(regs[0], 10);
+	EXPECT_EQ(regs[1], 11);
+	EXPECT_EQ(regs[6], 40);
+	EXPECT_EQ(regs[7], 41);
+	EXPECT_EQ(device.getBusStats().frames, 4u);
+	EXPECT_EQ(device.getBusStats().errors, 0u);
+
+	device.close();
+}
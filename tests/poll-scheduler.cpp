@@ -0,0 +1,74 @@
+#include "../src/poll-scheduler.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace {
+// Waits up to a second for the condition to hold
+template <typename Condition>
+bool wait_for(Condition condition) {
+	for (int i = 0; i < 1000; ++i) {
+		if (condition()) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return condition();
+}
+}  // namespace
+
+TEST(poll_scheduler, serializes_a_bus) {
+	PollScheduler scheduler(4);
+	const int bus = 0;
+
+	std::atomic<int> inside{0};
+	std::atomic<int> overlaps{0};
+	std::atomic<int> runs{0};
+	const auto task = [&] {
+		if (++inside > 1) {
+			++overlaps;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		--inside;
+		++runs;
+	};
+
+	const auto first = scheduler.add(&bus, std::chrono::milliseconds(1), task);
+	const auto second = scheduler.add(&bus, std::chrono::milliseconds(1), task);
+	EXPECT_EQ(scheduler.getBusCount(), 1u);
+	EXPECT_EQ(scheduler.getWorkerCount(), 1u);
+
+	ASSERT_TRUE(wait_for([&] { return runs >= 10; }));
+	scheduler.remove(first);
+	scheduler.remove(second);
+	EXPECT_EQ(overlaps, 0);
+	EXPECT_EQ(scheduler.getBusCount(), 0u);
+
+	// Nothing runs once removed
+	const int removed = runs;
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	EXPECT_EQ(runs, removed);
+}
+
+TEST(poll_scheduler, runs_buses_in_parallel) {
+	PollScheduler scheduler(4);
+	const int buses[2] = {0, 1};
+
+	// Each task only returns once the other has started, which can't happen
+	// if the buses take turns
+	std::atomic<bool> started[2] = {false, false};
+	std::atomic<bool> met[2] = {false, false};
+	PollScheduler::TaskId ids[2];
+	for (int i = 0; i < 2; ++i) {
+		ids[i] = scheduler.add(&buses[i], std::chrono::milliseconds(1000), [&, i] {
+			started[i] = true;
+			met[i] = wait_for([&] { return started[1 - i].load(); });
+		});
+	}
+	EXPECT_EQ(scheduler.getWorkerCount(), 2u);
+
+	ASSERT_TRUE(wait_for([&] { return met[0] && met[1]; }));
+	scheduler.remove(ids[0]);
+	scheduler.remove(ids[1]);
+}
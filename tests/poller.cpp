@@ -0,0 +1,94 @@
+#include "../src/poller.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include "load-mapping.hpp"
+
+namespace {
+// Answers every read with the number of reads so far
+class CountingDevice : public ModbusDeviceTcp {
+   public:
+	CountingDevice() : ModbusDeviceTcp("127.0.0.1", 502) {}
+
+	unsigned int readRegisters(int, int nb, uint16_t* dest) override {
+		const uint16_t count = static_cast<uint16_t>(++reads);
+		std::fill(dest, dest + nb, count);
+		return nb;
+	}
+
+	std::atomic<int> reads{0};
+};
+
+// Waits for the snapshot to be published after the given time
+int64_t wait_for(const Poller::Snapshot& snapshot,
+				 uint16_t* regs,
+				 int64_t after = 0) {
+	for (int i = 0; i < 1000; ++i) {
+		const int64_t timeMs = snapshot.read(regs);
+		if (timeMs > after) {
+			return timeMs;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return 0;
+}
+}  // namespace
+
+TEST(poller, snapshot) {
+	Poller::Snapshot snapshot(3);
+	uint16_t regs[3] = {7, 7, 7};
+
+	// Nothing published yet
+	EXPECT_EQ(snapshot.read(regs), 0);
+	EXPECT_EQ(regs[0], 0);
+
+	const uint16_t published[3] = {1, 2, 3};
+	snapshot.publish(published, 42);
+	EXPECT_EQ(snapshot.read(regs), 42);
+	EXPECT_EQ(regs[0], 1);
+	EXPECT_EQ(regs[2], 3);
+}
+
+TEST(poller, polls_plans) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 0, "format": "u16", "type": "hold"},
+			"B": {"addr": 1, "format": "u32", "type": "hold"}
+		}
+	})");
+	auto device = std::make_shared<CountingDevice>();
+
+	Poller poller(device);
+	EXPECT_THROW(poller.addPlan(std::make_shared<ReadPlan>(mapping),
+								std::chrono::milliseconds(0)),
+				 std::invalid_argument);
+	EXPECT_EQ(poller.addPlan(std::make_shared<ReadPlan>(mapping),
+							 std::chrono::milliseconds(1)),
+			  0u);
+
+	poller.start();
+	EXPECT_TRUE(poller.isRunning());
+	EXPECT_THROW(poller.addPlan(std::make_shared<ReadPlan>(mapping),
+								std::chrono::milliseconds(1)),
+				 std::runtime_error);
+
+	uint16_t regs[3];
+	const int64_t first = wait_for(poller.getSnapshot(0), regs);
+	ASSERT_GT(first, 0);
+	EXPECT_EQ(regs[0], regs[2]);
+
+	// The plan keeps being polled
+	const int64_t second = wait_for(poller.getSnapshot(0), regs, first);
+	EXPECT_GT(second, first);
+
+	poller.stop();
+	EXPECT_FALSE(poller.isRunning());
+	EXPECT_EQ(poller.getErrorCount(), 0u);
+
+	// Snapshots outlive the thread
+	const int reads = device->reads;
+	EXPECT_GT(poller.getSnapshot(0).read(regs), 0);
+	EXPECT_EQ(device->reads, reads);
+}
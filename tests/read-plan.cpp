@@ -0,0 +1,215 @@
+#include "../src/read-plan.hpp"
+#include <gtest/gtest.h>
+#include <modbus/modbus.h>
+#include <memory>
+#include "load-mapping.hpp"
+
+namespace {
+const char* MAPPING_JSON = R"({
+	"values": {
+		"A": {"addr": 0, "format": "u16", "type": "hold"},
+		"B": {"addr": 1, "format": "u32", "type": "hold"},
+		"C": {"addr": 2, "format": "u16", "type": "hold"},
+		"D": {"addr": 10, "format": "f32", "type": "hold"},
+		"E": {"addr": 0, "format": "u16", "type": "input"},
+		"F": {"addr": 100, "format": "str", "len": 100, "type": "hold"},
+		"G": {"addr": 190, "format": "str", "len": 40, "type": "hold"}
+	}
+})";
+
+// Refuses reads of holding registers spanning an unmapped address
+class GapRefusingDevice : public ModbusDeviceTcp {
+   public:
+	GapRefusingDevice() : ModbusDeviceTcp("127.0.0.1", 502) {}
+
+	unsigned int readRegisters(int addr, int nb, uint16_t* dest) override {
+		++reads;
+		if (addr <= 5 && addr + nb > 5) {
+			throw ModbusException(EMBXILADD);
+		}
+		for (int i = 0; i < nb; ++i) {
+			dest[i] = static_cast<uint16_t>(addr + i);
+		}
+		return static_cast<unsigned int>(nb);
+	}
+
+	int reads = 0;
+};
+}  // namespace
+
+TEST(read_plan, merges_adjacent_and_overlapping) {
+	auto mapping = load_mapping(MAPPING_JSON);
+	ReadPlan plan(mapping, {"C", "A", "B"});
+
+	ASSERT_EQ(plan.getBlocks().size(), 1u);
+	EXPECT_EQ(plan.getBlocks()[0].addr, 0);
+	EXPECT_EQ(plan.getBlocks()[0].length, 3);
+	EXPECT_EQ(plan.getRegisterCount(), 3u);
+
+	ASSERT_EQ(plan.getEntries().size(), 3u);
+	EXPECT_EQ(plan.getEntries()[0].name, "A");
+	EXPECT_EQ(plan.getEntries()[0].offset, 0u);
+	EXPECT_EQ(plan.getEntries()[1].name, "B");
+	EXPECT_EQ(plan.getEntries()[1].offset, 1u);
+	EXPECT_EQ(plan.getEntries()[2].name, "C");
+	EXPECT_EQ(plan.getEntries()[2].offset, 2u);
+}
+
+TEST(read_plan, splits_gaps_and_types) {
+	auto mapping = load_mapping(MAPPING_JSON);
+	ReadPlan plan(mapping, {"A", "D", "E"});
+
+	const auto& blocks = plan.getBlocks();
+	ASSERT_EQ(blocks.size(), 3u);
+	EXPECT_EQ(blocks[0].type, Mapping::ValueDefType::input);
+	EXPECT_EQ(blocks[1].addr, 0);
+	EXPECT_EQ(blocks[1].length, 1);
+	EXPECT_EQ(blocks[2].addr, 10);
+	EXPECT_EQ(blocks[2].length, 2);
+	EXPECT_EQ(blocks[2].offset, 2u);
+	EXPECT_EQ(plan.getRegisterCount(), 4u);
+}
+
+TEST(read_plan, respects_request_limit) {
+	auto mapping = load_mapping(MAPPING_JSON);
+	ReadPlan plan(mapping, {"F", "G"});
+
+	// Merging would need 130 registers, more than a single request allows
+	ASSERT_EQ(plan.getBlocks().size(), 2u);
+	EXPECT_EQ(plan.getRegisterCount(), 140u);
+}
+
+TEST(read_plan, respects_device_limits) {
+	auto mapping = load_mapping(MAPPING_JSON);
+	ModbusDevice::Capabilities caps;
+	caps.maxReadRegisters = 2;
+
+	// A and B would need three registers, B and C overlap in two
+	ReadPlan plan(mapping, {"A", "B", "C"}, 0, caps);
+	ASSERT_EQ(plan.getBlocks().size(), 2u);
+	EXPECT_EQ(plan.getBlocks()[0].length, 1);
+	EXPECT_EQ(plan.getBlocks()[1].addr, 1);
+	EXPECT_EQ(plan.getBlocks()[1].length, 2);
+}
+
+TEST(read_plan, whole_mapping) {
+	auto mapping = load_mapping(MAPPING_JSON);
+	ReadPlan plan(mapping);
+
+	// A-C merge, D, E, F and G are read on their own
+	EXPECT_EQ(plan.getEntries().size(), 7u);
+	EXPECT_EQ(plan.getBlocks().size(), 5u);
+	EXPECT_EQ(plan.getRegisterCount(), 3u + 2u + 1u + 100u + 40u);
+}
+
+TEST(read_plan, bridges_small_gaps) {
+	auto mapping = load_mapping(MAPPING_JSON);
+
+	// The gap between A and D is 9 registers
+	ReadPlan narrow(mapping, {"A", "D"}, 8);
+	EXPECT_EQ(narrow.getBlocks().size(), 2u);
+
+	ReadPlan wide(mapping, {"A", "D"}, 9);
+	ASSERT_EQ(wide.getBlocks().size(), 1u);
+	EXPECT_EQ(wide.getBlocks()[0].length, 12);
+	EXPECT_EQ(wide.getEntries()[1].name, "D");
+	EXPECT_EQ(wide.getEntries()[1].offset, 10u);
+}
+
+TEST(read_plan, skips_unreadable_gaps) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"A": {"addr": 0, "format": "u16", "type": "hold"},
+			"B": {"addr": 4, "format": "u16", "type": "hold"},
+			"C": {"addr": 8, "format": "u16", "type": "hold"}
+		},
+		"unreadable": [
+			{"addr": 6, "type": "hold"}
+		]
+	})");
+	ReadPlan plan(mapping, {"A", "B", "C"}, 4);
+
+	ASSERT_EQ(plan.getBlocks().size(), 2u);
+	EXPECT_EQ(plan.getBlocks()[0].length, 5);
+	EXPECT_EQ(plan.getBlocks()[1].addr, 8);
+	EXPECT_EQ(plan.getRegisterCount(), 6u);
+}
+
+TEST(read_plan, merges_bits) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"ALARM_0": {"addr": 0, "format": "bit", "type": "hold"},
+			"ALARM_1": {"addr": 1, "format": "bit", "type": "hold"},
+			"ALARM_9": {"addr": 9, "format": "bit", "type": "hold"},
+			"ALARM_2000": {"addr": 2000, "format": "bit", "type": "hold"},
+			"INPUT_0": {"addr": 0, "format": "bit", "type": "input"},
+			"REG_0": {"addr": 0, "format": "u16", "type": "hold"}
+		}
+	})");
+
+	// A gap worth one register is worth sixteen bits
+	ReadPlan plan(mapping, 1);
+
+	const auto& blocks = plan.getBlocks();
+	ASSERT_EQ(blocks.size(), 4u);
+	EXPECT_FALSE(blocks[0].bits);
+
+	// Discrete inputs sort before coils
+	EXPECT_TRUE(blocks[1].bits);
+	EXPECT_EQ(blocks[1].type, Mapping::ValueDefType::input);
+
+	// Coils 0 to 9 in one request, coil 2000 is too far away
+	EXPECT_TRUE(blocks[2].bits);
+	EXPECT_EQ(blocks[2].type, Mapping::ValueDefType::holding);
+	EXPECT_EQ(blocks[2].addr, 0);
+	EXPECT_EQ(blocks[2].length, 10);
+	EXPECT_EQ(blocks[3].addr, 2000);
+	EXPECT_EQ(plan.getEntries()[4].name, "ALARM_9");
+	EXPECT_EQ(plan.getEntries()[4].offset, blocks[2].offset + 9);
+}
+
+TEST(read_plan, groups_runs) {
+	auto mapping = load_mapping(R"({
+		"values": {
+			"P1": {"addr": 0, "format": "f32", "type": "input"},
+			"P2": {"addr": 2, "format": "f32", "type": "input"},
+			"P3": {"addr": 4, "format": "f32", "type": "input"},
+			"E1": {"addr": 6, "format": "u32", "type": "input"},
+			"E2": {"addr": 8, "format": "u32", "type": "input", "scale": 0.1},
+			"S1": {"addr": 10, "format": "u16", "type": "input"},
+			"S2": {"addr": 11, "format": "u16", "type": "input"}
+		}
+	})");
+	ReadPlan plan(mapping);
+
+	// E1 and E2 differ in scale, so each is decoded on its own
+	const auto& runs = plan.getRuns();
+	ASSERT_EQ(runs.size(), 2u);
+	EXPECT_EQ(runs[0].first, 0u);
+	EXPECT_EQ(runs[0].count, 3u);
+	EXPECT_EQ(runs[1].first, 5u);
+	EXPECT_EQ(runs[1].count, 2u);
+	EXPECT_FALSE(plan.getEntries()[3].bulk);
+	EXPECT_TRUE(plan.getEntries()[6].bulk);
+}
+
+TEST(read_plan, splits_refused_gaps) {
+	auto mapping = load_mapping(MAPPING_JSON);
+	ReadPlan plan(mapping, {"A", "D"}, 10);
+	ASSERT_EQ(plan.getBlocks().size(), 1u);
+	EXPECT_EQ(plan.getBlocks()[0].partCount, 2u);
+
+	// The bridged read is refused, then A and D are read on their own
+	GapRefusingDevice device;
+	std::vector<uint16_t> regs(plan.getRegisterCount());
+	plan.execute(device, regs.data());
+	EXPECT_EQ(device.reads, 3);
+	EXPECT_EQ(regs[0], 0);
+	EXPECT_EQ(regs[10], 10);
+	EXPECT_EQ(regs[11], 11);
+
+	// And from then on without trying the gap again
+	device.reads = 0;
+	plan.execute(device, regs.data());
+	EXPECT_EQ(device.reads, 2);
+}
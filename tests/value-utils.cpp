@@ -1,5 +1,8 @@
 #include "../src/value-utils.hpp"
 #include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include <vector>
 
 TEST(value_utils, map_byte_order_16) {
 	using namespace value_utils;
@@ -56,6 +59,12 @@ TEST(value_utils, map_byte_order_64) {
 
 	EXPECT_EQ(map_byte_order(value, Mapping::ValueDefOrder::abcdefgh),
 			  0x0123456789ABCDEF);
+	EXPECT_EQ(map_byte_order(value, Mapping::ValueDefOrder::hgfedcba),
+			  0xEFCDAB8967452301);
+	EXPECT_EQ(map_byte_order(value, Mapping::ValueDefOrder::badcfehg),
+			  0x23016745AB89EFCD);
+	EXPECT_EQ(map_byte_order(value, Mapping::ValueDefOrder::ghefcdab),
+			  0xCDEF89AB45670123);
 }
 
 TEST(value_utils, unmap_byte_order_64) {
@@ -65,4 +74,166 @@ TEST(value_utils, unmap_byte_order_64) {
 
 	EXPECT_EQ(unmap_byte_order(value, Mapping::ValueDefOrder::abcdefgh),
 			  0x0123456789ABCDEF);
+	EXPECT_EQ(unmap_byte_order((uint64_t)0xCDEF89AB45670123,
+							   Mapping::ValueDefOrder::ghefcdab),
+			  value);
+
+	for (const auto& entry : BYTE_ORDERS) {
+		EXPECT_EQ(unmap_byte_order(map_byte_order(value, entry.order),
+								   entry.order),
+				  value)
+			<< entry.name;
+	}
+}
+
+TEST(value_utils, unpack_bits) {
+	using namespace value_utils;
+
+	const uint8_t bits[] = {1, 0, 0, 1, 1, 0xFF, 0, 1, 0, 1};
+	uint16_t words[10] = {};
+	unpack_bits(bits, 10, words);
+
+	const uint16_t expected[] = {1, 0, 0, 1, 1, 1, 0, 1, 0, 1};
+	for (int i = 0; i < 10; ++i) {
+		EXPECT_EQ(words[i], expected[i]) << "bit " << i;
+	}
+}
+
+TEST(value_utils, unpack_bits_msb) {
+	using namespace value_utils;
+
+	const uint8_t bits[] = {0x99, 0x40};
+	uint16_t words[10] = {};
+	unpack_bits_msb(bits, 10, words);
+
+	const uint16_t expected[] = {1, 0, 0, 1, 1, 0, 0, 1, 0, 1};
+	for (int i = 0; i < 10; ++i) {
+		EXPECT_EQ(words[i], expected[i]) << "bit " << i;
+	}
+}
+
+TEST(value_utils, unpack_bytes) {
+	using namespace value_utils;
+
+	// Long enough to go through the vector shuffles and a partial tail
+	std::vector<uint16_t> regs(21);
+	for (size_t i = 0; i < regs.size(); ++i) {
+		regs[i] = static_cast<uint16_t>(('A' + i) << 8 | ('a' + i));
+	}
+
+	char ab[42];
+	unpack_bytes(regs.data(), regs.size(), true, ab);
+	char ba[42];
+	unpack_bytes(regs.data(), regs.size(), false, ba);
+	for (size_t i = 0; i < regs.size(); ++i) {
+		EXPECT_EQ(ab[i * 2], 'A' + static_cast<int>(i));
+		EXPECT_EQ(ab[i * 2 + 1], 'a' + static_cast<int>(i));
+		EXPECT_EQ(ba[i * 2], 'a' + static_cast<int>(i));
+		EXPECT_EQ(ba[i * 2 + 1], 'A' + static_cast<int>(i));
+	}
+}
+
+TEST(value_utils, pack_bytes) {
+	using namespace value_utils;
+
+	const char* str = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefg";
+	const size_t size = strlen(str);
+
+	std::vector<uint16_t> ab((size + 1) / 2);
+	pack_bytes(str, size, true, ab.data());
+	EXPECT_EQ(ab[0], 0x4142);
+	EXPECT_EQ(ab.back(), 0x6700);
+
+	std::vector<uint16_t> ba((size + 1) / 2);
+	pack_bytes(str, size, false, ba.data());
+	EXPECT_EQ(ba[0], 0x4241);
+	EXPECT_EQ(ba.back(), 0x0067);
+
+	std::vector<char> unpacked(ab.size() * 2);
+	unpack_bytes(ab.data(), ab.size(), true, unpacked.data());
+	EXPECT_EQ(std::string(unpacked.data(), size), str);
+}
+
+TEST(value_utils, decode_array_matches_scalar) {
+	using namespace value_utils;
+
+	// Enough values to go through the vector loop and the scalar tail
+	const size_t count = 150;
+	std::vector<uint16_t> regs(count * 2);
+	for (size_t i = 0; i < regs.size(); ++i) {
+		regs[i] = static_cast<uint16_t>(i * 0x0F1D + 0x1234);
+	}
+
+	for (const auto order :
+		 {Mapping::ValueDefOrder::abcd, Mapping::ValueDefOrder::dcba,
+		  Mapping::ValueDefOrder::badc, Mapping::ValueDefOrder::cdab}) {
+		std::vector<double> values(count);
+		decode_array(regs.data(), count, Mapping::ValueDefFormat::i32, order,
+					 1.0, values.data());
+
+		for (size_t i = 0; i < count; ++i) {
+			const uint32_t raw = (static_cast<uint32_t>(regs[i * 2]) << 16) |
+								 regs[i * 2 + 1];
+			const int32_t expected =
+				static_cast<int32_t>(map_byte_order(raw, order));
+			ASSERT_EQ(values[i], expected) << "value " << i;
+		}
+	}
+}
+
+TEST(value_utils, decode_array_16) {
+	using namespace value_utils;
+
+	const uint16_t regs[] = {0x1234, 0xFFFE, 0x8000};
+	double values[3];
+
+	decode_array(regs, 3, Mapping::ValueDefFormat::i16,
+				 Mapping::ValueDefOrder::ab, 1.0, values);
+	EXPECT_EQ(values[0], 0x1234);
+	EXPECT_EQ(values[1], -2);
+	EXPECT_EQ(values[2], -32768);
+
+	decode_array(regs, 3, Mapping::ValueDefFormat::u16,
+				 Mapping::ValueDefOrder::ba, 1.0, values);
+	EXPECT_EQ(values[0], 0x3412);
+	EXPECT_EQ(values[1], 0xFEFF);
+	EXPECT_EQ(values[2], 0x0080);
+}
+
+TEST(value_utils, decode_array_scaled) {
+	using namespace value_utils;
+
+	// Integers are truncated after scaling
+	const uint16_t ints[] = {25, 0xFFE7};
+	double values[2];
+	decode_array(ints, 2, Mapping::ValueDefFormat::i16,
+				 Mapping::ValueDefOrder::ab, 0.1, values);
+	EXPECT_EQ(values[0], 2);
+	EXPECT_EQ(values[1], -2);
+
+	// Floats stay single precision
+	const float f = 1.5f;
+	uint32_t raw;
+	memcpy(&raw, &f, sizeof(raw));
+	const uint16_t floats[] = {static_cast<uint16_t>(raw >> 16),
+							   static_cast<uint16_t>(raw)};
+	decode_array(floats, 1, Mapping::ValueDefFormat::f32,
+				 Mapping::ValueDefOrder::abcd, 0.1, values);
+	EXPECT_EQ(values[0], static_cast<double>(static_cast<float>(1.5 * 0.1)));
+}
+
+TEST(value_utils, decode_array_64) {
+	using namespace value_utils;
+
+	const double d = -1234.5678;
+	uint64_t raw;
+	memcpy(&raw, &d, sizeof(raw));
+	const uint16_t regs[] = {
+		static_cast<uint16_t>(raw >> 48), static_cast<uint16_t>(raw >> 32),
+		static_cast<uint16_t>(raw >> 16), static_cast<uint16_t>(raw)};
+
+	double value;
+	decode_array(regs, 1, Mapping::ValueDefFormat::f64,
+				 Mapping::ValueDefOrder::abcdefgh, 1.0, &value);
+	EXPECT_EQ(value, d);
 }